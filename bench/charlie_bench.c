@@ -0,0 +1,394 @@
+//
+// charlie_bench: times the editor's own code on generated files.
+//
+//  > charlie_bench [--csv] [--iterations N] [--huge GB]
+//
+// results go to stdout as JSON (or CSV), one entry per case, times in milliseconds.
+// --huge also opens, edits and saves a file of that many GB once, half of it on one line. it wants
+// about twice that much memory, so it is not run unless asked for.
+//
+
+#define CHARLIE_NO_MAIN
+#include "../charlie.c"
+
+#define BENCH_ITERATIONS 5
+#define BENCH_MAX_RESULTS 64
+
+struct benchResult {
+	char name[64];
+	int iterations;
+	double best;
+	double mean;
+	double worst;
+	long long bytes; // what one iteration went through, 0 when that makes no sense.
+};
+
+struct benchResult g_results[BENCH_MAX_RESULTS];
+int g_numberResults = 0;
+int g_iterations = BENCH_ITERATIONS;
+char g_benchDirectory[] = "/tmp/charlie-bench-XXXXXX";
+
+static double benchMilliseconds(void) {
+	return monotonicMicroseconds() / 1000.0;
+}
+
+// the active buffer goes back to an empty, nameless one, so editorOpen() loads into it again.
+static void benchFresh(void) {
+	bufferRelease();
+	bufferReset();
+	return;
+}
+
+// 'line_length' wide lines of C-looking text, so the highlighter has some work to do.
+static char *benchGenerate(const char *name, int lines, int line_length, long long *bytes) {
+	static const char *words[] = { "int", "return", "value", "0x1f", "\"text\"", "if", "42", "struct", "//", "buffer" };
+	char *path = malloc(strlen(g_benchDirectory) + strlen(name) + 2);
+	sprintf(path, "%s/%s", g_benchDirectory, name);
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL) error("fopen");
+	char *line = malloc(line_length + 1);
+	unsigned int seed = 1;
+	for (int i = 0; i < lines; i++) {
+		int length = 0;
+		line[length++] = '\t';
+		while (length < line_length) {
+			seed = seed * 1103515245 + 12345;
+			const char *word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+			int word_length = strlen(word);
+			if (length + word_length + 1 > line_length) break;
+			memcpy(&line[length], word, word_length);
+			length += word_length;
+			line[length++] = ' ';
+		}
+		fwrite(line, 1, length, file);
+		fputc('\n', file);
+	}
+	fputs("\tneedle\n", file); // the one thing the search benchmarks find, as far as it gets.
+	*bytes = ftell(file);
+	fclose(file);
+	free(line);
+	return path;
+}
+
+static void benchRecord(const char *name, double *times, long long bytes) {
+	if (g_numberResults == BENCH_MAX_RESULTS) return;
+	struct benchResult *result = &g_results[g_numberResults++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->iterations = g_iterations;
+	result->bytes = bytes;
+	result->best = result->worst = times[0];
+	result->mean = 0.0;
+	for (int i = 0; i < g_iterations; i++) {
+		if (times[i] < result->best)  result->best = times[i];
+		if (times[i] > result->worst) result->worst = times[i];
+		result->mean += times[i] / g_iterations;
+	}
+	fprintf(stderr, "%-32s %10.3f ms\n", name, result->mean);
+	return;
+}
+
+static void benchOpen(const char *name, const char *path, long long bytes) {
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		benchFresh();
+		double start = benchMilliseconds();
+		editorOpen(path);
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord(name, times, bytes);
+	return;
+}
+
+static void benchInsert(void) {
+	const int lines = 2000, columns = 64;
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		benchFresh();
+		double start = benchMilliseconds();
+		for (int y = 0; y < lines; y++) {
+			for (int x = 0; x < columns; x++)
+				insertChar('a' + (x + y) % 26);
+			insertNewLine();
+		}
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("insert_chars_2000x64", times, (long long)lines * (columns + 1));
+	return;
+}
+
+// full frames while paging through the file, everything but the write to a terminal.
+static void benchRender(const char *path) {
+	const int frames = 500;
+	benchFresh();
+	editorOpen(path);
+
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		g_Configuration.cursorY = 0;
+		double start = benchMilliseconds();
+		for (int frame = 0; frame < frames; frame++) {
+			g_Configuration.cursorY = (g_Configuration.cursorY + g_Configuration.screenRows) % g_Configuration.numberRows;
+			refreshScreen();
+		}
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("refresh_screen_500_frames", times, (long long)g_headless.frame.length * frames);
+	return;
+}
+
+static void benchFind(const char *name, const char *path, char *query) {
+	benchFresh();
+	editorOpen(path);
+
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		g_Configuration.cursorX = g_Configuration.cursorY = 0;
+		double start = benchMilliseconds();
+		findCallback(query, 0);
+		times[i] = benchMilliseconds() - start;
+		findCallback(query, '\r');
+	}
+	benchRecord(name, times, 0);
+	return;
+}
+
+// half of the file killed and yanked back: one splice of the row array each way, whatever the size.
+static void benchKill(const char *path) {
+	const int lines = 100000;
+	benchFresh();
+	editorOpen(path);
+
+	double kill_times[g_iterations], yank_times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		g_Configuration.cursorX = g_Configuration.markX = 0;
+		g_Configuration.cursorY = lines;
+		g_Configuration.markY = 0;
+		g_Configuration.markSet = 1;
+		double start = benchMilliseconds();
+		regionKill();
+		kill_times[i] = benchMilliseconds() - start;
+		start = benchMilliseconds();
+		yank();
+		yank_times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("kill_region_100000_lines", kill_times, 0);
+	benchRecord("yank_100000_lines", yank_times, 0);
+	return;
+}
+
+// a four key macro (to the start of the line, two characters, next line) run once per line.
+static void benchMacro(const char *path) {
+	const int runs = 10000;
+	int keys[] = { HOME, '/', '/', DOWN };
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		benchFresh();
+		editorOpen(path);
+		free(g_macro.keys);
+		g_macro.keys = malloc(sizeof(keys));
+		memcpy(g_macro.keys, keys, sizeof(keys));
+		g_macro.length = g_macro.capacity = sizeof(keys) / sizeof(keys[0]);
+		double start = benchMilliseconds();
+		macroRun(runs);
+		refreshScreen();
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("macro_replay_10000_runs", times, 0);
+	return;
+}
+
+static void benchSortLines(const char *path) {
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		benchFresh();
+		editorOpen(path);
+		double start = benchMilliseconds();
+		sortLines();
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("sort_lines_200000", times, 0);
+	return;
+}
+
+static void benchSyntax(const char *path, long long bytes) {
+	benchFresh();
+	editorOpen(path);
+
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		double start = benchMilliseconds();
+		for (int y = 0; y < g_Configuration.numberRows; y++)
+			updateSyntax(&g_Configuration.rows[y]);
+		times[i] = benchMilliseconds() - start;
+	}
+	benchRecord("update_syntax_c_100000_lines", times, bytes);
+	return;
+}
+
+static void benchSave(const char *path, long long bytes) {
+	benchFresh();
+	editorOpen(path);
+	free(g_Configuration.filename);
+	g_Configuration.filename = malloc(strlen(g_benchDirectory) + sizeof("/saved.c"));
+	sprintf(g_Configuration.filename, "%s/saved.c", g_benchDirectory);
+
+	double times[g_iterations];
+	for (int i = 0; i < g_iterations; i++) {
+		double start = benchMilliseconds();
+		save();
+		times[i] = benchMilliseconds() - start;
+	}
+	unlink(g_Configuration.filename);
+	benchRecord("save_100000_lines", times, bytes);
+	return;
+}
+
+// one row of half the file, then short lines up to 'gigabytes': past 4 GB the file and past 2 GB the row
+// stop fitting in an int. the edits at both ends of the long row and at the end of the file must land
+// where they should, so the saved file is checked and not only timed.
+static int benchHuge(long long gigabytes) {
+	long long total = gigabytes << 30, long_length = total / 2;
+	long long memory = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	if (memory > 0 && memory < total * 2) {
+		fprintf(stderr, "huge: skipped, %lld GB wants about %lld GB of memory\n", gigabytes, gigabytes * 2);
+		return 0;
+	}
+	char *path = malloc(strlen(g_benchDirectory) + sizeof("/huge.txt"));
+	sprintf(path, "%s/huge.txt", g_benchDirectory);
+	FILE *file = fopen(path, "w");
+	if (file == NULL) error("fopen");
+	char *block = malloc(1 << 20), line[100];
+	memset(block, 'b', 1 << 20);
+	for (long long written = 0; written < long_length; written += 1 << 20)
+		fwrite(block, 1, long_length - written < (1 << 20) ? long_length - written : (1 << 20), file);
+	fputc('\n', file);
+	free(block);
+	memset(line, 'b', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\n';
+	long long bytes = long_length + 1;
+	for (; bytes < total; bytes += sizeof(line))
+		fwrite(line, 1, sizeof(line), file);
+	if (fclose(file) != 0) error("fclose");
+
+	int saved_iterations = g_iterations;
+	g_iterations = 1;
+	double times[1];
+	benchFresh();
+	double start = benchMilliseconds();
+	editorOpen(path);
+	loadWait();
+	times[0] = benchMilliseconds() - start;
+	benchRecord("huge_open", times, bytes);
+
+	int failed = g_Configuration.bufferType == BT_VIEW || g_Configuration.numberRows < 2 ||
+				 (long long)g_Configuration.rows[0].size != long_length;
+	if (!failed) {
+		g_Configuration.cursorY = 0;
+		g_Configuration.cursorX = 0;
+		insertChar('<');
+		g_Configuration.cursorX = g_Configuration.rows[0].size;
+		insertChar('>');
+		g_Configuration.cursorY = g_Configuration.numberRows - 1;
+		g_Configuration.cursorX = g_Configuration.rows[g_Configuration.cursorY].size;
+		insertChar('!');
+
+		free(g_Configuration.filename);
+		g_Configuration.filename = malloc(strlen(g_benchDirectory) + sizeof("/huge-saved.txt"));
+		sprintf(g_Configuration.filename, "%s/huge-saved.txt", g_benchDirectory);
+		start = benchMilliseconds();
+		save();
+		times[0] = benchMilliseconds() - start;
+		benchRecord("huge_save", times, bytes + 3);
+
+		// '<' first, '>' right before the long row's newline, '!' before the very last one.
+		struct stat saved_stat;
+		char head, middle[2], tail[2];
+		int fd = open(g_Configuration.filename, O_RDONLY);
+		failed = fd == -1 || fstat(fd, &saved_stat) == -1 || saved_stat.st_size != bytes + 3 ||
+				 pread(fd, &head, 1, 0) != 1 || pread(fd, middle, 2, long_length + 1) != 2 ||
+				 pread(fd, tail, 2, saved_stat.st_size - 2) != 2 ||
+				 head != '<' || memcmp(middle, ">\n", 2) != 0 || memcmp(tail, "!\n", 2) != 0;
+		if (fd != -1) close(fd);
+		unlink(g_Configuration.filename);
+	}
+	benchFresh();
+	unlink(path);
+	free(path);
+	g_iterations = saved_iterations;
+	if (failed) fprintf(stderr, "huge: the saved file is not what was edited\n");
+	return failed ? -1 : 0;
+}
+
+static void benchPrint(int csv) {
+	if (csv) {
+		printf("name,iterations,best_ms,mean_ms,worst_ms,bytes,mb_per_s\n");
+		for (int i = 0; i < g_numberResults; i++) {
+			struct benchResult *result = &g_results[i];
+			printf("%s,%d,%.3f,%.3f,%.3f,%lld,%.1f\n", result->name, result->iterations, result->best, result->mean, result->worst,
+				   result->bytes, result->bytes && result->best > 0 ? result->bytes / result->best / 1000.0 : 0.0);
+		}
+		return;
+	}
+	printf("{\n  \"version\": \"%s\",\n  \"results\": [\n", VERSION);
+	for (int i = 0; i < g_numberResults; i++) {
+		struct benchResult *result = &g_results[i];
+		printf("    { \"name\": \"%s\", \"iterations\": %d, \"best_ms\": %.3f, \"mean_ms\": %.3f, \"worst_ms\": %.3f, \"bytes\": %lld, \"mb_per_s\": %.1f }%s\n",
+			   result->name, result->iterations, result->best, result->mean, result->worst, result->bytes,
+			   result->bytes && result->best > 0 ? result->bytes / result->best / 1000.0 : 0.0,
+			   i + 1 < g_numberResults ? "," : "");
+	}
+	printf("  ]\n}\n");
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	int csv = 0;
+	long long huge = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--csv") == 0) csv = 1;
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) g_iterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--huge") == 0 && i + 1 < argc) huge = atoll(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [--csv] [--iterations N] [--huge GB]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (g_iterations < 1) g_iterations = 1;
+	if (mkdtemp(g_benchDirectory) == NULL) error("mkdtemp");
+
+	// rendering goes to the in-memory frame of the headless mode.
+	g_headless.active = 1;
+	g_headless.frames = -1;
+	g_headless.cols = 120;
+	g_headless.rows = 40;
+	g_doBackups = false;
+	init();
+
+	long long small_bytes, wide_bytes, large_bytes, source_bytes;
+	char *small = benchGenerate("small.txt", 10000, 40, &small_bytes);
+	char *wide = benchGenerate("wide.txt", 10000, 2000, &wide_bytes);
+	char *large = benchGenerate("large.txt", 200000, 80, &large_bytes);
+	char *source = benchGenerate("source.c", 100000, 80, &source_bytes);
+
+	benchOpen("open_10000x40", small, small_bytes);
+	benchOpen("open_10000x2000", wide, wide_bytes);
+	benchOpen("open_200000x80", large, large_bytes);
+	benchOpen("open_c_100000x80", source, source_bytes);
+	benchInsert();
+	benchRender(source);
+	benchFind("find_hit_200000_lines", large, "needle");
+	benchFind("find_miss_200000_lines", large, "not in there");
+	benchKill(large);
+	benchMacro(source);
+	benchSortLines(large);
+	benchSyntax(source, source_bytes);
+	benchSave(source, source_bytes);
+	int failed = huge > 0 && benchHuge(huge) != 0;
+
+	unlink(small); unlink(wide); unlink(large); unlink(source);
+	rmdir(g_benchDirectory);
+	free(small); free(wide); free(large); free(source);
+	benchPrint(csv);
+	return failed ? 1 : 0;
+}
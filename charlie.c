@@ -8,32 +8,87 @@
 #define _GNU_SOURCE
 
 #include <termios.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <time.h>
+#include <poll.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
 
 #include <libgen.h>
+#include <dirent.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <regex.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define BACKUP_NECESSARY_CHARACTERS 512
 #define BACKUP_STRING ".backup"
+#define CACHE_EXTENSION ".lines"
+#define CACHE_MAGIC "CHRLIDX1"
+#define CACHE_MIN_BYTES (1 << 20) // smaller files load faster than the cache can be checked.
 #define COLUMN_SYMBOL ""
 #define VERSION "0.0.6"
 #define QUIT_TIMES 1
+#define STATUS_MESSAGE_SECONDS 5
+#define BACKUP_IDLE_SECONDS 30 // a pending backup is also taken after that long without edits.
+#define INPUT_BUFFER_SIZE 4096
+#define ESCAPE_TIMEOUT 50 // ms to wait for the rest of an escape sequence.
+#define MAX_WATCHERS 16
 #define TAB_STOP 4
 
+#define SEARCH_PARALLEL_ROWS 65536 // below that a plain loop on the UI thread is faster than waking the pool.
+#define SEARCH_CHUNK_ROWS 4096
+#define LINES_PARALLEL_ROWS 65536 // sorting and matching fewer lines than that is not worth the pool.
+#define GREP_BINARY_PROBE 8000 // same heuristic as GNU grep: a NUL byte in the head means binary.
+#define GREP_LINE_LIMIT 256
+#define GREP_BUFFER "*grep*"
+#define BUFFERS_BUFFER "*buffers*"
+#define MEMORY_BUFFER "*memory*"
+#define SHELL_BUFFER "*shell*"
+#define SHELL_READ_SIZE 4096
+#define FILTER_READ_SIZE 65536
+#define WRITE_CHUNK_BYTES (1 << 20) // saving writes the rows in pieces of about that size.
+#define FILTER_ERROR_SIZE 256
+#define REPLACE_GROUPS 10
+#define KILL_RING_SIZE 16
+#define COMMAND_TABLE_SIZE 128 // power of two, kept well above the number of commands.
+#define COMMAND_HISTORY 32
+#define COMMAND_CANDIDATES 64
+#define LOAD_BACKGROUND_BYTES (8 << 20) // files from this size up are read by the loader thread.
+#define LOAD_READ_SIZE (1 << 20)
+#define LOAD_FIRST_BATCH 256 // small, so the first screen shows up right away.
+#define LOAD_BATCH_ROWS 65536
+#define COMPACT_MARGIN 256 // rows kept rendered above and below the screen when compacting.
+#define TRACE_EVENTS 65536 // power of two, the oldest events are overwritten past that.
+#define TRACE_DEFAULT_PATH "charlie-trace.json"
+#define DIFF_MAX_EDITS 4096 // past that many changed lines the reload just replaces the whole middle.
+#define MAX_WATCHED_CHANGES 64
+#define VIEW_CHECKPOINT_LINES 4096 // the viewer's index keeps where every that many lines starts.
+#define VIEW_WINDOW_ROWS 4096      // rows of a viewed file in memory, around the cursor.
+#define VIEW_MARGIN 1024           // the window moves once the cursor is that close to one of its ends.
+#define VIEW_MAP_BYTES (16 << 20)
+#define VIEW_REPORT_BYTES (256 << 20)
+
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define ABUF_INIT { NULL, 0 }
+#define ABUF_INIT { NULL, 0, 0 }
 
 #define HIGHLIGHT_NUMBERS (1<<0)
 #define HIGHLIGHT_STRINGS (1<<1)
@@ -43,13 +98,32 @@
 // \------------------------|-----------------------/
 
 
+// one per tab in the row: where it is in chars and the render column it starts at.
+struct columnStop {
+	size_t charsX;
+	size_t renderX;
+};
+// one per grapheme cluster of a row that is not plain ASCII: where it starts in chars, in render and on screen.
+struct cellStop {
+	size_t charsX;
+	size_t renderX;
+	size_t column;
+};
+
 typedef struct editorRow {
     char *render;
     char *chars;
-    int rsize;
-    int size;
+    size_t rsize;
+    size_t size;
 	
 	unsigned char *highlight;
+	
+	struct columnStop *columns; // built on demand by rowColumnIndex(), dropped by updateRow().
+	ssize_t numberColumns;      // -1 while there is no index.
+	
+	int ascii;                  // 0 until rowIsAscii() looks, then 1 for plain ASCII and -1 for anything else.
+	struct cellStop *cells;     // non-ASCII rows only, built by rowRender() or on demand. one more at the end of the row.
+	size_t numberCells;
 } ROW;
 
 struct langSyntax {
@@ -67,6 +141,21 @@ enum PROMPT_COMMANDS {
 	PC_GOTO,
 	PC_SAVE,
 	PC_SHELL,
+	PC_GREP,
+	PC_REPLACE,
+	PC_BUFFER,
+	PC_BUDGET,
+	PC_MACRO,
+	PC_LINES,
+};
+
+enum BUFFER_TYPES {
+	BT_FILE = 0,
+	BT_GREP,
+	BT_BUFFERS,
+	BT_SHELL,
+	BT_MEMORY,
+	BT_VIEW,
 };
 
 enum HIGHLIGHTS {
@@ -97,6 +186,9 @@ enum KEYS {
     DELETE      ,
     HOME        ,
     END         ,
+	
+	COPY_REGION , // M-w
+	YANK_POP    , // M-y
 };
 
 struct editorConfig {
@@ -104,41 +196,399 @@ struct editorConfig {
     int screenRows;
     int screenCols;
     
-    int cursorX, cursorY;
-    int renderX;
+    size_t cursorX;
+    int cursorY;
+    size_t renderX;
     
     int rowsOff;
-    int colsOff;
+    size_t colsOff;
     
     int numberRows;
     
     time_t statusMessageTime;
-    char statusMessage[80];
+    char statusMessage[256];
     int dirty;
     
     char *filename;
     ROW *rows;
 	
-	int markX;
+	size_t markX;
 	int markY;
+	int markSet;
+	int partial; // only part of the file is in: still loading, or the load was cancelled.
+	
+	int watch;                 // inotify watch on the file, -1 when there is none.
+	struct timespec diskTime;  // what the file on disk looked like when we last read or wrote it.
+	off_t diskSize;
+	int diskChanged;           // changed on disk while the buffer had edits of its own.
+	
+	int follow;                // new lines written to the file are appended as they come, see followRead().
+	int followFd;
+	int followDirectory;       // watch on the directory, where a rotated file comes back.
+	off_t followOffset;        // everything before it is in the buffer already.
+	int followTail;            // the last row is a line that has no '\n' yet.
+	
+	struct codec *codec;       // the file is compressed in that format, NULL when it is not.
 	
+	struct viewIndex *view;    // read-only viewer: the rows are only a window of the file, see viewLoad().
+	long long viewFirst;       // line of the file in rows[0].
+	
+	int bufferType;
 	struct langSyntax *syntax;
 };
 
 struct ABUF {
     char *buffer;
-    int length;
+    size_t length;
+    size_t capacity;
+};
+
+// the frame being written by the render thread plus, at most, the next one waiting for it.
+struct renderHandoff {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	
+	struct ABUF pending;
+	int hasPending;
+	int writing;
+	int started;
+	long skippedFrames;
+};
+
+// on-disk cache of a file's line index and highlight, see cacheLoad().
+// the header is followed by one cacheLine per row and then every row's highlight, back to back.
+struct cacheHeader {
+	char magic[8];
+	char version[16];
+	char filetype[16];
+	uint32_t tabStop;
+	uint32_t reserved;
+	uint64_t fileSize;
+	int64_t mtimeSeconds;
+	int64_t mtimeNanoseconds;
+	uint64_t contentHash;
+	uint64_t numberRows;
+	uint64_t highlightBytes;
+};
+
+struct cacheLine {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// checkpoints of a file too big to be loaded, built by viewIndexer().
+struct viewIndex {
+	int fd;
+	off_t size;
+	off_t *checkpoints; // where lines 0, VIEW_CHECKPOINT_LINES, 2 * VIEW_CHECKPOINT_LINES... start.
+	long long numberCheckpoints;
+	long long capacity;
+	long long lines;    // all of them, once done.
+	int done;           // 1 when indexed, -1 if reading failed.
+	int announced;
+	atomic_llong indexed;
+	atomic_int cancel;
+	pthread_t thread;
+	pthread_mutex_t lock;
+};
+
+// rows [oldStart, oldStart + oldCount) of the buffer become lines [newStart, newStart + newCount) on disk.
+struct diffHunk {
+	int oldStart, oldCount;
+	int newStart, newCount;
+};
+
+// a row's highlight put aside while a match is painted over it. the watchers run while the next key is
+// waited for and may reload or grow the rows, so it only goes back on a row that still has the same text.
+struct savedHighlight {
+	int line;
+	unsigned char *highlight;
+	size_t rsize;
+	char *chars;
+	size_t size;
+};
+
+// a compressed format, handled by piping through its usual command line tool.
+struct codec {
+	const char *extension;
+	const char *magic;
+	size_t magicLength;
+	const char *decompress;
+	const char *compress;
+};
+
+struct command {
+	const char *name;
+	void (*handler)(void);
+	int alias;
+};
+
+// where the last kill or yank left the cursor. the next command continues it (a kill adds to the same
+// entry, yank-pop swaps the yanked text) only if nothing was edited and the cursor hasn't moved since.
+struct killSpot {
+	int buffer; // -1 when there is nothing to continue.
+	int dirty;
+	int startY, endY;
+	size_t startX, endX;
+};
+
+// killed and copied text, shared by all buffers. 'first' is the newest entry.
+struct killRing {
+	char *texts[KILL_RING_SIZE];
+	size_t lengths[KILL_RING_SIZE];
+	int first;
+	int count;
+	int yankIndex; // entries back from 'first' the last yank or yank-pop took.
+	struct killSpot killed;
+	struct killSpot yanked;
+};
+
+// C-x ( ... C-x ): the keys readKey() returned in between, fed back to keyPress() by C-x e.
+struct keyMacro {
+	int *keys;
+	int length;
+	int capacity;
+	int position;  // next key to replay.
+	int recording;
+	int replaying;
+	int searchMissed; // the last search of the replay found nothing.
+	int searched;     // a search ran in the replay, so it has something to stop at.
+	int stopped;      // MS_*, why the replay ends early.
+};
+
+// the one background shell command, its output streamed into *shell*.
+struct shellJob {
+	pid_t pid;     // 0 when nothing is running.
+	int output;    // -1 once the pipe reached EOF.
+	int status;
+	int exited;
+	struct ABUF partial;
+};
+
+// CHARLIE_HEADLESS: no terminal, keys come from a script and the frames go to memory or a file.
+struct headlessRun {
+	int active;
+	int rows, cols;
+	
+	unsigned char *script;
+	size_t scriptLength;
+	size_t scriptOffset;
+	size_t *breaks;      // offsets where a timed read (the rest of an escape sequence) runs out.
+	int numberBreaks;
+	int nextBreak;
+	
+	int frames;          // where the frames are written, -1 keeps only the last one in memory.
+	struct ABUF frame;
+	long frameCount;
+	long long frameBytes;
+	long long renderTime;
+	
+	long long startTime; // all times in microseconds.
+	long long keyStart;
+	long long *latencies;
+	int numberKeys;
+	int capacityKeys;
+};
+
+// rows read by the loader thread and not in the buffer yet.
+struct loadBatch {
+	ROW *rows;
+	struct cacheLine *lines; // where each row is in the file, only kept when the file is going to be cached.
+	int count;
+	int capacity;
+	struct loadBatch *next;
+};
+
+// the one file being read in the background, see loadPoll().
+struct loadJob {
+	char *path;
+	int fd;
+	struct stat fileStat;
+	int cacheable;
+	struct cacheLine *lines;
+	int gotoLine;  // where to put the cursor once it's read, -1 for nowhere.
+	pid_t codec;   // decompressing into 'fd', 0 when it is the file itself.
+	
+	pthread_t thread;
+	int joined;
+	pthread_mutex_t lock;
+	struct loadBatch *batches;
+	struct loadBatch **batchesTail;
+	int finished;
+	int failed;    // errno of what stopped the worker.
+	int notify[2];
+	
+	atomic_int cancel;
+	atomic_llong bytesRead;
+};
+
+struct traceEvent {
+	const char *name;
+	long long start;    // microseconds, CLOCK_MONOTONIC.
+	long long duration;
+	int thread;
+	atomic_ulong sequence;
+};
+
+struct traceRing {
+	atomic_int enabled;
+	atomic_ulong next;
+	char *path;
+	struct traceEvent events[TRACE_EVENTS];
+};
+
+struct watcher {
+	int fd;
+	int (*callback)(void); // returns 1 when the screen has to be repainted.
+};
+
+struct poolTask {
+	void (*function)(void *);
+	void *argument;
+	struct poolTask *next;
+};
+
+struct threadPool {
+	pthread_t *threads;
+	int numberThreads;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct poolTask *head;
+	struct poolTask *tail;
+};
+
+// a set of pool tasks waited for as a whole.
+struct poolBatch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+};
+struct poolBatchTask {
+	struct poolBatch *batch;
+	void (*function)(void *);
+	void *argument;
+};
+
+// one piece of sort-lines: sorts rows [from, to) of 'source' (with 'target' as scratch), or merges
+// the sorted runs [from, middle) and [middle, to) of 'source' into 'target'.
+struct sortTask {
+	ROW **source;
+	ROW **target;
+	int from, middle, to;
+	int merge;
+};
+
+// keep-lines and delete-lines: which of rows [from, to) match, from matches[0] on, each task with its own copy of the
+// regex since glibc's regexec() locks a compiled one.
+struct linesTask {
+	regex_t compiled;
+	int from, to;
+	unsigned char *matches;
+};
+
+enum MACRO_STOPS {
+	MS_NONE = 0,
+	MS_SEARCH, // a search found nothing or went back up.
+	MS_KEYS,   // a prompt wanted more keys than were recorded.
+	MS_NO_SEARCH, // run until a search fails, but there is no search.
+	MS_INPUT,  // a key was typed while it ran.
+};
+
+enum SEARCH_CHUNK_STATES {
+	SC_PENDING = 0,
+	SC_MISS,
+	SC_HIT,
+};
+
+struct grepItem {
+	char *path;
+	int isDirectory;
+	struct grepItem *next;
+};
+
+struct grepResult {
+	char *line;
+	struct grepResult *next;
+};
+
+struct grepJob {
+	char *query;
+	size_t queryLength;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct grepItem *pending;
+	int busyWorkers;
+	int runningWorkers;
+	// its own threads, not the pool's: a walk of a big tree would keep searches and sorts waiting.
+	pthread_t *threads;
+	int numberThreads;
+	
+	struct grepResult *results;
+	struct grepResult **resultsTail;
+	int notify[2];
+	
+	atomic_int cancel;
+	atomic_long filesSearched;
+	long matches;
+};
+
+struct replacer {
+	char *query;
+	size_t queryLength;
+	char *replacement;
+	size_t replacementLength;
+	
+	int regex;
+	regex_t compiled;
+};
+
+struct searchChunk {
+	int state;
+	int row;
+	ssize_t offset;
+};
+
+// whole-buffer search split in chunks of rows ordered by distance from the starting row,
+// so the first chunk with a hit (all the previous ones being misses) is the nearest match.
+struct searchJob {
+	const char *query;
+	size_t queryLength;
+	int start;
+	int direction;
+	int numberRows;
+	
+	int numberChunks;
+	struct searchChunk *chunks;
+	atomic_int nextChunk;
+	atomic_int limitChunk;
+	atomic_int cancel;
+	int runningWorkers;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
 };
 
-int rowCxToRx(ROW *row, int cursorX );
-int rowRxToCx(ROW *row, int renderX );
-char *rowsToString(int *bufferLength);
+void rowColumnIndex(ROW *row);
+int textIsAscii(const char *text, size_t length);
+int rowIsAscii(ROW *row);
+int codepointWidth(uint32_t codepoint);
+size_t rowCxToRx(ROW *row, size_t cursorX);
+size_t rowRxToCx(ROW *row, size_t renderX);
+size_t rowCxToBx(ROW *row, size_t cursorX);
+size_t rowNextCx(ROW *row, size_t cursorX);
+size_t rowPrevCx(ROW *row, size_t cursorX);
+char *rowsToString(size_t *bufferLength);
+int writeAll(int fd, const char *buffer, size_t length);
+off_t rowsWrite(int fd);
 
 int getWindowSize(int *rows, int *cols);
 
 void error(const char *errorMessage);
 
-void bufferAppend(struct ABUF *bff, const char *string, int length);
+int bufferAppend(struct ABUF *bff, const char *string, size_t length);
 void bufferFree(struct ABUF *bff);
 
 int getCursorPosition(int *rows, int *cols);
@@ -148,10 +598,23 @@ void disableRawMode(void);
 void enableRawMode(void);
 
 void rowAppendString(ROW *row, char *string, size_t length);
-void rowInsertChar(ROW *row, int at, int character);
-void rowDeleteChar(ROW *row, int at);
+void rowInsertChar(ROW *row, size_t at, int character);
+void rowDeleteChar(ROW *row, size_t at);
 
 void insertMark(void);
+void regionBounds(int *start_y, size_t *start_x, int *end_y, size_t *end_x);
+char *regionString(int start_y, size_t start_x, int end_y, size_t end_x, size_t *length);
+int regionReplace(int start_y, size_t start_x, int end_y, size_t end_x, const char *text, size_t length);
+void filter(void);
+void regionKill(void);
+void regionCopy(void);
+void killLine(void);
+void yank(void);
+void yankPop(void);
+void sortLines(void);
+void uniqLines(void);
+void keepLines(void);
+void deleteLines(void);
 
 void insertNewLine(void);
 
@@ -159,6 +622,7 @@ void insertChar(int character);
 void deleteChar(void);
 
 void deleteRow(int at);
+void deleteRows(int at, int count);
 void freeRow(ROW *row);
 
 void setStatusMessage(const char *formated_string, ...);
@@ -167,29 +631,123 @@ void drawStatusMessage(struct ABUF *bff);
 void centerScreen(void);
 
 char *prompt(char *prompt, int prompt_type, void (*callback)(char *, int));
+void poolSubmit(void (*function)(void *), void *argument);
+void poolRun(void (*function)(void *), void *arguments, size_t size, int count);
+ssize_t searchRow(ROW *row, const char *query, size_t query_length);
+int searchRows(const char *query, int start, int direction, int *match_row, size_t *match_offset);
+void findCallback(char *query, int key);
 void file_open(void);
 void command(void);
+struct command *commandLookup(const char *name);
+int commandCandidates(const char *typed, struct command **candidates, int max, int with_aliases);
+char *commandComplete(const char *typed);
+char *commandChoose(const char *typed, int rotation);
+void commandNarrow(const char *typed, int rotation);
+void commandHistoryAdd(const char *name);
+const char *commandHistoryAt(int age);
 void find(void);
 
+void gotoLine(int number);
 void goto_line(void);
 void shell(void);
+void shellKill(void);
+pid_t spawnShell(const char *shell_command, int input, int output, int errors);
+int childPoll(void);
+
+void replace(int use_regex, int all);
+
+struct editorConfig *bufferAt(int index);
+void bufferReset(void);
+void bufferActivate(int index);
+int bufferNew(void);
+void bufferLeave(void);
+int bufferFind(const char *name);
+int bufferAnyDirty(void);
+void bufferSwitch(int index);
+void buffer_switch(void);
+void bufferClose(void);
+void bufferList(void);
+void bufferVisit(void);
+
+void rowCompact(ROW *row);
+void rowEnsureRender(ROW *row);
+long long memoryCompact(void);
+void memoryCheck(void);
+void memoryReport(void);
+void memoryBudget(void);
+
+int loadPoll(void);
+void loadCancel(void);
+void loadWait(void);
+void loadGoto(int line);
+
+int fileReload(void);
+void fileWatch(void);
+void fileUnwatch(void);
+int filePoll(void);
+void revert(void);
+void followUpdate(int rotated);
+void followStop(void);
+void follow(void);
+
+struct codec *codecDetect(const char *file_path);
+int codecWait(pid_t pid);
+int codecOpen(struct codec *codec, int fd, pid_t *pid);
+char *codecRead(struct codec *codec, const char *file_path, size_t *length);
+long long codecSave(struct codec *codec, const char *file_path);
+
+int viewPoll(void);
+void viewIndexFree(struct viewIndex *view);
+void viewLoad(long long line);
+void viewSlide(void);
+void viewGoto(long long line);
+int viewSearch(const char *query, long long from, int direction, int *match_row, size_t *match_offset);
+void viewOpen(const char *file_path);
+void view(void);
+void gotoByte(long long offset);
+void goto_byte(void);
+
+void grep(void);
+void grepVisit(void);
+void grepCancel(void);
+int grepPoll(void);
 
 void drawStatusBar(struct ABUF *bff);
 void drawRows(struct ABUF *bff);
 void refreshScreen(void);
+void renderSubmit(struct ABUF *frame);
+void renderFlush(void);
+
+void watchAdd(int fd, int (*callback)(void));
+void watchRemove(int fd);
+void eventInit(void);
+int inputByte(int timeout);
+void headlessInit(const char *size);
 
 void keyPress(void);
 int readKey(void);
+void macroStart(void);
+void macroEnd(void);
+void macroRun(int times);
+void macroRepeat(void);
 
+ROW rowNew(const char *string, size_t length);
 void insertRow(int at, char *string, size_t length);
+int insertRows(int at, ROW *rows, int count);
 int syntaxToColour(int highlight);
 void selectSyntaxHighlight(void);
 void updateSyntax(ROW *row);
 int is_separator(int c);
+void rowRender(ROW *row);
 void updateRow(ROW *row);
+void updateRowNow(ROW *row);
 
 void editorScroll(void);
 
+uint64_t contentHash(const void *data, size_t size);
+int cacheLoad(const char *file_path, int fd, struct stat *file_stat);
+void cacheStore(const char *file_path, struct stat *file_stat, uint64_t hash, struct cacheLine *lines);
+
 void backupSave(void);
 void save(void);
 
@@ -250,35 +808,330 @@ struct langSyntax g_highlightDatabase[] = {
 #define HIGHLIGHT_ENTRIES (sizeof(g_highlightDatabase) / sizeof(g_highlightDatabase[0]))
 
 struct editorConfig g_Configuration; // this capitalized C pisses me off.
+// every open buffer. the active one lives in g_Configuration, its slot here is stale until it's left.
+struct editorConfig *g_buffers = NULL;
+int g_numberBuffers = 0;
+int g_currentBuffer = 0;
 unsigned int g_backupCounter = 0;
+time_t g_lastEditTime = 0;
+
+struct watcher g_watchers[MAX_WATCHERS];
+int g_numberWatchers = 0;
+
+unsigned char g_input[INPUT_BUFFER_SIZE];
+int g_inputHead = 0;
+int g_inputTail = 0;
+
+int g_resizePipe[2] = { -1, -1 };
+int g_childPipe[2] = { -1, -1 };
+int g_statusExpired = 1;
+struct headlessRun g_headless = { 0 };
+struct killRing g_killRing = { .killed.buffer = -1, .yanked.buffer = -1 };
+struct keyMacro g_macro = { 0 };
+struct traceRing g_trace;
+struct loadJob *g_load = NULL;
+int g_viewNotify[2] = { -1, -1 };
+
+struct codec g_codecs[] = {
+	{ ".gz", "\x1f\x8b", 2, "gzip -dc", "gzip -c" },
+	{ ".zst", "\x28\xb5\x2f\xfd", 4, "zstd -dcq", "zstd -cq" },
+};
+#define CODECS_NUMBER (int)(sizeof(g_codecs) / sizeof(g_codecs[0]))
 
 bool g_doBackups = true;
+bool g_doCache = false;
+long long g_derivedBytes = 0; // render + highlight of every row in every buffer.
+long long g_memoryBudget = 0; // for g_derivedBytes, 0 is no limit.
 
-int rowCxToRx(ROW *row, int cursorX) {
-    int newRenderX = 0;
-    for (int i = 0; i < cursorX; i++) {
-		if (row->chars[i] == '\t')
-			newRenderX += (TAB_STOP - 1) - (newRenderX % TAB_STOP);
-		newRenderX++;
-    }
-    return newRenderX;
+// a whole row is checked at once, and most rows never have a byte with the high bit set.
+int textIsAscii(const char *text, size_t length) {
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; i + 32 <= length; i += 32) {
+		__m128i first = _mm_loadu_si128((const __m128i *)&text[i]);
+		__m128i second = _mm_loadu_si128((const __m128i *)&text[i + 16]);
+		if (_mm_movemask_epi8(_mm_or_si128(first, second)))
+			return 0;
+	}
+#endif
+	uint64_t high = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &text[i], 8);
+		high |= word;
+	}
+	high &= 0x8080808080808080ULL;
+	for (; i < length; i++)
+		high |= (unsigned char)text[i] & 0x80;
+	return high == 0;
 }
-int rowRxToCx(ROW *row, int renderX) {
-    int cursorRenderX = 0;
-    int newCursorX;
-    
-    for (newCursorX = 0; newCursorX < row->size; newCursorX++) {
-		if (row->chars[newCursorX] == '\t') {
-	    	cursorRenderX += (TAB_STOP - 1) - (cursorRenderX & TAB_STOP);
-	    	cursorRenderX++;
-	    	if (cursorRenderX > renderX) return newCursorX;
+int rowIsAscii(ROW *row) {
+	if (row->ascii == 0)
+		row->ascii = textIsAscii(row->chars, row->size) ? 1 : -1;
+	return row->ascii == 1;
+}
+
+// 0 for anything that is not a complete, shortest form, UTF-8 sequence.
+static int utf8Decode(const unsigned char *text, size_t length, uint32_t *codepoint) {
+	unsigned char byte = text[0];
+	uint32_t value;
+	int bytes;
+	
+	if (byte < 0x80) {
+		*codepoint = byte;
+		return 1;
+	}
+	if (byte >= 0xc2 && byte <= 0xdf)      { bytes = 2; value = byte & 0x1f; }
+	else if ((byte & 0xf0) == 0xe0)        { bytes = 3; value = byte & 0x0f; }
+	else if (byte >= 0xf0 && byte <= 0xf4) { bytes = 4; value = byte & 0x07; }
+	else return 0;
+	if ((size_t)bytes > length) return 0;
+	
+	for (int i = 1; i < bytes; i++) {
+		if ((text[i] & 0xc0) != 0x80) return 0;
+		value = (value << 6) | (text[i] & 0x3f);
+	}
+	if ((bytes == 3 && value < 0x800) || (bytes == 4 && (value < 0x10000 || value > 0x10ffff)))
+		return 0;
+	if (value >= 0xd800 && value <= 0xdfff)
+		return 0;
+	*codepoint = value;
+	return bytes;
+}
+
+// marks, joiners, variation selectors, skin tones and tags: they sit on whatever comes before them.
+static const uint32_t g_zeroWidth[][2] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 },
+	{ 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f }, { 0x0670, 0x0670 },
+	{ 0x06d6, 0x06dc }, { 0x06df, 0x06e4 }, { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0711, 0x0711 },
+	{ 0x0730, 0x074a }, { 0x07a6, 0x07b0 }, { 0x0900, 0x0902 }, { 0x093a, 0x093a }, { 0x093c, 0x093c },
+	{ 0x0941, 0x0948 }, { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0e31, 0x0e31 },
+	{ 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1160, 0x11ff }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+	{ 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+	{ 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0x1f3fb, 0x1f3ff }, { 0xe0000, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+// east asian wide and fullwidth, and the emoji that terminals draw two columns wide.
+static const uint32_t g_wideWidth[][2] = {
+	{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 },
+	{ 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267f, 0x267f },
+	{ 0x2693, 0x2693 }, { 0x26a1, 0x26a1 }, { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+	{ 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+	{ 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b }, { 0x2728, 0x2728 },
+	{ 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+	{ 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 },
+	{ 0x2e80, 0x303e }, { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+	{ 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+	{ 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 }, { 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff },
+	{ 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f202 },
+	{ 0x1f210, 0x1f23b }, { 0x1f240, 0x1f248 }, { 0x1f250, 0x1f251 }, { 0x1f260, 0x1f265 }, { 0x1f300, 0x1f320 },
+	{ 0x1f32d, 0x1f335 }, { 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca }, { 0x1f3cf, 0x1f3d3 },
+	{ 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f3fa }, { 0x1f400, 0x1f43e }, { 0x1f440, 0x1f440 },
+	{ 0x1f442, 0x1f4fc }, { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e }, { 0x1f550, 0x1f567 }, { 0x1f57a, 0x1f57a },
+	{ 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 }, { 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc },
+	{ 0x1f6d0, 0x1f6d2 }, { 0x1f6d5, 0x1f6d7 }, { 0x1f6dc, 0x1f6df }, { 0x1f6eb, 0x1f6ec }, { 0x1f6f4, 0x1f6fc },
+	{ 0x1f7e0, 0x1f7eb }, { 0x1f7f0, 0x1f7f0 }, { 0x1f90c, 0x1f93a }, { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff },
+	{ 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+static int rangesContain(const uint32_t (*ranges)[2], int count, uint32_t codepoint) {
+	int low = 0, high = count;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (ranges[middle][1] < codepoint) low = middle + 1;
+		else                               high = middle;
+	}
+	return low < count && ranges[low][0] <= codepoint;
+}
+int codepointWidth(uint32_t codepoint) {
+	if (codepoint < 0x300) return 1;
+	if (rangesContain(g_zeroWidth, sizeof(g_zeroWidth) / sizeof(g_zeroWidth[0]), codepoint)) return 0;
+	if (rangesContain(g_wideWidth, sizeof(g_wideWidth) / sizeof(g_wideWidth[0]), codepoint)) return 2;
+	return 1;
+}
+static int isRegionalIndicator(uint32_t codepoint) {
+	return codepoint >= 0x1f1e6 && codepoint <= 0x1f1ff;
+}
+
+// one walk over a row that is not plain ASCII: its cells, and its render when there is somewhere to put it.
+// invalid bytes and C1 controls render as '?', a mark with nothing before it gets a space to sit on.
+static size_t rowCells(ROW *row, char *render) {
+	const unsigned char *chars = (const unsigned char *)row->chars;
+	struct cellStop *cells = malloc(sizeof(struct cellStop) * (row->size + 1));
+	size_t x = 0, index = 0, column = 0, count = 0;
+	
+	while (x < row->size) {
+		cells[count].charsX = x;
+		cells[count].renderX = index;
+		cells[count].column = column;
+		count++;
+		
+		if (chars[x] == '\t') {
+			int width = TAB_STOP - (column % TAB_STOP);
+			if (render) memset(&render[index], ' ', width);
+			index += width;
+			column += width;
+			x++;
+			continue;
 		}
-    }
-    return newCursorX;
+		uint32_t codepoint;
+		int bytes = utf8Decode(&chars[x], row->size - x, &codepoint);
+		if (bytes == 0 || (codepoint >= 0x80 && codepoint < 0xa0)) {
+			if (render) render[index] = '?';
+			index++;
+			column++;
+			x += bytes ? bytes : 1;
+			continue;
+		}
+		int width = codepointWidth(codepoint);
+		if (width == 0) {
+			if (render) render[index] = ' ';
+			index++;
+			width = 1;
+		}
+		if (render) memcpy(&render[index], &chars[x], bytes);
+		index += bytes;
+		x += bytes;
+		
+		// the rest of the cluster: anything zero width, whatever a joiner glues on, the second half of a flag.
+		int joiner = codepoint == 0x200d, flag = isRegionalIndicator(codepoint);
+		while (x < row->size) {
+			bytes = utf8Decode(&chars[x], row->size - x, &codepoint);
+			if (bytes == 0 || codepoint < 0xa0) break;
+			if (flag && isRegionalIndicator(codepoint)) width = 2;
+			else if (!joiner && codepointWidth(codepoint) != 0) break;
+			flag = 0;
+			joiner = codepoint == 0x200d;
+			if (render) memcpy(&render[index], &chars[x], bytes);
+			index += bytes;
+			x += bytes;
+		}
+		column += width;
+	}
+	cells[count].charsX = x;
+	cells[count].renderX = index;
+	cells[count].column = column;
+	
+	free(row->cells);
+	row->cells = realloc(cells, sizeof(struct cellStop) * (count + 1));
+	row->numberCells = count;
+	return index;
+}
+// the cell that cursorX is in, or the one past the end of the row.
+static struct cellStop *rowCellAt(ROW *row, size_t cursorX) {
+	if (row->cells == NULL)
+		rowCells(row, NULL);
+	size_t low = 0, high = row->numberCells + 1;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (row->cells[middle].charsX <= cursorX) low = middle + 1;
+		else                                      high = middle;
+	}
+	return &row->cells[low > 0 ? low - 1 : 0];
+}
+
+// between two tabs chars and render advance together, so the tabs alone are enough to map columns.
+void rowColumnIndex(ROW *row) {
+	if (row->numberColumns >= 0) return;
+	
+	size_t tabs = 0;
+	char *tab = row->chars, *end = row->chars + row->size;
+	while ((tab = memchr(tab, '\t', end - tab)) != NULL) {
+		tabs++;
+		tab++;
+	}
+	row->numberColumns = 0;
+	if (tabs == 0) return;
+	row->columns = malloc(sizeof(struct columnStop) * tabs);
+	if (row->columns == NULL) {
+		row->numberColumns = -1;
+		return;
+	}
+	
+	size_t renderX = 0, charsX = 0;
+	tab = row->chars;
+	while ((tab = memchr(tab, '\t', end - tab)) != NULL) {
+		renderX += (tab - row->chars) - charsX;
+		charsX = tab - row->chars;
+		row->columns[row->numberColumns].charsX = charsX;
+		row->columns[row->numberColumns].renderX = renderX;
+		row->numberColumns++;
+		
+		renderX += TAB_STOP - (renderX % TAB_STOP);
+		charsX++;
+		tab++;
+	}
+	return;
+}
+static size_t columnStopEnd(struct columnStop *stop) {
+	return stop->renderX + TAB_STOP - (stop->renderX % TAB_STOP);
+}
+
+size_t rowCxToRx(ROW *row, size_t cursorX) {
+	if (!rowIsAscii(row)) return rowCellAt(row, cursorX)->column;
+	rowColumnIndex(row);
+	if (row->numberColumns <= 0) return cursorX;
+	
+	// last tab before cursorX.
+	size_t low = 0, high = row->numberColumns;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (row->columns[middle].charsX < cursorX) low = middle + 1;
+		else                                       high = middle;
+	}
+	if (low == 0) return cursorX;
+	struct columnStop *stop = &row->columns[low - 1];
+	return columnStopEnd(stop) + (cursorX - stop->charsX - 1);
+}
+size_t rowRxToCx(ROW *row, size_t renderX) {
+	if (!rowIsAscii(row)) {
+		rowCellAt(row, 0);
+		// last cell starting at or before renderX.
+		size_t low = 0, high = row->numberCells;
+		while (low < high) {
+			size_t middle = (low + high) / 2;
+			if (row->cells[middle].column <= renderX) low = middle + 1;
+			else                                      high = middle;
+		}
+		return renderX >= row->cells[row->numberCells].column ? row->size : row->cells[low > 0 ? low - 1 : 0].charsX;
+	}
+	rowColumnIndex(row);
+	size_t cursorX = renderX;
+	
+	if (row->numberColumns > 0) {
+		// last tab starting at or before renderX.
+		size_t low = 0, high = row->numberColumns;
+		while (low < high) {
+			size_t middle = (low + high) / 2;
+			if (row->columns[middle].renderX <= renderX) low = middle + 1;
+			else                                         high = middle;
+		}
+		if (low > 0) {
+			struct columnStop *stop = &row->columns[low - 1];
+			size_t end = columnStopEnd(stop);
+			cursorX = (renderX < end) ? stop->charsX : stop->charsX + 1 + (renderX - end);
+		}
+	}
+	return cursorX < row->size ? cursorX : row->size;
+}
+// where cursorX lands in render and highlight, which only differs from the column outside ASCII.
+size_t rowCxToBx(ROW *row, size_t cursorX) {
+	if (!rowIsAscii(row)) return rowCellAt(row, cursorX)->renderX;
+	return rowCxToRx(row, cursorX);
+}
+// one grapheme cluster to the right or to the left.
+size_t rowNextCx(ROW *row, size_t cursorX) {
+	if (cursorX >= row->size) return row->size;
+	if (rowIsAscii(row)) return cursorX + 1;
+	struct cellStop *cell = rowCellAt(row, cursorX);
+	return cell == &row->cells[row->numberCells] ? row->size : cell[1].charsX;
+}
+size_t rowPrevCx(ROW *row, size_t cursorX) {
+	if (cursorX == 0) return 0;
+	if (rowIsAscii(row)) return cursorX - 1;
+	return rowCellAt(row, cursorX - 1)->charsX;
 }
 
-char *rowsToString(int *bufferLength) {
-    int totalLength = 0;
+char *rowsToString(size_t *bufferLength) {
+    size_t totalLength = 0;
     for (int i = 0; i < g_Configuration.numberRows; i++)
 		totalLength += g_Configuration.rows[i].size + 1;
     *bufferLength = totalLength;
@@ -292,10 +1145,59 @@ char *rowsToString(int *bufferLength) {
     }
     return buffer;
 }
+// however many write() calls it takes: one never writes more than about 2 GB.
+int writeAll(int fd, const char *buffer, size_t length) {
+	while (length > 0) {
+		ssize_t count = write(fd, buffer, length);
+		if (count == -1 && errno == EINTR) continue;
+		if (count == -1) return -1;
+		buffer += count;
+		length -= count;
+	}
+	return 0;
+}
+// the rows of the active buffer, each with its '\n', gathered into chunks of about WRITE_CHUNK_BYTES
+// so a big file never needs a second copy of itself in memory. rows bigger than a chunk go out as they are.
+// returns the bytes written, -1 with errno set on failure.
+off_t rowsWrite(int fd) {
+	struct ABUF chunk = ABUF_INIT;
+	off_t total = 0;
+	int failed = 0;
+	for (int i = 0; !failed && i < g_Configuration.numberRows; i++) {
+		ROW *row = &g_Configuration.rows[i];
+		if (row->size >= WRITE_CHUNK_BYTES) {
+			failed = writeAll(fd, chunk.buffer, chunk.length) == -1 || writeAll(fd, row->chars, row->size) == -1;
+			total += chunk.length + row->size;
+			chunk.length = 0;
+		} else if (bufferAppend(&chunk, row->chars, row->size) == -1) {
+			failed = 1;
+			errno = ENOMEM;
+		}
+		if (!failed && bufferAppend(&chunk, "\n", 1) == -1) {
+			failed = 1;
+			errno = ENOMEM;
+		}
+		if (!failed && (chunk.length >= WRITE_CHUNK_BYTES || i == g_Configuration.numberRows - 1)) {
+			failed = failed || writeAll(fd, chunk.buffer, chunk.length) == -1;
+			total += chunk.length;
+			chunk.length = 0;
+		}
+	}
+	int saved_errno = errno;
+	bufferFree(&chunk);
+	errno = saved_errno;
+	return failed ? -1 : total;
+}
 
 int getWindowSize(int *rows, int *cols) {
 	struct winsize window_size;
+	if (g_headless.active) {
+		*rows = g_headless.rows;
+		*cols = g_headless.cols;
+		return 0;
+	}
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) == -1 || window_size.ws_col == 0) {
+		renderFlush();
 		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
 			return -1;
 		return getCursorPosition(rows, cols);
@@ -306,20 +1208,29 @@ int getWindowSize(int *rows, int *cols) {
 }
 
 void error(const char *errorMessage) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+	renderFlush();
+	if (!g_headless.active) {
+		write(STDOUT_FILENO, "\x1b[2J", 4);
+		write(STDOUT_FILENO, "\x1b[H", 3);
+	}
     perror(errorMessage); exit(1);
     return;
 }
 
-void bufferAppend(struct ABUF *bff, const char *string, int length) {
-    char *n = realloc(bff->buffer, bff->length + length);
-    if (n ==  NULL) return;
-    
-    memcpy(&n[bff->length], string, length);
+// -1 when it could not grow, for the few callers that can't just lose the text.
+int bufferAppend(struct ABUF *bff, const char *string, size_t length) {
+    if (bff->length + length > bff->capacity) {
+		size_t capacity = bff->capacity ? bff->capacity : 64;
+		while (capacity < bff->length + length)
+			capacity *= 2;
+		char *n = realloc(bff->buffer, capacity);
+		if (n ==  NULL) return -1;
+		bff->buffer = n;
+		bff->capacity = capacity;
+    }
+    memcpy(&bff->buffer[bff->length], string, length);
     bff->length += length;
-    bff->buffer = n;
-    return;
+    return 0;
 }
 void bufferFree(struct ABUF *bff) {
     free(bff->buffer);
@@ -333,7 +1244,9 @@ int getCursorPosition(int *rows, int *cols) {
         return -1;
     
     while (i < sizeof(buffer) - 1) {
-		if (read(STDIN_FILENO, &buffer[i], 1) != 1) break;
+		int c = inputByte(1000);
+		if (c == -1) break;
+		buffer[i] = c;
 		if (buffer[i] == 'R') break;
 		i++;
     }
@@ -349,14 +1262,14 @@ void moveCursor(int key) {
     
     switch(key) {
         case LEFT:
-			if (g_Configuration.cursorX != 0) g_Configuration.cursorX--;
+			if (row && g_Configuration.cursorX != 0) g_Configuration.cursorX = rowPrevCx(row, g_Configuration.cursorX);
 			else if (g_Configuration.cursorY > 0) {
 				g_Configuration.cursorY--;
 				g_Configuration.cursorX = g_Configuration.rows[g_Configuration.cursorY].size;
 			}
 			break;
         case RIGHT:
-			if (row && g_Configuration.cursorX < row->size) g_Configuration.cursorX++;
+			if (row && g_Configuration.cursorX < row->size) g_Configuration.cursorX = rowNextCx(row, g_Configuration.cursorX);
 			else if (g_Configuration.cursorY > 0) {
 				g_Configuration.cursorY++;
 				g_Configuration.cursorX = 0;
@@ -382,8 +1295,10 @@ void moveCursor(int key) {
     }
     row = (g_Configuration.cursorY >= g_Configuration.numberRows) ? NULL : &g_Configuration.rows[g_Configuration.cursorY];
 	
-    int rowLength = row ? row->size : 0;
+    size_t rowLength = row ? row->size : 0;
     if (g_Configuration.cursorX > rowLength) g_Configuration.cursorX = rowLength;
+	// up and down can land in the middle of a wide or combined character.
+	if (row && !rowIsAscii(row)) g_Configuration.cursorX = rowCellAt(row, g_Configuration.cursorX)->charsX;
     return;
 }
 
@@ -404,7 +1319,8 @@ void enableRawMode(void) {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |=  (CS8);
     
-    raw.c_cc[VTIME] = 1;
+    // never blocks: the waiting is done by poll() in eventWait().
+    raw.c_cc[VTIME] = 0;
     raw.c_cc[VMIN] = 0;
     
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
@@ -423,8 +1339,8 @@ void rowAppendString(ROW *row, char *string, size_t length) {
     g_Configuration.dirty++;
     return;
 }
-void rowInsertChar(ROW *row, int at, int character) {
-    if (at < 0 || at > row->size) at = row->size;
+void rowInsertChar(ROW *row, size_t at, int character) {
+    if (at > row->size) at = row->size;
     row->chars = realloc(row->chars, row->size + 2);
     
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
@@ -434,10 +1350,12 @@ void rowInsertChar(ROW *row, int at, int character) {
     updateRow(row);
     return;
 }
-void rowDeleteChar(ROW *row, int at) {
-	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
+// the whole character at 'at', with its marks and the rest of its cluster.
+void rowDeleteChar(ROW *row, size_t at) {
+	if (at >= row->size) return;
+	size_t end = rowNextCx(row, at);
+	memmove(&row->chars[at], &row->chars[end], row->size - end + 1);
+	row->size -= end - at;
     
 	updateRow(row);
 }
@@ -445,6 +1363,8 @@ void rowDeleteChar(ROW *row, int at) {
 void insertMark(void) {
 	g_Configuration.markX = g_Configuration.cursorX;
 	g_Configuration.markY = g_Configuration.cursorY;
+	g_Configuration.markSet = 1;
+	setStatusMessage("Mark set.");
 	return;
 }
 
@@ -483,8 +1403,8 @@ void deleteChar(void) {
     
     ROW *row = &g_Configuration.rows[g_Configuration.cursorY];
     if (g_Configuration.cursorX > 0) {
-		rowDeleteChar(row, g_Configuration.cursorX - 1);
-		g_Configuration.cursorX--;
+		g_Configuration.cursorX = rowPrevCx(row, g_Configuration.cursorX);
+		rowDeleteChar(row, g_Configuration.cursorX);
     } else {
 		g_Configuration.cursorX = g_Configuration.rows[g_Configuration.cursorY - 1].size;
 		rowAppendString(&g_Configuration.rows[g_Configuration.cursorY - 1], row->chars, row->size);
@@ -507,12 +1427,35 @@ void deleteRow(int at) {
 		g_backupCounter++;
     return;
 }
+// the rows go away with a single memmove, whatever their number.
+void deleteRows(int at, int count) {
+	if (at < 0 || count <= 0 || at >= g_Configuration.numberRows) return;
+	if (count > g_Configuration.numberRows - at) count = g_Configuration.numberRows - at;
+	for (int i = at; i < at + count; i++)
+		freeRow(&g_Configuration.rows[i]);
+	
+	memmove(&g_Configuration.rows[at], &g_Configuration.rows[at + count], sizeof(ROW) * (g_Configuration.numberRows - at - count));
+	g_Configuration.numberRows -= count;
+	g_Configuration.dirty++;
+	return;
+}
 void freeRow(ROW *row) {
+	if (row->render)
+		g_derivedBytes -= 2 * (long long)row->rsize + 1;
+	free(row->columns);
+	free(row->cells);
 	free(row->highlight);
     free(row->render);
     free(row->chars);
     return;
 }
+// the rows an insertRows() did not take, and the array holding them.
+static void rowsFree(ROW *rows, int count) {
+	for (int i = 0; i < count; i++)
+		freeRow(&rows[i]);
+	free(rows);
+	return;
+}
 
 void setStatusMessage(const char *formated_string, ...) {
     va_list parameters;
@@ -520,6 +1463,7 @@ void setStatusMessage(const char *formated_string, ...) {
     vsnprintf(g_Configuration.statusMessage, sizeof(g_Configuration.statusMessage), formated_string, parameters);
     va_end(parameters);
     g_Configuration.statusMessageTime = time(NULL);
+	g_statusExpired = 0;
     return;
 }
 void drawStatusMessage(struct ABUF *bff) {
@@ -527,7 +1471,7 @@ void drawStatusMessage(struct ABUF *bff) {
     int length = strlen(g_Configuration.statusMessage);
 	
     if (length > g_Configuration.screenCols) length = g_Configuration.screenCols;
-    if (length && time(NULL) - g_Configuration.statusMessageTime < 5)
+    if (length && time(NULL) - g_Configuration.statusMessageTime < STATUS_MESSAGE_SECONDS)
 		bufferAppend(bff, g_Configuration.statusMessage, length);
 	
     while (length < g_Configuration.screenCols) {
@@ -550,9 +1494,9 @@ char *prompt(char *prompt, int prompt_type, void (*callback)(char *, int)) {
 				size_t filename_length = strlen(g_Configuration.filename);
 				
 				char *final_buffer = NULL;
-				final_buffer = (char*)malloc(filename_length);
-				memcpy(final_buffer, g_Configuration.filename, filename_length);
+				final_buffer = (char*)malloc(filename_length + 1);
 				if (final_buffer == NULL) break;
+				memcpy(final_buffer, g_Configuration.filename, filename_length + 1);
 				
 				char *path = dirname(final_buffer);
 				buffer_size = strlen(path) + 2;
@@ -561,7 +1505,7 @@ char *prompt(char *prompt, int prompt_type, void (*callback)(char *, int)) {
 					setStatusMessage("failed to malloc memory to prompt's string buffer.");
 					return NULL;
 				}
-				buffer[buffer_size] = '\0';
+				buffer[0] = '\0';
 				snprintf(buffer, buffer_size, "%s/", path);
 				buffer_length = buffer_size - 1;
 				free(final_buffer);
@@ -587,14 +1531,33 @@ char *prompt(char *prompt, int prompt_type, void (*callback)(char *, int)) {
 			break;
 	}
 
+	int history_age = -1; // -1 is what is being typed, not a history entry.
+	int rotation = 0;
     while(1) {
 		setStatusMessage(prompt, buffer);
+		if (prompt_type == PC_COMMAND)
+			commandNarrow(buffer, rotation);
 		refreshScreen();
 		
 		int c = readKey();
+		char *replacement = NULL;
 		if (c == BACKSPACE) {
-			if (buffer_length != 0)
-				buffer[--buffer_length] = '\0';
+			// a whole UTF-8 character: its continuation bytes, then the one it started with.
+			while (buffer_length != 0 && ((unsigned char)buffer[--buffer_length] & 0xc0) == 0x80);
+			buffer[buffer_length] = '\0';
+			rotation = 0;
+		} else if (prompt_type == PC_COMMAND && c == '\t') {
+			replacement = commandComplete(buffer);
+			rotation = 0;
+		} else if (prompt_type == PC_COMMAND && (c == CTRL_KEY('s') || c == CTRL_KEY('r'))) {
+			rotation += c == CTRL_KEY('s') ? 1 : -1;
+		} else if (prompt_type == PC_COMMAND && (c == UP || c == DOWN)) {
+			int age = history_age + (c == UP ? 1 : -1);
+			if (age >= -1 && (age == -1 || commandHistoryAt(age) != NULL)) {
+				history_age = age;
+				replacement = strdup(age == -1 ? "" : commandHistoryAt(age));
+				rotation = 0;
+			}
 		} else if (c == '\x1b') {
 			setStatusMessage("");
 			if (callback)
@@ -603,768 +1566,5419 @@ char *prompt(char *prompt, int prompt_type, void (*callback)(char *, int)) {
 			return NULL;
 		} else if (c == '\r') {
 			if (buffer_length != 0) {
+				char *chosen = prompt_type == PC_COMMAND ? commandChoose(buffer, rotation) : NULL;
+				if (chosen != NULL) {
+					free(buffer);
+					buffer = chosen;
+				}
 				setStatusMessage("");
 				if (callback)
 					callback(buffer, c);
 				return buffer;
 			}
-		} else if (!iscntrl(c) && c < 128) {
+		} else if ((!iscntrl(c) && c < 128) || (c >= 128 && c < 256)) {
 			if (buffer_length == buffer_size - 1) {
 				buffer_size *= 2;
 				buffer = realloc(buffer, buffer_size);
 			}
 			buffer[buffer_length++] = c;
 			buffer[buffer_length] = '\0';
+			rotation = 0;
+		}
+		if (replacement != NULL) {
+			free(buffer);
+			buffer = replacement;
+			buffer_length = strlen(buffer);
+			buffer_size = buffer_length + 1;
 		}
 	if (callback)
 		callback(buffer, c);
 	}
 }
 
-void findCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-	
-	static char *saved_highlight = NULL;
-	static int saved_highlight_line;
-	
-	if (saved_highlight) {
-		memcpy(g_Configuration.rows[saved_highlight_line].highlight, saved_highlight, g_Configuration.rows[saved_highlight_line].rsize);
-		free(saved_highlight);
-		saved_highlight = NULL;
-	}
-	
-    if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
+void watchAdd(int fd, int (*callback)(void)) {
+	if (g_numberWatchers == MAX_WATCHERS) return;
+	g_watchers[g_numberWatchers].fd = fd;
+	g_watchers[g_numberWatchers].callback = callback;
+	g_numberWatchers++;
+	return;
+}
+void watchRemove(int fd) {
+	for (int i = 0; i < g_numberWatchers; i++) {
+		if (g_watchers[i].fd != fd) continue;
+		g_watchers[i] = g_watchers[--g_numberWatchers];
 		return;
-    }
-    else if (key == DOWN) {
-		direction = 1;
-    }
-    else if (key == UP) {
-		direction = -1;
-    }
-    else {
-		last_match = -1;
-		direction = 1;
-    }
-    
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    
-    for (int i = 0; i < g_Configuration.numberRows; i++) {
-		current += direction;
-		if (current == -1)
-			current = g_Configuration.numberRows - 1;
-		else if (current == (int)g_Configuration.numberRows)
-			current = 0;
-	
-		ROW *row = &g_Configuration.rows[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			g_Configuration.cursorY = current;
-			g_Configuration.cursorX = rowRxToCx(row, match - row->render);
-			g_Configuration.rowsOff = g_Configuration.numberRows;
-			
-			saved_highlight_line = current;
-			saved_highlight = malloc(row->rsize);
-			memcpy(saved_highlight, row->highlight, row->rsize);
-			memset(&row->highlight[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
 	}
+	return;
 }
 
-void find(void) {
-    int savedColsOff = g_Configuration.colsOff;
-    int savedRowsOff = g_Configuration.rowsOff;
-    int savedCursorX = g_Configuration.cursorX;
-    int savedCursorY = g_Configuration.cursorY;
-    
-    char *query = prompt("Search for: %s", PC_SEARCH, findCallback);
-    if (query)
-		free(query);
-    else {
-		g_Configuration.colsOff = savedColsOff;
-		g_Configuration.rowsOff = savedRowsOff;
-		g_Configuration.cursorX = savedCursorX;
-		g_Configuration.cursorY = savedCursorY;
-    }
-    return;
+static void signalHandler(int signal_number) {
+	int saved_errno = errno;
+	if (write(signal_number == SIGCHLD ? g_childPipe[1] : g_resizePipe[1], "", 1) == -1) {
+		// one is already pending.
+	}
+	errno = saved_errno;
+	return;
+}
+static int resizePoll(void) {
+	char drain[32];
+	while (read(g_resizePipe[0], drain, sizeof(drain)) > 0);
+	if (getWindowSize(&g_Configuration.screenRows, &g_Configuration.screenCols) == -1)
+		return 0;
+	g_Configuration.screenRows -= 2;
+	return 1;
+}
+void eventInit(void) {
+	if (pipe2(g_resizePipe, O_NONBLOCK | O_CLOEXEC) == -1 || pipe2(g_childPipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		error("pipe2");
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGWINCH, &action, NULL);
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &action, NULL);
+	// a filter that exits before reading all its input must not take the editor down with it.
+	signal(SIGPIPE, SIG_IGN);
+	watchAdd(g_resizePipe[0], resizePoll);
+	watchAdd(g_childPipe[0], childPoll);
+	return;
 }
 
-void file_open(void) {
-	char *file_path = prompt("Open file at: %s", PC_OPEN, NULL);
-	if (file_path == NULL) {
-		setStatusMessage("Opening file operation aborted.");
-		return;
-	}
-	editorOpen(file_path);
-	g_backupCounter = 0;
-	refreshScreen();
+static long long monotonicMilliseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+static long long monotonicMicroseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// CHARLIE_TRACE (or the trace command): spans of the hot paths, for chrome://tracing and the like.
+// writers only bump an atomic index, so any thread can record without taking a lock.
+static long long traceBegin(void) {
+	return atomic_load_explicit(&g_trace.enabled, memory_order_relaxed) ? monotonicMicroseconds() : 0;
+}
+static void traceEnd(const char *name, long long start) {
+	if (start == 0) return;
+	static _Thread_local int thread = 0;
+	if (thread == 0) thread = gettid();
+	
+	unsigned long index = atomic_fetch_add_explicit(&g_trace.next, 1, memory_order_relaxed);
+	struct traceEvent *event = &g_trace.events[index & (TRACE_EVENTS - 1)];
+	// the sequence is 0 while the slot is written, a dump skips what it catches half done.
+	atomic_store_explicit(&event->sequence, 0, memory_order_release);
+	event->name = name;
+	event->start = start;
+	event->duration = monotonicMicroseconds() - start;
+	event->thread = thread;
+	atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
 	return;
 }
 
-void goto_line(void) {
-	char *input_number = prompt("Go to line: %s", PC_GOTO, NULL);
-	if (input_number == NULL) {
-		setStatusMessage("Goto-line operation aborted.");
-		return;
+static int traceDump(void) {
+	const char *path = g_trace.path ? g_trace.path : TRACE_DEFAULT_PATH;
+	FILE *file = fopen(path, "w");
+	if (file == NULL) return -1;
+	
+	unsigned long end = atomic_load(&g_trace.next);
+	unsigned long begin = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+	int written = 0;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (unsigned long i = begin; i < end; i++) {
+		struct traceEvent *event = &g_trace.events[i & (TRACE_EVENTS - 1)];
+		unsigned long sequence = atomic_load_explicit(&event->sequence, memory_order_acquire);
+		struct traceEvent copy = { event->name, event->start, event->duration, event->thread, 0 };
+		if (sequence != i + 1 || atomic_load_explicit(&event->sequence, memory_order_acquire) != sequence) continue;
+		
+		fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+				written ? "," : "", copy.name, copy.start, copy.duration, (int)getpid(), copy.thread);
+		written++;
 	}
-	int number = atoi(input_number);
-	if (number < 0)
-		g_Configuration.cursorY = 0;
-	else {
-		if (number < g_Configuration.numberRows)
-			g_Configuration.cursorY = number;
-		else
-			g_Configuration.cursorY = g_Configuration.numberRows;
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0) return -1;
+	return written;
+}
+static void traceExit(void) {
+	if (atomic_load(&g_trace.enabled))
+		traceDump();
+	return;
+}
+static void traceStart(const char *path) {
+	static int registered = 0;
+	if (path != NULL) {
+		free(g_trace.path);
+		g_trace.path = strdup(path);
 	}
-	setStatusMessage("Cursor placed in %d line.", g_Configuration.cursorY);
+	if (!registered) {
+		atexit(traceExit);
+		registered = 1;
+	}
+	atomic_store(&g_trace.enabled, 1);
 	return;
 }
 
-void shell(void) {
-	char *shell_command = prompt("Shell command: %s", PC_SHELL, NULL);
-	if (shell_command == NULL) {
-		setStatusMessage("Shell command operation aborted.");
-		return;
+// scripts are the bytes a terminal would send, plus C escapes (\r \t \e \\ \xHH) to write them.
+// newlines are only there to lay the script out and are dropped, Enter is \r as on a terminal.
+static void headlessLoad(int fd) {
+	struct ABUF raw = ABUF_INIT;
+	char chunk[65536];
+	ssize_t nread;
+	while ((nread = read(fd, chunk, sizeof(chunk))) > 0)
+		bufferAppend(&raw, chunk, nread);
+	if (nread == -1)
+		error("read");
+	
+	g_headless.script = malloc(raw.length + 1);
+	g_headless.breaks = malloc(sizeof(size_t) * (raw.length + 1));
+	if (g_headless.script == NULL || g_headless.breaks == NULL)
+		error("malloc");
+	
+	size_t length = 0;
+	for (size_t i = 0; i < raw.length; i++) {
+		char c = raw.buffer[i];
+		if (c == '\n') continue;
+		if (c == '\\' && i + 1 < raw.length) {
+			switch (raw.buffer[++i]) {
+				case 'r': c = '\r'; break;
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'e': c = '\x1b'; break;
+				case 'x': {
+					char digits[3] = { 0 };
+					for (int j = 0; j < 2 && i + 1 < raw.length && isxdigit((unsigned char)raw.buffer[i + 1]); j++)
+						digits[j] = raw.buffer[++i];
+					c = (char)strtol(digits, NULL, 16);
+					break;
+				}
+				default: c = raw.buffer[i]; break;
+			}
+		}
+		g_headless.script[length++] = c;
 	}
-	if (system(shell_command) < 0) {
-		setStatusMessage("Command is not valid and/or is not available.");
-		return;
+	bufferFree(&raw);
+	g_headless.scriptLength = length;
+	
+	// an escape that does not start a sequence is a key of its own, as if typed on its own.
+	for (size_t i = 0; i < length; i++) {
+		if (g_headless.script[i] != '\x1b') continue;
+		if (i + 1 < length && (g_headless.script[i + 1] == '[' || g_headless.script[i + 1] == 'O')) continue;
+		g_headless.breaks[g_headless.numberBreaks++] = i + 1;
 	}
-	setStatusMessage("Command executed successfully");
 	return;
 }
 
-static void backupRemove(void) {
-	if (g_Configuration.filename == NULL)
-		return;
+static int latencyCompare(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+static double latencyPercentile(double percentile) {
+	if (g_headless.numberKeys == 0) return 0.0;
+	int index = (int)(percentile / 100.0 * (g_headless.numberKeys - 1) + 0.5);
+	return g_headless.latencies[index] / 1000.0;
+}
+static void headlessReport(void) {
+	long long total = monotonicMicroseconds() - g_headless.startTime;
+	if (g_headless.keyStart != 0 && g_headless.numberKeys < g_headless.capacityKeys)
+		g_headless.latencies[g_headless.numberKeys++] = monotonicMicroseconds() - g_headless.keyStart;
 	
-	int backup_length = strlen(g_Configuration.filename) + strlen(BACKUP_STRING) + 1;
-	char *backup_filename = (char*)malloc(backup_length);
+	long long sum = 0;
+	for (int i = 0; i < g_headless.numberKeys; i++)
+		sum += g_headless.latencies[i];
+	qsort(g_headless.latencies, g_headless.numberKeys, sizeof(long long), latencyCompare);
 	
-	snprintf(backup_filename, backup_length, "%s%s", g_Configuration.filename, BACKUP_STRING);
-	if (remove(backup_filename) != 0) {
-		setStatusMessage("Failed to remove backup file.");
-		return;
-	}
-	setStatusMessage("%s backup file removed.", backup_filename);
-    free(backup_filename);
+	fprintf(stderr, "charlie headless %dx%d: %d keys, %ld frames, %lld bytes rendered\n",
+			g_headless.cols, g_headless.rows, g_headless.numberKeys, g_headless.frameCount, g_headless.frameBytes);
+	fprintf(stderr, "total %.3f ms, render %.3f ms\n", total / 1000.0, g_headless.renderTime / 1000.0);
+	fprintf(stderr, "key latency ms: mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+			g_headless.numberKeys ? (double)sum / g_headless.numberKeys / 1000.0 : 0.0,
+			latencyPercentile(50), latencyPercentile(90), latencyPercentile(99), latencyPercentile(100));
 	return;
 }
 
-void command(void) {
-	char *command = prompt("Exec. command: %s", PC_COMMAND, NULL);
-	if (command == NULL) {
-		setStatusMessage("Exec. of command aborted.");
-		return;
+// CHARLIE_HEADLESS is the virtual screen, "COLSxROWS" (80x24 when it's not a size).
+// the script is read from CHARLIE_SCRIPT or stdin and the frames written to CHARLIE_FRAMES, if set.
+void headlessInit(const char *size) {
+	g_headless.active = 1;
+	g_headless.frames = -1;
+	if (sscanf(size, "%dx%d", &g_headless.cols, &g_headless.rows) != 2 || g_headless.cols < 1 || g_headless.rows < 3) {
+		g_headless.cols = 80;
+		g_headless.rows = 24;
 	}
 	
-	if (strcmp(command, "quit") == 0 || 
-		strcmp(command, "exit") == 0 ||
-		strcmp(command, "kill-charlie")==0) {
-		write(STDOUT_FILENO, "\x1b[2J", 4);
-		write(STDOUT_FILENO, "\x1b[H", 3);
-		exit(0);
-		return;
+	const char *script = getenv("CHARLIE_SCRIPT");
+	int fd = STDIN_FILENO;
+	if (script != NULL && strcmp(script, "-") != 0 && (fd = open(script, O_RDONLY)) == -1)
+		error("open");
+	headlessLoad(fd);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	
+	const char *frames = getenv("CHARLIE_FRAMES");
+	if (frames != NULL && (g_headless.frames = open(frames, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		error("open");
+	
+	g_headless.startTime = monotonicMicroseconds();
+	atexit(headlessReport);
+	return;
+}
+
+// moves script bytes into the input buffer, up to the next break.
+// returns 0 when a timed read has to run out instead, once the script is over it ends the run.
+static int headlessFeed(int timed) {
+	if (g_headless.nextBreak < g_headless.numberBreaks && g_headless.breaks[g_headless.nextBreak] == g_headless.scriptOffset) {
+		g_headless.nextBreak++;
+		if (timed) return 0;
 	}
-	else if (strcmp(command, "backup-mode") == 0) { g_doBackups = !g_doBackups; g_doBackups ? setStatusMessage("Backup-mode enabled") : setStatusMessage("Backup-mode disabled"); return; }
-	else if (strcmp(command, "version") == 0 || strcmp(command, "charlie_version") == 0) { setStatusMessage("Current Charlie Version: %s", VERSION); return; }
-	else if (strcmp(command, "humans-apes?") == 0 || strcmp(command, "humans-apes") == 0) { setStatusMessage("Yes, Miranda. We are all apes."); return; }
-	else if (strcmp(command, "center-screen") == 0) { centerScreen(); setStatusMessage("Screen centered."); return; }
-	else if (strcmp(command, "current-line") == 0) { setStatusMessage(" %d ", g_Configuration.cursorY); return; }
-	else if (strcmp(command, "remove-backup") == 0 || strcmp(command, "backup-remove") == 0) { backupRemove(); return; }
-	else if (strcmp(command, "save-backup") == 0 || strcmp(command, "backup-save") == 0) { backupSave(); return; }
-	else if (strcmp(command, "goto-line") == 0) { goto_line(); return; }
-	else if (strcmp(command, "open") == 0) { file_open(); return; }
-	else if (strcmp(command, "shell") == 0) { shell(); return; }
-	
-	else if (strcmp(command, "refresh-screen") == 0) {
-		g_Configuration.statusMessageTime = 0;
-		setStatusMessage("");
-		
-		if (getWindowSize(&g_Configuration.screenRows, &g_Configuration.screenCols) == -1)
-			error("getWindowSize");
-		g_Configuration.screenRows -= 2;
-		refreshScreen();
-		return;
+	if (g_headless.scriptOffset == g_headless.scriptLength) {
+		if (timed) return 0;
+		exit(0);
 	}
+	size_t end = g_headless.scriptLength;
+	if (g_headless.nextBreak < g_headless.numberBreaks)
+		end = g_headless.breaks[g_headless.nextBreak];
 	
-	setStatusMessage("Command not found.");
-	return;
+	if (g_inputHead == g_inputTail)
+		g_inputHead = g_inputTail = 0;
+	size_t count = end - g_headless.scriptOffset;
+	if (count > (size_t)(INPUT_BUFFER_SIZE - g_inputTail))
+		count = INPUT_BUFFER_SIZE - g_inputTail;
+	memcpy(&g_input[g_inputTail], &g_headless.script[g_headless.scriptOffset], count);
+	g_inputTail += count;
+	g_headless.scriptOffset += count;
+	return 1;
 }
 
-void drawStatusBar(struct ABUF *bff) {
-    bufferAppend(bff, "\x1b[7m", 4);
-    char status[80], rstatus[80];
+// runs the timers that are due and returns how long (in ms) until the next one, -1 if there is none.
+static int timersRun(int *repaint) {
+	int next = -1;
+	time_t now = time(NULL);
 	
-	float lines_percentage = 0.0f;
-	if (g_Configuration.numberRows >  0) lines_percentage = (float)g_Configuration.cursorY / g_Configuration.numberRows * 100.0f;
-    int length = snprintf(status, sizeof(status), "[%.50s] %s (%.1f%%)[line %u/%u][column %u/%u]",
-						g_Configuration.filename ? g_Configuration.filename : "New File",
-						g_Configuration.dirty ? "(modified)" : "",
-						lines_percentage,
-						g_Configuration.cursorY, g_Configuration.numberRows,
-						g_Configuration.cursorX, g_Configuration.screenCols);
-	int rlength = snprintf(rstatus, sizeof(rstatus), "%s", g_Configuration.syntax ? g_Configuration.syntax->filetype : " no syntax ");
-    
-    if (length > g_Configuration.screenCols)
-		length = g_Configuration.screenCols;
-    bufferAppend(bff, status, length);
-    
-    while (length < g_Configuration.screenCols) {
-		if (g_Configuration.screenCols - length == rlength) {
-			bufferAppend(bff, rstatus, rlength);
-			break;
-		} else {
-			bufferAppend(bff, " ", 1);
-			length++;
-		}
+	if (!g_statusExpired && g_Configuration.statusMessage[0] != '\0') {
+		time_t expiry = g_Configuration.statusMessageTime + STATUS_MESSAGE_SECONDS;
+		if (now >= expiry) {
+			g_statusExpired = 1;
+			*repaint = 1;
+		} else
+			next = (expiry - now) * 1000;
 	}
-    bufferAppend(bff, "\r\n", 2);
-    bufferAppend(bff, "\x1b[m", 3);
-    return;
+	if (g_doBackups == true && g_backupCounter > 0 && g_lastEditTime != 0) {
+		time_t due = g_lastEditTime + BACKUP_IDLE_SECONDS;
+		if (now >= due) {
+			g_lastEditTime = 0;
+			backupSave();
+			*repaint = 1;
+		} else if (next == -1 || (due - now) * 1000 < next)
+			next = (due - now) * 1000;
+	}
+	return next;
 }
 
-void drawRows(struct ABUF *bff) {
-    for (int y = 0; y < g_Configuration.screenRows; y++) {
-		int fileRow = y + g_Configuration.rowsOff;
-		if (fileRow >= g_Configuration.numberRows) {
-			if (g_Configuration.numberRows == 0 && y == g_Configuration.screenRows / 2) {
-				char welcomeMessage[80];
-				int welcomeLength = snprintf(welcomeMessage, sizeof(welcomeMessage), "Charlie %s, a little bad text editor", VERSION);
-				if (welcomeLength > g_Configuration.screenCols) welcomeLength = g_Configuration.screenCols;
-				
-				int padding = (g_Configuration.screenCols - welcomeLength) / 2;
-				if (padding) {
-//					bufferAppend(bff, COLUMN_SYMBOL, 1);
-					padding--;
-				}
-				while (padding--) bufferAppend(bff, " ", 1);
-				bufferAppend(bff, welcomeMessage, welcomeLength);
-			}// else {
-//				bufferAppend(bff, COLUMN_SYMBOL, 1); // this became an apendice, but i'll keep it here in case I change my mind
-//			}
-		} else {
-			int length = g_Configuration.rows[fileRow].rsize - g_Configuration.colsOff;
-			
-			if (length < 0) length = 0;
-			if (length > g_Configuration.screenCols)
-				length = g_Configuration.screenCols;
-			
-			unsigned char *highlight = &g_Configuration.rows[fileRow].highlight[g_Configuration.colsOff];
-			char *r = &g_Configuration.rows[fileRow].render[g_Configuration.colsOff];
-			int current_colour = -1;
-			for (int i = 0; i < length; i++) {
-				if (iscntrl(r[i])) {
-					char sym = (r[i] <= 26) ? '@' + r[i] : '?';
-					bufferAppend(bff, "\x1b[7m", 4);
-					bufferAppend(bff, &sym, 1);
-					bufferAppend(bff, "\x1b[m", 3);
-					if (current_colour != -1) {
-						char buffer[16];
-						int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", current_colour);
-						bufferAppend(bff, buffer, clen);
-					}
-				}
-				else if (highlight[i] == HL_NORMAL) {
-					if (current_colour != -1) {
-						bufferAppend(bff, "\x1b[39m", 5);
-						current_colour = -1;
-					}
-					bufferAppend(bff, &r[i], 1);
-				} else {
-					int colour = syntaxToColour(highlight[i]);
-					if (colour != current_colour) {
-						current_colour = colour;
-						char buffer[16];
-						
-						int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", colour);
-						bufferAppend(bff, buffer, clen);
-					}
-					bufferAppend(bff, &r[i], 1);
+// the only place where the editor sleeps: waits for input, a watched descriptor or a timer.
+// returns once there is something in the input buffer or 'timeout' (ms, -1 forever) is over.
+static void eventWait(int timeout) {
+	long long deadline = (timeout >= 0) ? monotonicMilliseconds() + timeout : -1;
+	
+	while (g_inputHead == g_inputTail) {
+		int repaint = 0;
+		int wait = timersRun(&repaint);
+		if (repaint)
+			refreshScreen();
+		if (deadline >= 0) {
+			long long left = deadline - monotonicMilliseconds();
+			if (left <= 0) return;
+			if (wait < 0 || left < wait) wait = left;
+		}
+		
+		struct pollfd descriptors[MAX_WATCHERS + 1];
+		descriptors[0].fd = g_headless.active ? -1 : STDIN_FILENO;
+		descriptors[0].events = POLLIN;
+		if (g_headless.active)
+			wait = 0; // the script is always ready, the watchers only get a look in between.
+		int count = g_numberWatchers;
+		for (int i = 0; i < count; i++) {
+			descriptors[i + 1].fd = g_watchers[i].fd;
+			descriptors[i + 1].events = POLLIN;
+		}
+		if (poll(descriptors, count + 1, wait) == -1) {
+			if (errno == EINTR) continue;
+			error("poll");
+		}
+		
+		repaint = 0;
+		for (int i = count - 1; i >= 0; i--) {
+			// callbacks may remove their own watcher, so look it up again.
+			if (!(descriptors[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			for (int j = 0; j < g_numberWatchers; j++) {
+				if (g_watchers[j].fd == descriptors[i + 1].fd) {
+					repaint |= g_watchers[j].callback();
+					break;
 				}
 			}
-			bufferAppend(bff, "\x1b[39m", 5);
-	  	}
-		bufferAppend(bff, "\x1b[K", 3);
-		bufferAppend(bff, "\r\n", 2);
-    }
+		}
+		if (descriptors[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			// everything the terminal has for us, in one go.
+			if (g_inputHead == g_inputTail)
+				g_inputHead = g_inputTail = 0;
+			ssize_t nread = read(STDIN_FILENO, &g_input[g_inputTail], INPUT_BUFFER_SIZE - g_inputTail);
+			if (nread == -1 && errno != EAGAIN && errno != EINTR)
+				error("read");
+			if (nread == 0 && (descriptors[0].revents & POLLHUP))
+				error("read");
+			if (nread > 0)
+				g_inputTail += nread;
+		}
+		if (repaint)
+			refreshScreen();
+		if (g_headless.active && !headlessFeed(timeout >= 0))
+			return;
+	}
+	return;
 }
 
-void refreshScreen(void) {
-    editorScroll();
-    
-    struct ABUF buffer = ABUF_INIT;
-    
-    bufferAppend(&buffer, "\x1b[?25l", 6);
-    bufferAppend(&buffer, "\x1b[H", 3);
-    
-    drawRows(&buffer);
-    drawStatusBar(&buffer);
-    drawStatusMessage(&buffer);
-    
-    char cursor[32];
-    snprintf(cursor, sizeof(cursor), "\x1b[%d;%dH", (g_Configuration.cursorY - g_Configuration.rowsOff) + 1, (g_Configuration.renderX - g_Configuration.colsOff) + 1);
-    bufferAppend(&buffer, cursor, strlen(cursor));
-    
-    bufferAppend(&buffer, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, buffer.buffer, buffer.length);
-    bufferFree(&buffer);
-    return;
+int inputByte(int timeout) {
+	if (g_inputHead == g_inputTail)
+		eventWait(timeout);
+	if (g_inputHead == g_inputTail)
+		return -1;
+	return g_input[g_inputHead++];
+}
+static int inputPending(void) {
+	// a script always has more keys queued, letting them cancel work would make runs unrepeatable.
+	if (g_headless.active)
+		return 0;
+	if (g_inputHead != g_inputTail)
+		return 1;
+	struct pollfd descriptor = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&descriptor, 1, 0) > 0;
 }
 
-void control(void) {
-	int next = readKey();
-	switch (next) {
-		case CTRL_KEY('o'):
-			file_open();
-			break;
-		case CTRL_KEY('c'):
-			command();
-			break;
-		case CTRL_KEY('s'):
-			save();
-			break;
-		case DELETE:			
-			if (g_Configuration.cursorX == g_Configuration.rows[g_Configuration.cursorY].size) return;
-			if (g_Configuration.cursorX == 0) {
-				deleteRow(g_Configuration.cursorY);
-				insertRow(g_Configuration.cursorY, "", 0);
-				g_Configuration.cursorX = 0;
-			} else {
-				ROW *row = &g_Configuration.rows[g_Configuration.cursorY];
-				for (int i = row->size; i > g_Configuration.cursorX - 1; --i)
-					rowDeleteChar(row, i);
-			}
+struct threadPool g_threadPool = { NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL };
+
+static void *poolWorker(void *argument) {
+	(void)argument;
+	while (1) {
+		pthread_mutex_lock(&g_threadPool.lock);
+		while (g_threadPool.head == NULL)
+			pthread_cond_wait(&g_threadPool.wake, &g_threadPool.lock);
+		struct poolTask *task = g_threadPool.head;
+		g_threadPool.head = task->next;
+		if (g_threadPool.head == NULL)
+			g_threadPool.tail = NULL;
+		pthread_mutex_unlock(&g_threadPool.lock);
+		
+		task->function(task->argument);
+		free(task);
+	}
+	return NULL;
+}
+static void poolInit(void) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1) cores = 1;
+	
+	g_threadPool.threads = malloc(sizeof(pthread_t) * cores);
+	if (g_threadPool.threads == NULL) return;
+	for (long i = 0; i < cores; i++) {
+		if (pthread_create(&g_threadPool.threads[g_threadPool.numberThreads], NULL, poolWorker, NULL) != 0)
 			break;
+		pthread_detach(g_threadPool.threads[g_threadPool.numberThreads]);
+		g_threadPool.numberThreads++;
 	}
 	return;
 }
-
-void centerScreen(void) {
-	int new_position = g_Configuration.cursorY - (g_Configuration.screenRows / 2) - 1;
-	setStatusMessage("%d", new_position);
-	if(new_position>0)
-		g_Configuration.rowsOff=new_position;
-	else
-		g_Configuration.rowsOff=0;
+// the workers are spawned the first time something needs them and live until exit.
+void poolSubmit(void (*function)(void *), void *argument) {
+	if (g_threadPool.threads == NULL)
+		poolInit();
+	struct poolTask *task = malloc(sizeof(struct poolTask));
+	if (task == NULL || g_threadPool.numberThreads == 0) {
+		// no pool available, so just do the work here.
+		free(task);
+		function(argument);
+		return;
+	}
+	task->function = function;
+	task->argument = argument;
+	task->next = NULL;
+	
+	pthread_mutex_lock(&g_threadPool.lock);
+	if (g_threadPool.tail) g_threadPool.tail->next = task;
+	else                   g_threadPool.head = task;
+	g_threadPool.tail = task;
+	pthread_cond_signal(&g_threadPool.wake);
+	pthread_mutex_unlock(&g_threadPool.lock);
 	return;
 }
-void keyPress(void) {
-    ROW *row = (g_Configuration.cursorY >= g_Configuration.numberRows) ? NULL : &g_Configuration.rows[g_Configuration.cursorY];
-    static int quit_times = QUIT_TIMES;
-    int c = readKey();
-    switch (c) {
-		case CTRL_KEY('c'): break;
-        case '\r':
-			insertNewLine();
+static void poolBatchWorker(void *argument) {
+	struct poolBatchTask *task = argument;
+	task->function(task->argument);
+	pthread_mutex_lock(&task->batch->lock);
+	task->batch->pending--;
+	pthread_cond_signal(&task->batch->done);
+	pthread_mutex_unlock(&task->batch->lock);
+	return;
+}
+// function() on each of the 'count' arguments, 'size' bytes apart, spread over the pool. returns once all are done.
+void poolRun(void (*function)(void *), void *arguments, size_t size, int count) {
+	struct poolBatchTask *tasks = malloc(sizeof(struct poolBatchTask) * count);
+	if (tasks == NULL || count == 1) {
+		free(tasks);
+		for (int i = 0; i < count; i++)
+			function((char *)arguments + i * size);
+		return;
+	}
+	struct poolBatch batch = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, count };
+	for (int i = 0; i < count; i++) {
+		tasks[i].batch = &batch;
+		tasks[i].function = function;
+		tasks[i].argument = (char *)arguments + i * size;
+		poolSubmit(poolBatchWorker, &tasks[i]);
+	}
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0)
+		pthread_cond_wait(&batch.done, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+	free(tasks);
+	return;
+}
+
+// the search "engine": every search in the editor matches against the row's chars.
+ssize_t searchRow(ROW *row, const char *query, size_t query_length) {
+	char *match = memmem(row->chars, row->size, query, query_length);
+	return match ? match - row->chars : -1;
+}
+
+static int searchJobRow(struct searchJob *job, int position) {
+	int row = (job->start + job->direction * position) % job->numberRows;
+	return row < 0 ? row + job->numberRows : row;
+}
+static void searchWorker(void *argument) {
+	struct searchJob *job = argument;
+	int chunk;
+	
+	while ((chunk = atomic_fetch_add(&job->nextChunk, 1)) < job->numberChunks) {
+		if (atomic_load(&job->cancel) || chunk > atomic_load(&job->limitChunk))
 			break;
-        case 27:
-			if (g_Configuration.dirty && quit_times > 0) {
-				setStatusMessage("File has unsaved changes! If you're sure, press ESC key %d more times to quit.", quit_times);
-				quit_times--;
-				return;
+		int first = chunk * SEARCH_CHUNK_ROWS + 1;
+		int last = first + SEARCH_CHUNK_ROWS;
+		if (last > job->numberRows + 1) last = job->numberRows + 1;
+		
+		int state = SC_MISS, row = -1;
+		ssize_t offset = -1;
+		for (int position = first; position < last; position++) {
+			if (atomic_load_explicit(&job->cancel, memory_order_relaxed))
+				break;
+			row = searchJobRow(job, position);
+			offset = searchRow(&g_Configuration.rows[row], job->query, job->queryLength);
+			if (offset != -1) {
+				state = SC_HIT;
+				break;
 			}
-			write(STDOUT_FILENO, "\x1b[2J", 4);
-			write(STDOUT_FILENO, "\x1b[H", 3);
-			exit(0);
-			break;
+		}
+		if (state == SC_HIT) {
+			int limit = atomic_load(&job->limitChunk);
+			while (chunk < limit && !atomic_compare_exchange_weak(&job->limitChunk, &limit, chunk));
+		}
+		pthread_mutex_lock(&job->lock);
+		job->chunks[chunk].state = state;
+		job->chunks[chunk].row = row;
+		job->chunks[chunk].offset = offset;
+		pthread_cond_signal(&job->changed);
+		pthread_mutex_unlock(&job->lock);
+	}
+	pthread_mutex_lock(&job->lock);
+	job->runningWorkers--;
+	pthread_cond_signal(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+	return;
+}
+// returns 1 and the nearest match walking from 'start' in 'direction' (wrapping around),
+// 0 when there is none and -1 if a keypress arrived before the answer was known.
+int searchRows(const char *query, int start, int direction, int *match_row, size_t *match_offset) {
+	size_t query_length = strlen(query);
+	int rows = g_Configuration.numberRows;
+	if (query_length == 0 || rows == 0)
+		return 0;
+	if (start < 0) start = (direction > 0) ? -1 : 0;
 	
-		case HOME:
-	    	g_Configuration.cursorX = 0;
-	    	break;
-		case END:
-	    	row = (g_Configuration.cursorY >= g_Configuration.numberRows) ? NULL : &g_Configuration.rows[g_Configuration.cursorY];
-	    	int rowLength = row ? row->size : 0;
-	    	if (g_Configuration.cursorX < rowLength) g_Configuration.cursorX = rowLength;
-	    	break;
-		
-		case CTRL_KEY('x'):
-			control();
-	    	break;
-
-		case CTRL_KEY('s'):
-	    	find();
-	    	break;
-
-		case DELETE:
-			if (g_Configuration.cursorY != 0) {
-				if (g_Configuration.cursorX != 0) rowDeleteChar(row, g_Configuration.cursorX);
-				else {
-					if (g_Configuration.rows[g_Configuration.cursorY].size > 0) rowDeleteChar(row, g_Configuration.cursorX);
-					else                                                        deleteRow(g_Configuration.cursorY);
-				}
-			} else {
-				if (g_Configuration.cursorX != 0) deleteRow(g_Configuration.cursorY + 1);
-				else {
-					deleteRow(g_Configuration.cursorY);
-					g_Configuration.cursorX = 0;
-				}
+	if (rows < SEARCH_PARALLEL_ROWS) {
+		int current = start;
+		for (int i = 0; i < rows; i++) {
+			current += direction;
+			if (current < 0)      current = rows - 1;
+			else if (current >= rows) current = 0;
+			
+			ssize_t offset = searchRow(&g_Configuration.rows[current], query, query_length);
+			if (offset != -1) {
+				*match_row = current;
+				*match_offset = offset;
+				return 1;
 			}
+		}
+		return 0;
+	}
+	
+	struct searchJob job;
+	job.query = query;
+	job.queryLength = query_length;
+	job.start = start;
+	job.direction = direction;
+	job.numberRows = rows;
+	job.numberChunks = (rows + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+	job.chunks = calloc(job.numberChunks, sizeof(struct searchChunk));
+	if (job.chunks == NULL)
+		return 0;
+	atomic_init(&job.nextChunk, 0);
+	atomic_init(&job.limitChunk, job.numberChunks);
+	atomic_init(&job.cancel, 0);
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.changed, NULL);
+	
+	if (g_threadPool.threads == NULL)
+		poolInit();
+	int workers = g_threadPool.numberThreads > 0 ? g_threadPool.numberThreads : 1;
+	if (workers > job.numberChunks) workers = job.numberChunks;
+	job.runningWorkers = workers;
+	for (int i = 0; i < workers; i++)
+		poolSubmit(searchWorker, &job);
+	
+	int result = 0, chunk = 0;
+	pthread_mutex_lock(&job.lock);
+	while (chunk < job.numberChunks) {
+		if (job.chunks[chunk].state == SC_MISS) {
+			chunk++;
+			continue;
+		}
+		if (job.chunks[chunk].state == SC_HIT) {
+			*match_row = job.chunks[chunk].row;
+			*match_offset = job.chunks[chunk].offset;
+			result = 1;
 			break;
+		}
+		if (job.runningWorkers == 0)
+			break; // could not happen, unless a worker gave up.
 		
-		case BACKSPACE:
-	    	deleteChar();
-	    	break;
-	
-		case PAGE_DOWN:
-		case PAGE_UP:
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 20 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&job.changed, &job.lock, &deadline) == ETIMEDOUT && inputPending()) {
+			result = -1;
+			break;
+		}
+	}
+	// nothing after this point is useful anymore, and the rows must not be touched once we return.
+	atomic_store(&job.cancel, 1);
+	while (job.runningWorkers > 0)
+		pthread_cond_wait(&job.changed, &job.lock);
+	pthread_mutex_unlock(&job.lock);
+	
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.changed);
+	free(job.chunks);
+	return result;
+}
+
+// -1 if there is no memory to keep it, and then the row's highlight can't be touched.
+static int highlightSave(struct savedHighlight *saved, int line) {
+	ROW *row = &g_Configuration.rows[line];
+	saved->line = line;
+	saved->rsize = row->rsize;
+	saved->size = row->size;
+	saved->highlight = malloc(row->rsize + 1);
+	saved->chars = malloc(row->size + 1);
+	if (saved->highlight == NULL || saved->chars == NULL) {
+		free(saved->highlight);
+		free(saved->chars);
+		saved->highlight = NULL;
+		saved->chars = NULL;
+		return -1;
+	}
+	memcpy(saved->highlight, row->highlight, row->rsize);
+	memcpy(saved->chars, row->chars, row->size);
+	return 0;
+}
+// puts the highlight back, if the row is still the one it came from. returns whether it was.
+static int highlightRestore(struct savedHighlight *saved) {
+	if (saved->highlight == NULL) return 0;
+	ROW *row = (saved->line < g_Configuration.numberRows) ? &g_Configuration.rows[saved->line] : NULL;
+	int same = row != NULL && row->highlight != NULL && row->rsize == saved->rsize && row->size == saved->size &&
+			   memcmp(row->chars, saved->chars, saved->size) == 0;
+	if (same)
+		memcpy(row->highlight, saved->highlight, row->rsize);
+	free(saved->highlight);
+	free(saved->chars);
+	saved->highlight = NULL;
+	saved->chars = NULL;
+	return same;
+}
+
+void findCallback(char *query, int key) {
+    static int last_match = -1;
+    static int direction = 1;
+	
+	static struct savedHighlight saved_highlight = { 0, NULL, 0, NULL, 0 };
+	highlightRestore(&saved_highlight);
+	
+    if (key == '\r' || key == '\x1b') {
+		last_match = -1;
+		direction = 1;
+		return;
+    }
+    else if (key == DOWN) {
+		direction = 1;
+    }
+    else if (key == UP) {
+		direction = -1;
+    }
+    else {
+		last_match = -1;
+		direction = 1;
+    }
+    
+    if (last_match == -1) direction = 1;
+    
+	long long trace = traceBegin();
+	int current, found;
+	size_t offset;
+	// the viewer has only a window of the file in rows, its search goes through the file itself.
+	if (g_Configuration.view)
+		found = viewSearch(query, g_Configuration.viewFirst + (last_match == -1 ? g_Configuration.cursorY - 1 : last_match),
+						   direction, &current, &offset);
+	else
+		found = searchRows(query, last_match, direction, &current, &offset);
+	g_macro.searchMissed = found != 1;
+	if (found == 1) {
+		ROW *row = &g_Configuration.rows[current];
+		rowEnsureRender(row);
+		size_t renderStart = rowCxToBx(row, offset);
+		size_t renderEnd = rowCxToBx(row, offset + strlen(query));
+		
+		last_match = current;
+		g_Configuration.cursorY = current;
+		g_Configuration.cursorX = offset;
+		g_Configuration.rowsOff = g_Configuration.numberRows;
+		
+		if (highlightSave(&saved_highlight, current) == 0)
+			memset(&row->highlight[renderStart], HL_MATCH, renderEnd - renderStart);
+	}
+	traceEnd("findCallback", trace);
+}
+
+void find(void) {
+    size_t savedColsOff = g_Configuration.colsOff;
+    int savedRowsOff = g_Configuration.rowsOff;
+    size_t savedCursorX = g_Configuration.cursorX;
+    int savedCursorY = g_Configuration.cursorY;
+	long long savedViewFirst = g_Configuration.viewFirst;
+    
+    char *query = prompt("Search for: %s", PC_SEARCH, findCallback);
+	if (query && g_macro.replaying)
+		g_macro.searched = 1;
+	// searches start over from the top, so a replayed one that lands above where it started has run out.
+	if (query && g_macro.replaying &&
+		(g_macro.searchMissed || g_Configuration.viewFirst + g_Configuration.cursorY < savedViewFirst + savedCursorY ||
+		 (g_Configuration.viewFirst + g_Configuration.cursorY == savedViewFirst + savedCursorY && g_Configuration.cursorX < savedCursorX)))
+		g_macro.stopped = MS_SEARCH;
+    if (query)
+		free(query);
+    else {
+		if (g_Configuration.view && g_Configuration.viewFirst != savedViewFirst) {
+			viewLoad(savedViewFirst + savedCursorY);
+			savedRowsOff += savedViewFirst - g_Configuration.viewFirst;
+			savedCursorY += savedViewFirst - g_Configuration.viewFirst;
+		}
+		g_Configuration.colsOff = savedColsOff;
+		g_Configuration.rowsOff = savedRowsOff;
+		g_Configuration.cursorX = savedCursorX;
+		g_Configuration.cursorY = savedCursorY;
+    }
+    return;
+}
+
+void file_open(void) {
+	char *file_path = prompt("Open file at: %s", PC_OPEN, NULL);
+	if (file_path == NULL) {
+		setStatusMessage("Opening file operation aborted.");
+		return;
+	}
+	editorOpen(file_path);
+	g_backupCounter = 0;
+	refreshScreen();
+	return;
+}
+
+void gotoLine(int number) {
+	if (g_Configuration.view) {
+		viewGoto(number);
+		return;
+	}
+	if (number < 0)
+		g_Configuration.cursorY = 0;
+	else {
+		if (number < g_Configuration.numberRows)
+			g_Configuration.cursorY = number;
+		else
+			g_Configuration.cursorY = g_Configuration.numberRows;
+	}
+	g_Configuration.cursorX = 0;
+	centerScreen();
+	setStatusMessage("Cursor placed in %d line.", g_Configuration.cursorY);
+	return;
+}
+void goto_line(void) {
+	char *input_number = prompt("Go to line: %s", PC_GOTO, NULL);
+	if (input_number == NULL) {
+		setStatusMessage("Goto-line operation aborted.");
+		return;
+	}
+	if (g_Configuration.view) viewGoto(strtoll(input_number, NULL, 10));
+	else                      gotoLine(atoi(input_number));
+	free(input_number);
+	return;
+}
+
+struct editorConfig *bufferAt(int index) {
+	return (index == g_currentBuffer) ? &g_Configuration : &g_buffers[index];
+}
+
+void bufferReset(void) {
+    g_Configuration.cursorX = 0; g_Configuration.cursorY = 0;
+    g_Configuration.renderX = 0;
+    
+    g_Configuration.rowsOff = 0;
+    g_Configuration.colsOff = 0;
+    
+    g_Configuration.numberRows = 0;
+    g_Configuration.rows = NULL;
+    g_Configuration.dirty = 0;
+	
+    g_Configuration.filename = NULL;
+	g_Configuration.bufferType = BT_FILE;
+	g_Configuration.syntax = NULL;
+	
+	g_Configuration.markX = 0;
+	g_Configuration.markY = 0;
+	g_Configuration.markSet = 0;
+	g_Configuration.partial = 0;
+	
+	g_Configuration.watch = -1;
+	g_Configuration.diskSize = -1;
+	g_Configuration.diskChanged = 0;
+	
+	g_Configuration.follow = 0;
+	g_Configuration.followFd = -1;
+	g_Configuration.followDirectory = -1;
+	
+	g_Configuration.codec = NULL;
+	g_Configuration.view = NULL;
+	g_Configuration.viewFirst = 0;
+	return;
+}
+static void bufferRelease(void) {
+	followStop();
+	fileUnwatch();
+	if (g_Configuration.view)
+		viewIndexFree(g_Configuration.view);
+	for (int i = 0; i < g_Configuration.numberRows; i++)
+		freeRow(&g_Configuration.rows[i]);
+	free(g_Configuration.rows);
+	free(g_Configuration.filename);
+	return;
+}
+// empties a generated buffer (*grep*, *buffers*...) before filling it again.
+static void bufferClear(void) {
+	for (int i = 0; i < g_Configuration.numberRows; i++)
+		freeRow(&g_Configuration.rows[i]);
+	g_Configuration.numberRows = 0;
+	g_Configuration.cursorX = g_Configuration.cursorY = 0;
+	g_Configuration.rowsOff = 0;
+	g_Configuration.colsOff = 0;
+	g_Configuration.dirty = 0;
+	return;
+}
+// switches to the generated buffer called 'name', creating it with 'type' if needed, and empties it.
+static int bufferScratch(const char *name, int type) {
+	int index = bufferFind(name);
+	if (index != -1)
+		bufferSwitch(index);
+	else {
+		bufferLeave();
+		if (bufferNew() == -1) {
+			setStatusMessage("Failed to allocate a new buffer.");
+			return -1;
+		}
+		g_Configuration.filename = strdup(name);
+		g_Configuration.bufferType = type;
+	}
+	bufferClear();
+	return g_currentBuffer;
+}
+// the terminal, the screen size and the status message belong to the editor, not to a buffer.
+static void bufferLoad(int index) {
+	struct editorConfig shared = g_Configuration;
+	g_Configuration = g_buffers[index];
+	g_Configuration.m_OriginalTermios = shared.m_OriginalTermios;
+	g_Configuration.screenRows = shared.screenRows;
+	g_Configuration.screenCols = shared.screenCols;
+	g_Configuration.statusMessageTime = shared.statusMessageTime;
+	memcpy(g_Configuration.statusMessage, shared.statusMessage, sizeof(shared.statusMessage));
+	g_currentBuffer = index;
+	return;
+}
+// swaps the active buffer without side effects, for code that needs to touch a buffer in the background.
+void bufferActivate(int index) {
+	if (index == g_currentBuffer || index < 0 || index >= g_numberBuffers) return;
+	g_buffers[g_currentBuffer] = g_Configuration;
+	bufferLoad(index);
+	return;
+}
+int bufferNew(void) {
+	struct editorConfig *buffers = realloc(g_buffers, sizeof(struct editorConfig) * (g_numberBuffers + 1));
+	if (buffers == NULL) return -1;
+	g_buffers = buffers;
+	g_buffers[g_currentBuffer] = g_Configuration;
+	g_currentBuffer = g_numberBuffers++;
+	bufferReset();
+	return g_currentBuffer;
+}
+// the viewer shows files too big to be held, nothing typed goes into them.
+static int bufferReadOnly(void) {
+	if (g_Configuration.bufferType != BT_VIEW) return 0;
+	setStatusMessage("%s is open read-only.", g_Configuration.filename);
+	return 1;
+}
+static int bufferIsScratch(void) {
+	return g_Configuration.filename == NULL && g_Configuration.numberRows == 0 &&
+		   !g_Configuration.dirty && g_Configuration.bufferType == BT_FILE;
+}
+// the pending backup counter is editor-wide, so it is settled before leaving a buffer.
+void bufferLeave(void) {
+	if (g_doBackups == true && g_backupCounter > 0)
+		backupSave();
+	g_backupCounter = 0;
+	return;
+}
+
+int bufferFind(const char *name) {
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		if (buffer->filename && strcmp(buffer->filename, name) == 0)
+			return i;
+	}
+	return -1;
+}
+static int bufferFindFile(const char *file_path) {
+	struct stat wanted, visited;
+	if (stat(file_path, &wanted) == -1)
+		return -1;
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		if ((buffer->bufferType != BT_FILE && buffer->bufferType != BT_VIEW) || buffer->filename == NULL) continue;
+		if (stat(buffer->filename, &visited) == 0 && visited.st_dev == wanted.st_dev && visited.st_ino == wanted.st_ino)
+			return i;
+	}
+	return -1;
+}
+int bufferAnyDirty(void) {
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		if (buffer->dirty && buffer->bufferType == BT_FILE)
+			return 1;
+	}
+	return 0;
+}
+
+void bufferSwitch(int index) {
+	if (index < 0 || index >= g_numberBuffers) {
+		setStatusMessage("No such buffer.");
+		return;
+	}
+	if (index == g_currentBuffer) return;
+	bufferLeave();
+	bufferActivate(index);
+	setStatusMessage("Buffer %d: %s", index, g_Configuration.filename ? g_Configuration.filename : "New File");
+	return;
+}
+
+// accepts a buffer number, a name or a piece of one.
+void buffer_switch(void) {
+	char *name = prompt("Switch to buffer: %s", PC_BUFFER, NULL);
+	if (name == NULL) {
+		setStatusMessage("Buffer switch aborted.");
+		return;
+	}
+	char *end;
+	long number = strtol(name, &end, 10);
+	int index = (*end == '\0') ? (int)number : bufferFind(name);
+	for (int i = 0; index == -1 && i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		if (buffer->filename && strstr(buffer->filename, name))
+			index = i;
+	}
+	free(name);
+	bufferSwitch(index);
+	return;
+}
+
+void bufferClose(void) {
+	if (g_Configuration.dirty && g_Configuration.bufferType == BT_FILE) {
+		setStatusMessage("Buffer has unsaved changes! Close it anyway? (y/n)");
+		refreshScreen();
+		if (readKey() != 'y') {
+			setStatusMessage("Buffer close aborted.");
+			return;
+		}
+	}
+	if (g_Configuration.bufferType == BT_GREP)
+		grepCancel();
+	if (g_load != NULL && bufferFind(g_load->path) == g_currentBuffer)
+		loadCancel();
+	if (g_Configuration.bufferType == BT_FILE && g_backupCounter > 0)
+		g_backupCounter = 0;
+	
+	bufferRelease();
+	if (g_numberBuffers == 1) {
+		bufferReset();
+		setStatusMessage("Buffer closed.");
+		return;
+	}
+	memmove(&g_buffers[g_currentBuffer], &g_buffers[g_currentBuffer + 1], sizeof(struct editorConfig) * (g_numberBuffers - g_currentBuffer - 1));
+	g_numberBuffers--;
+	bufferLoad(g_currentBuffer < g_numberBuffers ? g_currentBuffer : g_numberBuffers - 1);
+	setStatusMessage("Buffer closed.");
+	return;
+}
+
+void bufferList(void) {
+	if (bufferScratch(BUFFERS_BUFFER, BT_BUFFERS) == -1)
+		return;
+	
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		char line[PATH_MAX + 64];
+		int length = snprintf(line, sizeof(line), "%d %s %s (%d lines)", i,
+							  buffer->dirty && buffer->bufferType == BT_FILE ? "*" : " ",
+							  buffer->filename ? buffer->filename : "New File", buffer->numberRows);
+		if (length >= (int)sizeof(line)) length = sizeof(line) - 1;
+		insertRow(g_Configuration.numberRows, line, length);
+	}
+	g_Configuration.dirty = 0;
+	setStatusMessage("%d buffers. Press enter to switch to one.", g_numberBuffers);
+	return;
+}
+void bufferVisit(void) {
+	if (g_Configuration.cursorY >= g_Configuration.numberRows) return;
+	bufferSwitch(atoi(g_Configuration.rows[g_Configuration.cursorY].chars));
+	return;
+}
+
+// render and highlight only cost memory, both come back from chars whenever a row is looked at again.
+void rowCompact(ROW *row) {
+	if (row->render == NULL) return;
+	g_derivedBytes -= 2 * (long long)row->rsize + 1;
+	free(row->render);
+	free(row->highlight);
+	free(row->columns);
+	free(row->cells);
+	row->render = NULL;
+	row->highlight = NULL;
+	row->columns = NULL;
+	row->numberColumns = -1;
+	row->cells = NULL;
+	return;
+}
+// anything reading render or highlight calls this first. the row has to belong to the active buffer.
+void rowEnsureRender(ROW *row) {
+	if (row->render == NULL)
+		updateRowNow(row);
+	return;
+}
+
+// drops what can be rebuilt everywhere but around the active buffer's viewport, returns the bytes freed.
+long long memoryCompact(void) {
+	long long before = g_derivedBytes;
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		int keep_from = 0, keep_to = 0;
+		if (i == g_currentBuffer) {
+			keep_from = buffer->rowsOff - COMPACT_MARGIN;
+			keep_to = buffer->rowsOff + buffer->screenRows + COMPACT_MARGIN;
+		}
+		for (int y = 0; y < buffer->numberRows; y++) {
+			if (y >= keep_from && y < keep_to) continue;
+			rowCompact(&buffer->rows[y]);
+		}
+	}
+	return before - g_derivedBytes;
+}
+void memoryCheck(void) {
+	if (g_memoryBudget > 0 && g_derivedBytes > g_memoryBudget)
+		memoryCompact();
+	return;
+}
+
+static void memoryFormat(long long bytes, char *out, size_t size) {
+	if (bytes >= 1 << 30)      snprintf(out, size, "%.2f GB", bytes / (double)(1 << 30));
+	else if (bytes >= 1 << 20) snprintf(out, size, "%.2f MB", bytes / (double)(1 << 20));
+	else if (bytes >= 1 << 10) snprintf(out, size, "%.2f KB", bytes / (double)(1 << 10));
+	else                       snprintf(out, size, "%lld B", bytes);
+	return;
+}
+
+enum MEMORY_COMPONENTS {
+	MC_ROWS = 0,
+	MC_CHARS,
+	MC_RENDER,
+	MC_HIGHLIGHT,
+	MC_COLUMNS,
+	MC_TOTAL,
+};
+
+void memoryReport(void) {
+	static const char *names[] = { "row structs", "chars", "render", "highlight", "column index", "total" };
+	if (bufferScratch(MEMORY_BUFFER, BT_MEMORY) == -1)
+		return;
+	
+	long long all[MC_TOTAL + 1] = { 0 };
+	char line[PATH_MAX + 256], amount[32];
+	int length;
+	insertRow(g_Configuration.numberRows, "by buffer:", 10);
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		long long bytes[MC_TOTAL + 1] = { 0 };
+		int compacted = 0;
+		
+		bytes[MC_ROWS] = (long long)buffer->numberRows * sizeof(ROW);
+		for (int y = 0; y < buffer->numberRows; y++) {
+			ROW *row = &buffer->rows[y];
+			bytes[MC_CHARS] += row->size + 1;
+			if (row->render == NULL) compacted++;
+			else                     bytes[MC_RENDER] += row->rsize + 1;
+			if (row->highlight)         bytes[MC_HIGHLIGHT] += row->rsize;
+			if (row->numberColumns > 0) bytes[MC_COLUMNS] += row->numberColumns * sizeof(struct columnStop);
+			if (row->cells)             bytes[MC_COLUMNS] += (row->numberCells + 1) * sizeof(struct cellStop);
+		}
+		for (int c = 0; c < MC_TOTAL; c++) {
+			bytes[MC_TOTAL] += bytes[c];
+			all[c] += bytes[c];
+		}
+		all[MC_TOTAL] += bytes[MC_TOTAL];
+		
+		memoryFormat(bytes[MC_TOTAL], amount, sizeof(amount));
+		length = snprintf(line, sizeof(line), "  %d %s: %s, %d rows (%d compacted), render + highlight %.0f%% of chars", i,
+						  buffer->filename ? buffer->filename : "New File", amount, buffer->numberRows, compacted,
+						  bytes[MC_CHARS] ? 100.0 * (bytes[MC_RENDER] + bytes[MC_HIGHLIGHT]) / bytes[MC_CHARS] : 0.0);
+		if (length >= (int)sizeof(line)) length = sizeof(line) - 1;
+		insertRow(g_Configuration.numberRows, line, length);
+	}
+	
+	insertRow(g_Configuration.numberRows, "", 0);
+	insertRow(g_Configuration.numberRows, "by component, all buffers:", 26);
+	for (int c = 0; c <= MC_TOTAL; c++) {
+		memoryFormat(all[c], amount, sizeof(amount));
+		length = snprintf(line, sizeof(line), "  %-14s %12s  (%lld bytes)", names[c], amount, all[c]);
+		insertRow(g_Configuration.numberRows, line, length);
+	}
+	
+	insertRow(g_Configuration.numberRows, "", 0);
+	memoryFormat(g_derivedBytes, amount, sizeof(amount));
+	if (g_memoryBudget > 0) {
+		char budget[32];
+		memoryFormat(g_memoryBudget, budget, sizeof(budget));
+		length = snprintf(line, sizeof(line), "render + highlight: %s of a %s budget", amount, budget);
+	} else
+		length = snprintf(line, sizeof(line), "render + highlight: %s, no budget set", amount);
+	insertRow(g_Configuration.numberRows, line, length);
+	
+	g_Configuration.dirty = 0;
+	setStatusMessage("Memory in use by the buffers: %lld bytes.", all[MC_TOTAL]);
+	return;
+}
+void memoryBudget(void) {
+	char *input = prompt("Memory budget for render + highlight, in MB (0 for none): %s", PC_BUDGET, NULL);
+	if (input == NULL) {
+		setStatusMessage("Memory budget unchanged.");
+		return;
+	}
+	g_memoryBudget = atoll(input) * (1 << 20);
+	free(input);
+	if (g_memoryBudget <= 0) {
+		g_memoryBudget = 0;
+		setStatusMessage("Memory budget removed.");
+		return;
+	}
+	long long freed = memoryCompact();
+	setStatusMessage("Memory budget set, %lld bytes freed.", freed);
+	return;
+}
+
+struct shellJob g_shell = { 0, -1, 0, 0, ABUF_INIT };
+
+// appends to the *shell* buffer (if it's still open) without leaving the current one.
+static void shellAppend(const char *data, int length) {
+	int index = bufferFind(SHELL_BUFFER);
+	int previous = g_currentBuffer;
+	if (index != -1)
+		bufferActivate(index);
+	
+	const char *end = data + length;
+	while (data < end) {
+		const char *newline = memchr(data, '\n', end - data);
+		if (newline == NULL) {
+			bufferAppend(&g_shell.partial, data, end - data);
+			break;
+		}
+		bufferAppend(&g_shell.partial, data, newline - data);
+		size_t line_length = g_shell.partial.length;
+		if (line_length > 0 && g_shell.partial.buffer[line_length - 1] == '\r') line_length--;
+		if (index != -1)
+			insertRow(g_Configuration.numberRows, g_shell.partial.buffer ? g_shell.partial.buffer : "", line_length);
+		g_shell.partial.length = 0;
+		data = newline + 1;
+	}
+	if (index != -1) {
+		g_Configuration.dirty = 0;
+		bufferActivate(previous);
+	}
+	return;
+}
+static void shellFinish(void) {
+	char line[64];
+	int length;
+	if (WIFSIGNALED(g_shell.status))
+		length = snprintf(line, sizeof(line), "[killed by signal %d]\n", WTERMSIG(g_shell.status));
+	else
+		length = snprintf(line, sizeof(line), "[exit %d]\n", WEXITSTATUS(g_shell.status));
+	shellAppend(line, length);
+	
+	if (WIFSIGNALED(g_shell.status)) setStatusMessage("Shell command killed by signal %d.", WTERMSIG(g_shell.status));
+	else                             setStatusMessage("Shell command finished with exit code %d.", WEXITSTATUS(g_shell.status));
+	g_shell.pid = 0;
+	return;
+}
+
+static int shellPoll(void) {
+	char data[SHELL_READ_SIZE];
+	ssize_t nread = read(g_shell.output, data, sizeof(data));
+	if (nread > 0) {
+		shellAppend(data, nread);
+		return 1;
+	}
+	if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	
+	// EOF: flush a last line without a newline, and finish if the child is already gone.
+	watchRemove(g_shell.output);
+	close(g_shell.output);
+	g_shell.output = -1;
+	if (g_shell.partial.length > 0)
+		shellAppend("\n", 1);
+	if (g_shell.exited)
+		shellFinish();
+	return 1;
+}
+int childPoll(void) {
+	char drain[32];
+	while (read(g_childPipe[0], drain, sizeof(drain)) > 0);
+	if (g_shell.pid <= 0 || g_shell.exited)
+		return 0;
+	if (waitpid(g_shell.pid, &g_shell.status, WNOHANG) != g_shell.pid)
+		return 0;
+	g_shell.exited = 1;
+	if (g_shell.output == -1)
+		shellFinish();
+	return 1;
+}
+
+// spawns /bin/sh -c 'command' on its own session. stdin is /dev/null when 'input' is -1
+// and stderr goes with stdout when 'errors' is -1.
+pid_t spawnShell(const char *shell_command, int input, int output, int errors) {
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	setsid();
+	signal(SIGPIPE, SIG_DFL);
+	if (input == -1)
+		input = open("/dev/null", O_RDONLY);
+	dup2(input, STDIN_FILENO);
+	dup2(output, STDOUT_FILENO);
+	dup2(errors == -1 ? output : errors, STDERR_FILENO);
+	execl("/bin/sh", "sh", "-c", shell_command, (char *)NULL);
+	_exit(127);
+}
+
+// until both the child was reaped and its output reached EOF. a background job it left behind
+// keeps the pipe open after the child itself is gone.
+static int shellRunning(void) {
+	return g_shell.pid > 0;
+}
+
+void shell(void) {
+	if (shellRunning()) {
+		setStatusMessage("A shell command is still running, shell-kill stops it.");
+		return;
+	}
+	char *shell_command = prompt("Shell command: %s", PC_SHELL, NULL);
+	if (shell_command == NULL) {
+		setStatusMessage("Shell command operation aborted.");
+		return;
+	}
+	int descriptors[2];
+	if (pipe2(descriptors, O_CLOEXEC) == -1) {
+		setStatusMessage("Command could not be started: %s", strerror(errno));
+		free(shell_command);
+		return;
+	}
+	
+	// the output goes to *shell*, created (or emptied) in the background: we stay where we are.
+	int previous = g_currentBuffer;
+	int index = bufferFind(SHELL_BUFFER);
+	if (index != -1)
+		bufferActivate(index);
+	else if (bufferNew() != -1) {
+		g_Configuration.filename = strdup(SHELL_BUFFER);
+		g_Configuration.bufferType = BT_SHELL;
+	} else {
+		close(descriptors[0]);
+		close(descriptors[1]);
+		setStatusMessage("Command could not be started: no memory for %s.", SHELL_BUFFER);
+		free(shell_command);
+		return;
+	}
+	bufferClear();
+	bufferActivate(previous);
+	
+	g_shell.partial.length = 0;
+	g_shell.exited = 0;
+	g_shell.pid = spawnShell(shell_command, -1, descriptors[1], -1);
+	close(descriptors[1]);
+	if (g_shell.pid == -1) {
+		g_shell.pid = 0;
+		close(descriptors[0]);
+		setStatusMessage("Command could not be started: %s", strerror(errno));
+		free(shell_command);
+		return;
+	}
+	fcntl(descriptors[0], F_SETFL, O_NONBLOCK);
+	g_shell.output = descriptors[0];
+	watchAdd(g_shell.output, shellPoll);
+	
+	char header[SHELL_READ_SIZE];
+	int length = snprintf(header, sizeof(header), "$ %s\n", shell_command);
+	if (length >= (int)sizeof(header)) length = sizeof(header) - 1;
+	shellAppend(header, length);
+	setStatusMessage("Running in %s: %s", SHELL_BUFFER, shell_command);
+	free(shell_command);
+	return;
+}
+// the whole session gets the signal, background jobs included, and we stop waiting for the pipe.
+void shellKill(void) {
+	if (!shellRunning()) {
+		setStatusMessage("No shell command running.");
+		return;
+	}
+	kill(-g_shell.pid, SIGTERM);
+	setStatusMessage("Sent SIGTERM to the shell command.");
+	if (g_shell.output != -1) {
+		watchRemove(g_shell.output);
+		close(g_shell.output);
+		g_shell.output = -1;
+		if (g_shell.partial.length > 0)
+			shellAppend("\n", 1);
+		if (g_shell.exited)
+			shellFinish();
+	}
+	return;
+}
+
+// the marked region (or the whole buffer without a mark) in order: from (*start_y, *start_x) up to,
+// not including, (*end_y, *end_x). *end_y may be numberRows, meaning the end of the buffer.
+void regionBounds(int *start_y, size_t *start_x, int *end_y, size_t *end_x) {
+	if (!g_Configuration.markSet) {
+		*start_y = 0;
+		*start_x = *end_x = 0;
+		*end_y = g_Configuration.numberRows;
+		return;
+	}
+	int mark_y = g_Configuration.markY;
+	size_t mark_x = g_Configuration.markX;
+	if (mark_y > g_Configuration.numberRows) {
+		mark_y = g_Configuration.numberRows;
+		mark_x = 0;
+	}
+	if (mark_y < g_Configuration.numberRows && mark_x > g_Configuration.rows[mark_y].size)
+		mark_x = g_Configuration.rows[mark_y].size;
+	
+	if (mark_y < g_Configuration.cursorY || (mark_y == g_Configuration.cursorY && mark_x < g_Configuration.cursorX)) {
+		*start_y = mark_y; *start_x = mark_x;
+		*end_y = g_Configuration.cursorY; *end_x = g_Configuration.cursorX;
+	} else {
+		*start_y = g_Configuration.cursorY; *start_x = g_Configuration.cursorX;
+		*end_y = mark_y; *end_x = mark_x;
+	}
+	if (*end_y == g_Configuration.numberRows) *end_x = 0;
+	return;
+}
+// the region as text, rows joined by '\n' (and ended by one if it reaches the end of the buffer).
+char *regionString(int start_y, size_t start_x, int end_y, size_t end_x, size_t *length) {
+	struct ABUF text = ABUF_INIT;
+	for (int y = start_y; y <= end_y && y < g_Configuration.numberRows; y++) {
+		ROW *row = &g_Configuration.rows[y];
+		size_t from = (y == start_y) ? start_x : 0;
+		size_t to = (y == end_y) ? end_x : row->size;
+		bufferAppend(&text, &row->chars[from], to - from);
+		if (y != end_y)
+			bufferAppend(&text, "\n", 1);
+	}
+	*length = text.length;
+	if (text.buffer == NULL)
+		text.buffer = calloc(1, 1);
+	return text.buffer;
+}
+
+// puts 'text' where the region was: one memmove to insert the new rows and one to drop the old.
+// only the rows that come out of 'text' are built (rendered, highlighted), the rest stays as it is.
+// -1 (and the buffer untouched) when the new rows do not fit.
+int regionReplace(int start_y, size_t start_x, int end_y, size_t end_x, const char *text, size_t length) {
+	int last_y = (end_y < g_Configuration.numberRows) ? end_y : g_Configuration.numberRows - 1;
+	struct ABUF prefix = ABUF_INIT, suffix = ABUF_INIT;
+	if (start_y < g_Configuration.numberRows)
+		bufferAppend(&prefix, g_Configuration.rows[start_y].chars, start_x);
+	if (end_y < g_Configuration.numberRows)
+		bufferAppend(&suffix, &g_Configuration.rows[end_y].chars[end_x], g_Configuration.rows[end_y].size - end_x);
+	
+	// at the end of the buffer a trailing newline does not make an extra empty row, and nothing at all
+	// after the start of a line makes no row.
+	int count = 1;
+	if (end_y >= g_Configuration.numberRows && length == 0 && prefix.length == 0)
+		count = 0;
+	else if (end_y >= g_Configuration.numberRows && length > 0 && text[length - 1] == '\n')
+		length--;
+	
+	for (const char *newline = text; count > 0 && (newline = memchr(newline, '\n', text + length - newline)) != NULL; newline++)
+		count++;
+	ROW *rows = malloc(sizeof(ROW) * (count > 0 ? count : 1));
+	if (rows == NULL) {
+		bufferFree(&prefix);
+		bufferFree(&suffix);
+		setStatusMessage("No room for the new lines, buffer untouched.");
+		return -1;
+	}
+	const char *line = text, *end = text + length;
+	for (int i = 0; i < count; i++) {
+		const char *newline = memchr(line, '\n', end - line);
+		if (newline == NULL) newline = end;
+		struct ABUF built = ABUF_INIT;
+		if (i == 0) bufferAppend(&built, prefix.buffer, prefix.length);
+		bufferAppend(&built, line, newline - line);
+		if (i == count - 1) bufferAppend(&built, suffix.buffer, suffix.length);
+		rows[i] = rowNew(built.buffer ? built.buffer : "", built.length);
+		bufferFree(&built);
+		line = newline + 1;
+	}
+	bufferFree(&prefix);
+	bufferFree(&suffix);
+	
+	// the new rows go in after the old ones first, so running out of memory loses nothing.
+	if (insertRows(last_y >= start_y ? last_y + 1 : start_y, rows, count) == -1) {
+		rowsFree(rows, count);
+		setStatusMessage("No room for the new lines, buffer untouched.");
+		return -1;
+	}
+	free(rows);
+	if (last_y >= start_y)
+		deleteRows(start_y, last_y - start_y + 1);
+	
+	g_Configuration.cursorY = start_y;
+	g_Configuration.cursorX = start_x;
+	g_Configuration.markSet = 0;
+	g_Configuration.dirty++;
+	if (g_doBackups == true)
+		g_backupCounter++;
+	return 0;
+}
+
+// kill-region, copy-region and yank work on the region like filter does, so a block of any size costs
+// one regionString() and one regionReplace(): a memmove for the rows, a splice for the partial ends.
+static int killSpotCurrent(struct killSpot *spot) {
+	return spot->buffer == g_currentBuffer && spot->dirty == g_Configuration.dirty &&
+		   spot->endY == g_Configuration.cursorY && spot->endX == g_Configuration.cursorX;
+}
+static void killSpotSet(struct killSpot *spot, int start_y, size_t start_x) {
+	spot->buffer = g_currentBuffer;
+	spot->dirty = g_Configuration.dirty;
+	spot->startY = start_y;
+	spot->startX = start_x;
+	spot->endY = g_Configuration.cursorY;
+	spot->endX = g_Configuration.cursorX;
+	return;
+}
+// takes 'text'. 'append' adds it to the newest entry instead, for kills in a row.
+static void killPush(char *text, size_t length, int append) {
+	if (append && g_killRing.count > 0) {
+		int first = g_killRing.first;
+		char *joined = realloc(g_killRing.texts[first], g_killRing.lengths[first] + length + 1);
+		if (joined != NULL) {
+			memcpy(&joined[g_killRing.lengths[first]], text, length + 1);
+			g_killRing.texts[first] = joined;
+			g_killRing.lengths[first] += length;
+			free(text);
+			return;
+		}
+	}
+	g_killRing.first = (g_killRing.first + KILL_RING_SIZE - 1) % KILL_RING_SIZE;
+	if (g_killRing.count == KILL_RING_SIZE)
+		free(g_killRing.texts[g_killRing.first]);
+	else
+		g_killRing.count++;
+	g_killRing.texts[g_killRing.first] = text;
+	g_killRing.lengths[g_killRing.first] = length;
+	return;
+}
+// the region as a new kill ring entry, NULL (and the mark dropped) if it is empty.
+static char *regionTake(int *start_y, size_t *start_x, int *end_y, size_t *end_x, size_t *length) {
+	if (!g_Configuration.markSet) {
+		setStatusMessage("The mark is not set, C-space sets it.");
+		return NULL;
+	}
+	regionBounds(start_y, start_x, end_y, end_x);
+	char *text = regionString(*start_y, *start_x, *end_y, *end_x, length);
+	if (*length == 0) {
+		free(text);
+		g_Configuration.markSet = 0;
+		setStatusMessage("The region is empty.");
+		return NULL;
+	}
+	return text;
+}
+void regionKill(void) {
+	if (bufferReadOnly()) return;
+	int start_y, end_y;
+	size_t start_x, end_x, length;
+	char *text = regionTake(&start_y, &start_x, &end_y, &end_x, &length);
+	if (text == NULL) return;
+	killPush(text, length, 0);
+	if (regionReplace(start_y, start_x, end_y, end_x, "", 0) == -1) return;
+	setStatusMessage("Killed %zu bytes.", length);
+	return;
+}
+void regionCopy(void) {
+	int start_y, end_y;
+	size_t start_x, end_x, length;
+	char *text = regionTake(&start_y, &start_x, &end_y, &end_x, &length);
+	if (text == NULL) return;
+	killPush(text, length, 0);
+	g_Configuration.markSet = 0;
+	setStatusMessage("Copied %zu bytes.", length);
+	return;
+}
+// the rest of the line, or the newline when there is nothing else. kills one after the other
+// (C-k C-k C-k) pile up in one entry, yanked back as a whole.
+void killLine(void) {
+	if (bufferReadOnly()) return;
+	int y = g_Configuration.cursorY;
+	size_t x = g_Configuration.cursorX;
+	if (y >= g_Configuration.numberRows) return;
+	int end_y = y;
+	size_t end_x = g_Configuration.rows[y].size;
+	if (x == end_x) {
+		if (y + 1 >= g_Configuration.numberRows) return;
+		end_y = y + 1;
+		end_x = 0;
+	}
+	size_t length;
+	char *text = regionString(y, x, end_y, end_x, &length);
+	killPush(text, length, killSpotCurrent(&g_killRing.killed));
+	int mark_set = g_Configuration.markSet;
+	if (regionReplace(y, x, end_y, end_x, "", 0) == -1) return;
+	g_Configuration.markSet = mark_set;
+	killSpotSet(&g_killRing.killed, y, x);
+	return;
+}
+// puts the kill ring entry 'index' back from the newest in place of the region, leaving the
+// cursor after it and the mark before it, as emacs does.
+static int yankInsert(int start_y, size_t start_x, int end_y, size_t end_x, int index) {
+	int slot = (g_killRing.first + index) % KILL_RING_SIZE;
+	const char *text = g_killRing.texts[slot];
+	size_t length = g_killRing.lengths[slot];
+	if (regionReplace(start_y, start_x, end_y, end_x, text, length) == -1) return -1;
+	
+	int lines = 0;
+	const char *last = NULL;
+	for (const char *newline = text; (newline = memchr(newline, '\n', text + length - newline)) != NULL; newline++) {
+		last = newline;
+		lines++;
+	}
+	g_Configuration.cursorY = start_y + lines;
+	g_Configuration.cursorX = last ? (size_t)(text + length - last - 1) : start_x + length;
+	g_Configuration.markX = start_x;
+	g_Configuration.markY = start_y;
+	g_Configuration.markSet = 1;
+	g_killRing.yankIndex = index;
+	killSpotSet(&g_killRing.yanked, start_y, start_x);
+	return 0;
+}
+void yank(void) {
+	if (bufferReadOnly()) return;
+	if (g_killRing.count == 0) {
+		setStatusMessage("The kill ring is empty.");
+		return;
+	}
+	yankInsert(g_Configuration.cursorY, g_Configuration.cursorX, g_Configuration.cursorY, g_Configuration.cursorX, 0);
+	return;
+}
+// right after a yank: swaps what it put in for the next older entry of the ring.
+void yankPop(void) {
+	if (bufferReadOnly()) return;
+	if (!killSpotCurrent(&g_killRing.yanked)) {
+		setStatusMessage("The last command was not a yank.");
+		return;
+	}
+	struct killSpot *yanked = &g_killRing.yanked;
+	if (yankInsert(yanked->startY, yanked->startX, yanked->endY, yanked->endX, (g_killRing.yankIndex + 1) % g_killRing.count) == -1) return;
+	setStatusMessage("Yanked entry %d of %d.", g_killRing.yankIndex + 1, g_killRing.count);
+	return;
+}
+
+// whether the keys read ahead hold an ESC key of its own, not the start of an arrow key's sequence
+// or a meta key. an ESC at the very end gets ESCAPE_TIMEOUT for the rest of its sequence, as keyDecode() does.
+static int inputEscape(void) {
+	for (int i = g_inputHead; i < g_inputTail; i++) {
+		if (g_input[i] != '\x1b') continue;
+		if (i + 1 == g_inputTail) {
+			struct pollfd descriptor = { STDIN_FILENO, POLLIN, 0 };
+			if (g_inputTail < INPUT_BUFFER_SIZE && poll(&descriptor, 1, ESCAPE_TIMEOUT) > 0) {
+				ssize_t count = read(STDIN_FILENO, &g_input[g_inputTail], INPUT_BUFFER_SIZE - g_inputTail);
+				if (count > 0) g_inputTail += count;
+			}
+			if (i + 1 == g_inputTail) return 1;
+		}
+		if (g_input[i + 1] == '\x1b') return 1;
+		int introducer = g_input[++i];
+		// CSI parameters, then the final byte of the sequence.
+		if (introducer == '[')
+			while (i + 1 < g_inputTail && g_input[i + 1] >= '0' && g_input[i + 1] <= '?') i++;
+		if ((introducer == '[' || introducer == 'O') && i + 1 < g_inputTail) i++;
+	}
+	return 0;
+}
+
+// feeds the region to 'filter_command' and takes what it prints in its place. both pipes are
+// non-blocking and served from one poll(), so a filter that writes before reading everything
+// (sort does not, sed does) can not deadlock us.
+void filter(void) {
+	if (g_Configuration.bufferType != BT_FILE) {
+		setStatusMessage("Only file buffers can be filtered.");
+		return;
+	}
+	char *filter_command = prompt(g_Configuration.markSet ? "Filter region through: %s" : "Filter buffer through: %s", PC_SHELL, NULL);
+	if (filter_command == NULL) {
+		setStatusMessage("Filter operation aborted.");
+		return;
+	}
+	int start_y, end_y;
+	size_t start_x, end_x, input_length;
+	regionBounds(&start_y, &start_x, &end_y, &end_x);
+	char *input = regionString(start_y, start_x, end_y, end_x, &input_length);
+	
+	int to_child[2], from_child[2], errors[2];
+	if (pipe2(to_child, O_CLOEXEC) == -1) to_child[0] = to_child[1] = -1;
+	if (pipe2(from_child, O_CLOEXEC) == -1) from_child[0] = from_child[1] = -1;
+	if (pipe2(errors, O_CLOEXEC) == -1) errors[0] = errors[1] = -1;
+	pid_t pid = -1;
+	if (to_child[0] != -1 && from_child[0] != -1 && errors[0] != -1)
+		pid = spawnShell(filter_command, to_child[0], from_child[1], errors[1]);
+	// the child has its own copies of these.
+	if (to_child[0] != -1) close(to_child[0]);
+	if (from_child[1] != -1) close(from_child[1]);
+	if (errors[1] != -1) close(errors[1]);
+	if (pid == -1) {
+		setStatusMessage("Filter could not be started: %s", strerror(errno));
+		if (to_child[1] != -1) close(to_child[1]);
+		if (from_child[0] != -1) close(from_child[0]);
+		if (errors[0] != -1) close(errors[0]);
+		free(input);
+		free(filter_command);
+		return;
+	}
+	fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+	fcntl(from_child[0], F_SETFL, O_NONBLOCK);
+	fcntl(errors[0], F_SETFL, O_NONBLOCK);
+	
+	setStatusMessage("Filtering through '%s'... (ESC cancels)", filter_command);
+	refreshScreen();
+	
+	struct ABUF output = ABUF_INIT;
+	char error_text[FILTER_ERROR_SIZE] = "";
+	int error_length = 0, cancelled = 0;
+	size_t written = 0;
+	if (input_length == 0) {
+		close(to_child[1]);
+		to_child[1] = -1;
+	}
+	
+	while (from_child[0] != -1 || errors[0] != -1) {
+		struct pollfd descriptors[4] = {
+			{ to_child[1], POLLOUT, 0 }, { from_child[0], POLLIN, 0 }, { errors[0], POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 }
+		};
+		if (poll(descriptors, 4, -1) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (descriptors[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+			ssize_t count = write(to_child[1], &input[written], input_length - written);
+			if (count > 0) written += count;
+			if (written == input_length || (count == -1 && errno != EAGAIN && errno != EINTR)) {
+				close(to_child[1]);
+				to_child[1] = -1;
+			}
+		}
+		if (descriptors[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+			char data[FILTER_READ_SIZE];
+			ssize_t count = read(from_child[0], data, sizeof(data));
+			if (count > 0) bufferAppend(&output, data, count);
+			else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+				close(from_child[0]);
+				from_child[0] = -1;
+			}
+		}
+		if (descriptors[2].revents & (POLLIN | POLLERR | POLLHUP)) {
+			char data[FILTER_READ_SIZE];
+			ssize_t count = read(errors[0], data, sizeof(data));
+			if (count > 0) {
+				int room = (int)sizeof(error_text) - 1 - error_length;
+				if (count < room) room = count;
+				memcpy(&error_text[error_length], data, room);
+				error_length += room;
+				error_text[error_length] = '\0';
+			} else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+				close(errors[0]);
+				errors[0] = -1;
+			}
+		}
+		if (descriptors[3].revents & POLLIN) {
+			// the keys are not lost, they are read by readKey() once we are done.
+			if (g_inputTail < INPUT_BUFFER_SIZE) {
+				ssize_t count = read(STDIN_FILENO, &g_input[g_inputTail], INPUT_BUFFER_SIZE - g_inputTail);
+				if (count > 0) g_inputTail += count;
+			}
+			if (inputEscape()) {
+				g_inputHead = g_inputTail = 0;
+				cancelled = 1;
+				kill(-pid, SIGTERM);
+				break;
+			}
+		}
+	}
+	if (to_child[1] != -1) close(to_child[1]);
+	if (from_child[0] != -1) close(from_child[0]);
+	if (errors[0] != -1) close(errors[0]);
+	free(input);
+	
+	int status = 0;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+	
+	if (cancelled)
+		setStatusMessage("Filter cancelled, buffer untouched.");
+	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		char *newline = strchr(error_text, '\n');
+		if (newline) *newline = '\0';
+		setStatusMessage("Filter failed (%d), buffer untouched: %s", WIFEXITED(status) ? WEXITSTATUS(status) : -1, error_text);
+	} else if (regionReplace(start_y, start_x, end_y, end_x, output.buffer ? output.buffer : "", output.length) == 0)
+		setStatusMessage("Filtered through '%s'.", filter_command);
+	bufferFree(&output);
+	free(filter_command);
+	return;
+}
+
+// the whole lines the region touches, [*first, *last), all of them without a mark. a region ending
+// at the start of a line leaves that line out, as emacs does.
+static void regionLines(int *first, int *last) {
+	int start_y, end_y;
+	size_t start_x, end_x;
+	regionBounds(&start_y, &start_x, &end_y, &end_x);
+	*first = start_y < g_Configuration.numberRows ? start_y : g_Configuration.numberRows;
+	*last = (end_y < g_Configuration.numberRows && (end_x > 0 || end_y == start_y)) ? end_y + 1 : end_y;
+	if (*last > g_Configuration.numberRows) *last = g_Configuration.numberRows;
+	return;
+}
+static int linesEditable(void) {
+	if (bufferReadOnly()) return 0;
+	if (g_Configuration.bufferType != BT_FILE) {
+		setStatusMessage("Only the lines of file buffers can be sorted or filtered.");
+		return 0;
+	}
+	return 1;
+}
+// bytewise, like LC_ALL=C sort.
+static int rowCompare(const ROW *first, const ROW *second) {
+	size_t length = first->size < second->size ? first->size : second->size;
+	int order = memcmp(first->chars, second->chars, length);
+	if (order != 0) return order;
+	return (first->size > second->size) - (first->size < second->size);
+}
+static void sortMerge(ROW **source, int from, int middle, int to, ROW **target) {
+	int i = from, j = middle, k = from;
+	while (i < middle && j < to)
+		target[k++] = rowCompare(source[j], source[i]) < 0 ? source[j++] : source[i++];
+	while (i < middle) target[k++] = source[i++];
+	while (j < to)     target[k++] = source[j++];
+	return;
+}
+// stable, so equal lines keep their order.
+static void sortRange(ROW **rows, ROW **scratch, int from, int to) {
+	if (to - from <= 16) {
+		for (int i = from + 1; i < to; i++) {
+			ROW *row = rows[i];
+			int j = i;
+			for (; j > from && rowCompare(row, rows[j - 1]) < 0; j--)
+				rows[j] = rows[j - 1];
+			rows[j] = row;
+		}
+		return;
+	}
+	int middle = from + (to - from) / 2;
+	sortRange(rows, scratch, from, middle);
+	sortRange(rows, scratch, middle, to);
+	if (rowCompare(rows[middle], rows[middle - 1]) >= 0) return; // already in order, common in logs.
+	sortMerge(rows, from, middle, to, scratch);
+	memcpy(&rows[from], &scratch[from], sizeof(ROW *) * (to - from));
+	return;
+}
+static void sortWorker(void *argument) {
+	struct sortTask *task = argument;
+	if (task->merge) sortMerge(task->source, task->from, task->middle, task->to, task->target);
+	else             sortRange(task->source, task->target, task->from, task->to);
+	return;
+}
+// every worker sorts a slice, then neighbouring runs are merged pairwise, half as many merges each round.
+static void sortParallel(ROW **rows, ROW **scratch, int count) {
+	if (g_threadPool.threads == NULL)
+		poolInit();
+	int runs = g_threadPool.numberThreads > 1 ? g_threadPool.numberThreads : 1;
+	if (count < LINES_PARALLEL_ROWS || runs == 1) {
+		sortRange(rows, scratch, 0, count);
+		return;
+	}
+	int *bounds = malloc(sizeof(int) * (runs + 1));
+	struct sortTask *tasks = malloc(sizeof(struct sortTask) * runs);
+	if (bounds == NULL || tasks == NULL) {
+		free(bounds);
+		free(tasks);
+		sortRange(rows, scratch, 0, count);
+		return;
+	}
+	for (int i = 0; i <= runs; i++)
+		bounds[i] = (int)((long long)count * i / runs);
+	for (int i = 0; i < runs; i++)
+		tasks[i] = (struct sortTask){ rows, scratch, bounds[i], bounds[i + 1], bounds[i + 1], 0 };
+	poolRun(sortWorker, tasks, sizeof(struct sortTask), runs);
+	
+	ROW **source = rows, **target = scratch;
+	while (runs > 1) {
+		int merges = (runs + 1) / 2;
+		for (int i = 0; i < merges; i++) {
+			int from = bounds[2 * i], to = bounds[2 * i + 2 <= runs ? 2 * i + 2 : runs];
+			int middle = 2 * i + 1 <= runs ? bounds[2 * i + 1] : to;
+			tasks[i] = (struct sortTask){ source, target, from, middle, to, 1 };
+		}
+		poolRun(sortWorker, tasks, sizeof(struct sortTask), merges);
+		for (int i = 0; i <= merges; i++)
+			bounds[i] = bounds[2 * i <= runs ? 2 * i : runs];
+		runs = merges;
+		ROW **swap = source;
+		source = target;
+		target = swap;
+	}
+	if (source != rows)
+		memcpy(rows, source, sizeof(ROW *) * count);
+	free(bounds);
+	free(tasks);
+	return;
+}
+// the lines are moved as they are, text, render and highlight: nothing is copied or built again.
+void sortLines(void) {
+	if (!linesEditable()) return;
+	int first, last;
+	regionLines(&first, &last);
+	int count = last - first;
+	if (count < 2) {
+		setStatusMessage("Nothing to sort.");
+		return;
+	}
+	long long trace = traceBegin();
+	ROW **order = malloc(sizeof(ROW *) * count);
+	ROW **scratch = malloc(sizeof(ROW *) * count);
+	ROW *sorted = malloc(sizeof(ROW) * count);
+	if (order == NULL || scratch == NULL || sorted == NULL) {
+		free(order);
+		free(scratch);
+		free(sorted);
+		setStatusMessage("Not enough memory to sort %d lines.", count);
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		order[i] = &g_Configuration.rows[first + i];
+	sortParallel(order, scratch, count);
+	for (int i = 0; i < count; i++)
+		sorted[i] = *order[i];
+	memcpy(&g_Configuration.rows[first], sorted, sizeof(ROW) * count);
+	free(order);
+	free(scratch);
+	free(sorted);
+	traceEnd("sortLines", trace);
+	
+	g_Configuration.cursorY = first;
+	g_Configuration.cursorX = 0;
+	g_Configuration.markSet = 0;
+	g_Configuration.dirty++;
+	if (g_doBackups == true)
+		g_backupCounter++;
+	setStatusMessage("Sorted %d lines.", count);
+	return;
+}
+// drops the rows of [first, last) whose 'keep' is 0 in one pass, the rows after them follow with a
+// single memmove. returns how many were dropped.
+static int linesSift(int first, int last, const unsigned char *keep) {
+	int kept = first;
+	for (int y = first; y < last; y++) {
+		if (keep[y - first]) g_Configuration.rows[kept++] = g_Configuration.rows[y];
+		else                 freeRow(&g_Configuration.rows[y]);
+	}
+	int dropped = last - kept;
+	if (dropped == 0) return 0;
+	memmove(&g_Configuration.rows[kept], &g_Configuration.rows[last], sizeof(ROW) * (g_Configuration.numberRows - last));
+	g_Configuration.numberRows -= dropped;
+	g_Configuration.cursorY = first;
+	g_Configuration.cursorX = 0;
+	g_Configuration.markSet = 0;
+	g_Configuration.dirty++;
+	if (g_doBackups == true)
+		g_backupCounter++;
+	return dropped;
+}
+// repeated lines next to each other become one, like uniq(1): sort-lines first for all of them.
+void uniqLines(void) {
+	if (!linesEditable()) return;
+	int first, last;
+	regionLines(&first, &last);
+	if (last - first < 2) {
+		setStatusMessage("No duplicate lines.");
+		return;
+	}
+	unsigned char *keep = malloc(last - first);
+	if (keep == NULL) return;
+	keep[0] = 1;
+	for (int y = first + 1; y < last; y++)
+		keep[y - first] = rowCompare(&g_Configuration.rows[y], &g_Configuration.rows[y - 1]) != 0;
+	int dropped = linesSift(first, last, keep);
+	free(keep);
+	setStatusMessage("Removed %d duplicate lines.", dropped);
+	return;
+}
+static void linesWorker(void *argument) {
+	struct linesTask *task = argument;
+	for (int y = task->from; y < task->to; y++)
+		task->matches[y - task->from] = regexec(&task->compiled, g_Configuration.rows[y].chars, 0, NULL, 0) == 0;
+	return;
+}
+// keeps the lines that match a regex or, with 'matching' 0, those that do not.
+static void linesFilter(int matching) {
+	if (!linesEditable()) return;
+	char *query = prompt(matching ? "Keep lines matching: %s" : "Delete lines matching: %s", PC_LINES, NULL);
+	if (query == NULL) {
+		setStatusMessage(matching ? "Keep lines aborted." : "Delete lines aborted.");
+		return;
+	}
+	int first, last;
+	regionLines(&first, &last);
+	int count = last - first;
+	if (g_threadPool.threads == NULL)
+		poolInit();
+	int workers = (count >= LINES_PARALLEL_ROWS && g_threadPool.numberThreads > 1) ? g_threadPool.numberThreads : 1;
+	struct linesTask *tasks = calloc(workers, sizeof(struct linesTask));
+	unsigned char *keep = malloc(count > 0 ? count : 1);
+	int compiled = 0, code = 0;
+	for (; tasks && compiled < workers; compiled++)
+		if ((code = regcomp(&tasks[compiled].compiled, query, REG_EXTENDED | REG_NOSUB)) != 0) break;
+	if (tasks == NULL || keep == NULL || code != 0) {
+		if (code != 0) {
+			char message[64];
+			regerror(code, &tasks[compiled].compiled, message, sizeof(message));
+			setStatusMessage("Invalid regex: %s", message);
+		}
+		for (int i = 0; i < compiled; i++)
+			regfree(&tasks[i].compiled);
+		free(tasks);
+		free(keep);
+		free(query);
+		return;
+	}
+	long long trace = traceBegin();
+	for (int i = 0; i < workers; i++) {
+		tasks[i].from = first + (int)((long long)count * i / workers);
+		tasks[i].to = first + (int)((long long)count * (i + 1) / workers);
+		tasks[i].matches = &keep[tasks[i].from - first];
+	}
+	poolRun(linesWorker, tasks, sizeof(struct linesTask), workers);
+	for (int i = 0; i < count; i++)
+		keep[i] = keep[i] == matching;
+	int dropped = linesSift(first, last, keep);
+	traceEnd("linesFilter", trace);
+	
+	for (int i = 0; i < workers; i++)
+		regfree(&tasks[i].compiled);
+	free(tasks);
+	free(keep);
+	if (matching) setStatusMessage("Kept %d of %d lines, the ones matching '%s'.", count - dropped, count, query);
+	else          setStatusMessage("Deleted %d of %d lines, the ones matching '%s'.", dropped, count, query);
+	free(query);
+	return;
+}
+void keepLines(void) {
+	linesFilter(1);
+	return;
+}
+void deleteLines(void) {
+	linesFilter(0);
+	return;
+}
+
+static int replacerInit(struct replacer *r, char *query, char *replacement, int use_regex) {
+	r->query = query;
+	r->queryLength = strlen(query);
+	r->replacement = replacement;
+	r->replacementLength = strlen(replacement);
+	r->regex = use_regex;
+	if (use_regex) {
+		int code = regcomp(&r->compiled, query, REG_EXTENDED);
+		if (code != 0) {
+			char message[64];
+			regerror(code, &r->compiled, message, sizeof(message));
+			setStatusMessage("Invalid regex: %s", message);
+			return -1;
+		}
+	}
+	return 0;
+}
+static void replacerFree(struct replacer *r) {
+	if (r->regex)
+		regfree(&r->compiled);
+	free(r->query);
+	free(r->replacement);
+	return;
+}
+
+// finds the next match starting at 'from'. empty regex matches are skipped, they would never end.
+static int replacerMatch(struct replacer *r, ROW *row, size_t from, size_t *start, size_t *end, regmatch_t *groups) {
+	if (from > row->size) return 0;
+	if (!r->regex) {
+		char *match = memmem(&row->chars[from], row->size - from, r->query, r->queryLength);
+		if (match == NULL) return 0;
+		*start = match - row->chars;
+		*end = *start + r->queryLength;
+		return 1;
+	}
+	while (from <= row->size) {
+		if (regexec(&r->compiled, &row->chars[from], REPLACE_GROUPS, groups, from > 0 ? REG_NOTBOL : 0) != 0)
+			return 0;
+		if (groups[0].rm_eo > groups[0].rm_so) {
+			for (int i = 0; i < REPLACE_GROUPS; i++) {
+				if (groups[i].rm_so == -1) continue;
+				groups[i].rm_so += (regoff_t)from;
+				groups[i].rm_eo += (regoff_t)from;
+			}
+			*start = groups[0].rm_so;
+			*end = groups[0].rm_eo;
+			return 1;
+		}
+		from += groups[0].rm_so + 1;
+	}
+	return 0;
+}
+
+static void replacerExpand(struct replacer *r, ROW *row, regmatch_t *groups, struct ABUF *output) {
+	if (!r->regex) {
+		bufferAppend(output, r->replacement, r->replacementLength);
+		return;
+	}
+	// \0 to \9 are the match groups, anything else after a backslash is taken literally.
+	for (size_t i = 0; i < r->replacementLength; i++) {
+		char c = r->replacement[i];
+		if (c == '\\' && i + 1 < r->replacementLength) {
+			c = r->replacement[++i];
+			if (isdigit((unsigned char)c)) {
+				regmatch_t *group = &groups[c - '0'];
+				if (group->rm_so != -1)
+					bufferAppend(output, &row->chars[group->rm_so], group->rm_eo - group->rm_so);
+				continue;
+			}
+		}
+		bufferAppend(output, &c, 1);
+	}
+	return;
+}
+
+// rewrites the row once with up to 'limit' (or all, if -1) replacements from 'from' onwards.
+// returns how many were made and leaves in 'resume' where the search should continue.
+static int rowReplace(ROW *row, struct replacer *r, size_t from, int limit, size_t *resume) {
+	struct ABUF output = ABUF_INIT;
+	regmatch_t groups[REPLACE_GROUPS];
+	size_t start, end, copied = 0;
+	int count = 0;
+	
+	while ((limit < 0 || count < limit) && replacerMatch(r, row, from, &start, &end, groups)) {
+		bufferAppend(&output, &row->chars[copied], start - copied);
+		replacerExpand(r, row, groups, &output);
+		copied = from = end;
+		count++;
+	}
+	if (resume)
+		*resume = output.length;
+	if (count == 0) {
+		bufferFree(&output);
+		return 0;
+	}
+	bufferAppend(&output, &row->chars[copied], row->size - copied + 1); // with the NUL
+	free(row->chars);
+	row->chars = output.buffer;
+	row->size = output.length - 1;
+	updateRow(row);
+	return count;
+}
+
+static long replaceAll(struct replacer *r, int first_row, size_t first_column) {
+	long total = 0;
+	int rows = 0;
+	for (int y = first_row; y < g_Configuration.numberRows; y++) {
+		int count = rowReplace(&g_Configuration.rows[y], r, (y == first_row) ? first_column : 0, -1, NULL);
+		if (count) {
+			total += count;
+			rows++;
+		}
+	}
+	if (total) {
+		g_Configuration.dirty++;
+		if (g_doBackups == true)
+			g_backupCounter++;
+	}
+	setStatusMessage("Replaced %ld occurrences in %d lines.", total, rows);
+	return total;
+}
+
+static void replaceInteractive(struct replacer *r) {
+	regmatch_t groups[REPLACE_GROUPS];
+	int y = g_Configuration.cursorY;
+	size_t x = g_Configuration.cursorX;
+	long total = 0;
+	
+	while (y < g_Configuration.numberRows) {
+		ROW *row = &g_Configuration.rows[y];
+		size_t start, end;
+		if (!replacerMatch(r, row, x, &start, &end, groups)) {
+			y++;
+			x = 0;
+			continue;
+		}
+		g_Configuration.cursorY = y;
+		g_Configuration.cursorX = start;
+		
+		rowEnsureRender(row);
+		size_t renderStart = rowCxToBx(row, start);
+		size_t renderEnd = rowCxToBx(row, end);
+		struct savedHighlight saved_highlight;
+		if (highlightSave(&saved_highlight, y) == -1) {
+			setStatusMessage("Replace stopped, no memory to show the match. Replaced %ld occurrences.", total);
+			return;
+		}
+		memset(&row->highlight[renderStart], HL_MATCH, renderEnd - renderStart);
+		
+		setStatusMessage("Replace this one? (y)es, (n)o, (!) all the rest, (q)uit");
+		refreshScreen();
+		int key = readKey();
+		// the match is only where it was if the row is.
+		if (!highlightRestore(&saved_highlight)) {
+			setStatusMessage("The line changed while waiting, replace stopped. Replaced %ld occurrences.", total);
+			return;
+		}
+		row = &g_Configuration.rows[y];
+		
+		if (key == 'y' || key == ' ') {
+			size_t resume;
+			total += rowReplace(row, r, start, 1, &resume);
+			g_Configuration.dirty++;
+			if (g_doBackups == true)
+				g_backupCounter++;
+			x = resume;
+		} else if (key == 'n' || key == BACKSPACE) {
+			x = end;
+		} else if (key == '!') {
+			total += replaceAll(r, y, start);
+			setStatusMessage("Replaced %ld occurrences.", total);
+			return;
+		} else {
+			break;
+		}
+	}
+	setStatusMessage("Replaced %ld occurrences.", total);
+	return;
+}
+
+void replace(int use_regex, int all) {
+	if (bufferReadOnly()) return;
+	char *query = prompt(use_regex ? "Replace regex: %s" : "Replace: %s", PC_REPLACE, NULL);
+	if (query == NULL) {
+		setStatusMessage("Replace operation aborted.");
+		return;
+	}
+	// an empty replacement is valid, but prompt() wants something typed, hence the escape.
+	char *replacement = prompt("Replace with (\\e for nothing): %s", PC_REPLACE, NULL);
+	if (replacement == NULL) {
+		setStatusMessage("Replace operation aborted.");
+		free(query);
+		return;
+	}
+	if (strcmp(replacement, "\\e") == 0)
+		replacement[0] = '\0';
+	
+	struct replacer r;
+	if (replacerInit(&r, query, replacement, use_regex) == -1) {
+		free(query);
+		free(replacement);
+		return;
+	}
+	if (all) {
+		// the whole batch is a single change, so back up the state before it once.
+		if (g_doBackups == true)
+			backupSave();
+		replaceAll(&r, 0, 0);
+	} else
+		replaceInteractive(&r);
+	replacerFree(&r);
+	return;
+}
+
+struct grepJob *g_grep = NULL;
+
+static void grepPush(struct grepJob *job, char *path, int is_directory) {
+	struct grepItem *item = malloc(sizeof(struct grepItem));
+	if (item == NULL) {
+		free(path);
+		return;
+	}
+	item->path = path;
+	item->isDirectory = is_directory;
+	
+	pthread_mutex_lock(&job->lock);
+	item->next = job->pending;
+	job->pending = item;
+	pthread_cond_signal(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+	return;
+}
+static void grepFile(struct grepJob *job, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return;
+	struct stat s;
+	if (fstat(fd, &s) == -1 || !S_ISREG(s.st_mode) || s.st_size == 0) {
+		close(fd);
+		return;
+	}
+	size_t size = s.st_size;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return;
+	madvise(data, size, MADV_SEQUENTIAL);
+	
+	struct grepResult *first = NULL, **last = &first;
+	long found = 0;
+	if (memchr(data, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE) == NULL) {
+		char *position = data, *counted = data, *end = data + size;
+		int line = 1;
+		char *match;
+		while (!atomic_load_explicit(&job->cancel, memory_order_relaxed) &&
+			   (match = memmem(position, end - position, job->query, job->queryLength)) != NULL) {
+			char *newline;
+			while ((newline = memchr(counted, '\n', match - counted)) != NULL) {
+				line++;
+				counted = newline + 1;
+			}
+			char *line_end = memchr(match, '\n', end - match);
+			if (line_end == NULL) line_end = end;
+			int line_length = line_end - counted;
+			if (line_length > 0 && counted[line_length - 1] == '\r') line_length--;
+			if (line_length > GREP_LINE_LIMIT) line_length = GREP_LINE_LIMIT;
+			
+			struct grepResult *result = malloc(sizeof(struct grepResult));
+			if (result == NULL || asprintf(&result->line, "%s:%d:%.*s", path, line, line_length, counted) == -1) {
+				free(result);
+				break;
+			}
+			result->next = NULL;
+			*last = result;
+			last = &result->next;
+			found++;
+			
+			// one result per line is enough.
+			if (line_end == end) break;
+			line++;
+			counted = position = line_end + 1;
+		}
+	}
+	munmap(data, size);
+	atomic_fetch_add(&job->filesSearched, 1);
+	if (first == NULL) return;
+	
+	pthread_mutex_lock(&job->lock);
+	*job->resultsTail = first;
+	job->resultsTail = last;
+	job->matches += found;
+	pthread_mutex_unlock(&job->lock);
+	if (write(job->notify[1], "", 1) == -1) {
+		// the pipe being full already means the UI has something to drain.
+	}
+	return;
+}
+static void grepDirectory(struct grepJob *job, const char *path) {
+	DIR *directory = opendir(path);
+	if (directory == NULL) return;
+	
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL && !atomic_load_explicit(&job->cancel, memory_order_relaxed)) {
+		// skips '.', '..' and hidden stuff like .git, which is never what we are looking for.
+		if (entry->d_name[0] == '.')
+			continue;
+		char *child;
+		if (asprintf(&child, "%s/%s", path, entry->d_name) == -1)
+			continue;
+		
+		int type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat s;
+			if (lstat(child, &s) == 0)
+				type = S_ISDIR(s.st_mode) ? DT_DIR : (S_ISREG(s.st_mode) ? DT_REG : DT_UNKNOWN);
+		}
+		if (type == DT_DIR)      grepPush(job, child, 1);
+		else if (type == DT_REG) grepPush(job, child, 0);
+		else                     free(child);
+	}
+	closedir(directory);
+	return;
+}
+static void *grepWorker(void *argument) {
+	struct grepJob *job = argument;
+	
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		// done once nothing is queued and nobody is busy listing a directory that could queue more.
+		while (job->pending == NULL && job->busyWorkers > 0)
+			pthread_cond_wait(&job->changed, &job->lock);
+		if (job->pending == NULL)
+			break;
+		struct grepItem *item = job->pending;
+		job->pending = item->next;
+		job->busyWorkers++;
+		pthread_mutex_unlock(&job->lock);
+		
+		if (!atomic_load(&job->cancel)) {
+			if (item->isDirectory) grepDirectory(job, item->path);
+			else                   grepFile(job, item->path);
+		}
+		free(item->path);
+		free(item);
+		
+		pthread_mutex_lock(&job->lock);
+		job->busyWorkers--;
+		if (job->busyWorkers == 0)
+			pthread_cond_broadcast(&job->changed);
+	}
+	job->runningWorkers--;
+	pthread_cond_broadcast(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+	if (write(job->notify[1], "", 1) == -1) {
+		// same as above.
+	}
+	return NULL;
+}
+
+static void grepFree(struct grepJob *job) {
+	for (int i = 0; i < job->numberThreads; i++)
+		pthread_join(job->threads[i], NULL);
+	free(job->threads);
+	while (job->pending) {
+		struct grepItem *next = job->pending->next;
+		free(job->pending->path);
+		free(job->pending);
+		job->pending = next;
+	}
+	struct grepResult *result = job->results;
+	while (result) {
+		struct grepResult *next = result->next;
+		free(result->line);
+		free(result);
+		result = next;
+	}
+	watchRemove(job->notify[0]);
+	close(job->notify[0]);
+	close(job->notify[1]);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->changed);
+	free(job->query);
+	free(job);
+	return;
+}
+// waits for the workers to notice the cancel flag, they check it between files.
+void grepCancel(void) {
+	if (g_grep == NULL) return;
+	atomic_store(&g_grep->cancel, 1);
+	pthread_mutex_lock(&g_grep->lock);
+	while (g_grep->runningWorkers > 0)
+		pthread_cond_wait(&g_grep->changed, &g_grep->lock);
+	pthread_mutex_unlock(&g_grep->lock);
+	grepFree(g_grep);
+	g_grep = NULL;
+	return;
+}
+
+// moves whatever the workers found so far into the results buffer. returns 1 if the screen needs a repaint.
+int grepPoll(void) {
+	if (g_grep == NULL) return 0;
+	int index = bufferFind(GREP_BUFFER);
+	if (index == -1) {
+		grepCancel();
+		return 0;
+	}
+	char drain[256];
+	while (read(g_grep->notify[0], drain, sizeof(drain)) > 0);
+	
+	pthread_mutex_lock(&g_grep->lock);
+	struct grepResult *results = g_grep->results;
+	g_grep->results = NULL;
+	g_grep->resultsTail = &g_grep->results;
+	int finished = (g_grep->runningWorkers == 0);
+	long matches = g_grep->matches;
+	pthread_mutex_unlock(&g_grep->lock);
+	
+	// the results keep coming even when we are looking at some other buffer.
+	int previous = g_currentBuffer;
+	bufferActivate(index);
+	while (results) {
+		struct grepResult *next = results->next;
+		insertRow(g_Configuration.numberRows, results->line, strlen(results->line));
+		free(results->line);
+		free(results);
+		results = next;
+	}
+	g_Configuration.dirty = 0;
+	bufferActivate(previous);
+	
+	long files = atomic_load(&g_grep->filesSearched);
+	if (finished) {
+		setStatusMessage("grep finished: %ld matches in %ld files searched.", matches, files);
+		grepFree(g_grep);
+		g_grep = NULL;
+	} else
+		setStatusMessage("grep: %ld matches, %ld files searched so far...", matches, files);
+	return 1;
+}
+
+void grep(void) {
+	char *query = prompt("Grep for: %s", PC_GREP, NULL);
+	if (query == NULL) {
+		setStatusMessage("Grep operation aborted.");
+		return;
+	}
+	char *root = prompt("Grep in directory: %s", PC_OPEN, NULL);
+	if (root == NULL) {
+		setStatusMessage("Grep operation aborted.");
+		free(query);
+		return;
+	}
+	size_t root_length = strlen(root);
+	while (root_length > 1 && root[root_length - 1] == '/')
+		root[--root_length] = '\0';
+	
+	grepCancel();
+	struct grepJob *job = calloc(1, sizeof(struct grepJob));
+	if (job == NULL || pipe2(job->notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+		setStatusMessage("Failed to start grep: %s", strerror(errno));
+		free(job); free(query); free(root);
+		return;
+	}
+	job->query = query;
+	job->queryLength = strlen(query);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->changed, NULL);
+	job->resultsTail = &job->results;
+	atomic_init(&job->cancel, 0);
+	atomic_init(&job->filesSearched, 0);
+	
+	if (bufferScratch(GREP_BUFFER, BT_GREP) == -1) {
+		grepFree(job);
+		free(root);
+		return;
+	}
+	
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) workers = 1;
+	job->threads = malloc(sizeof(pthread_t) * workers);
+	job->runningWorkers = workers;
+	grepPush(job, root, 1);
+	for (long i = 0; job->threads && i < workers; i++) {
+		if (pthread_create(&job->threads[job->numberThreads], NULL, grepWorker, job) != 0)
+			break;
+		job->numberThreads++;
+	}
+	pthread_mutex_lock(&job->lock);
+	job->runningWorkers -= workers - job->numberThreads;
+	pthread_cond_broadcast(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+	if (job->numberThreads == 0) {
+		setStatusMessage("Failed to start grep: no threads.");
+		grepFree(job);
+		return;
+	}
+	g_grep = job;
+	watchAdd(job->notify[0], grepPoll);
+	
+	setStatusMessage("grep: searching for '%s'...", query);
+	return;
+}
+
+// <path>:<line>:<text>, the first ':<digits>:' is the separator so paths with colons still work.
+void grepVisit(void) {
+	if (g_Configuration.cursorY >= g_Configuration.numberRows) return;
+	ROW *row = &g_Configuration.rows[g_Configuration.cursorY];
+	
+	for (size_t i = 0; i < row->size; i++) {
+		if (row->chars[i] != ':') continue;
+		size_t j = i + 1;
+		while (j < row->size && isdigit((unsigned char)row->chars[j])) j++;
+		if (j == i + 1 || j >= row->size || row->chars[j] != ':') continue;
+		
+		char *path = strndup(row->chars, i);
+		int line = atoi(&row->chars[i + 1]);
+		if (path == NULL) return;
+		editorOpen(path);
+		free(path);
+		loadGoto(line - 1);
+		return;
+	}
+	setStatusMessage("No match location in this line.");
+	return;
+}
+
+static void backupRemove(void) {
+	if (g_Configuration.filename == NULL)
+		return;
+	
+	int backup_length = strlen(g_Configuration.filename) + strlen(BACKUP_STRING) + 1;
+	char *backup_filename = (char*)malloc(backup_length);
+	
+	snprintf(backup_filename, backup_length, "%s%s", g_Configuration.filename, BACKUP_STRING);
+	if (remove(backup_filename) != 0) {
+		setStatusMessage("Failed to remove backup file.");
+		return;
+	}
+	setStatusMessage("%s backup file removed.", backup_filename);
+    free(backup_filename);
+	return;
+}
+
+static void commandQuit(void) {
+	renderFlush();
+	if (!g_headless.active) {
+		write(STDOUT_FILENO, "\x1b[2J", 4);
+		write(STDOUT_FILENO, "\x1b[H", 3);
+	}
+	exit(0);
+	return;
+}
+static void commandCacheMode(void) { g_doCache = !g_doCache; g_doCache ? setStatusMessage("Cache-mode enabled") : setStatusMessage("Cache-mode disabled"); }
+static void commandBackupMode(void) { g_doBackups = !g_doBackups; g_doBackups ? setStatusMessage("Backup-mode enabled") : setStatusMessage("Backup-mode disabled"); }
+static void commandVersion(void) { setStatusMessage("Current Charlie Version: %s", VERSION); }
+static void commandApes(void) { setStatusMessage("Yes, Miranda. We are all apes."); }
+static void commandCenterScreen(void) { centerScreen(); setStatusMessage("Screen centered."); }
+static void commandCurrentLine(void) { setStatusMessage(" %d ", g_Configuration.cursorY); }
+static void commandBufferNext(void) { bufferSwitch((g_currentBuffer + 1) % g_numberBuffers); }
+static void commandBufferPrevious(void) { bufferSwitch((g_currentBuffer + g_numberBuffers - 1) % g_numberBuffers); }
+static void commandReplace(void) { replace(0, 0); }
+static void commandReplaceAll(void) { replace(0, 1); }
+static void commandReplaceRegex(void) { replace(1, 0); }
+static void commandReplaceAllRegex(void) { replace(1, 1); }
+static void commandMemoryCompact(void) {
+	long long freed = memoryCompact();
+	setStatusMessage("Compacted, %lld bytes freed.", freed);
+	return;
+}
+static void commandTrace(void) {
+	if (atomic_load(&g_trace.enabled)) {
+		int events = traceDump();
+		atomic_store(&g_trace.enabled, 0);
+		if (events < 0) setStatusMessage("Tracing stopped, failed to write the trace: %s", strerror(errno));
+		else            setStatusMessage("Tracing stopped, %d events written to %s.", events, g_trace.path ? g_trace.path : TRACE_DEFAULT_PATH);
+		return;
+	}
+	traceStart(NULL);
+	setStatusMessage("Tracing enabled.");
+	return;
+}
+static void commandTraceDump(void) {
+	int events = traceDump();
+	if (events < 0) setStatusMessage("Failed to write the trace: %s", strerror(errno));
+	else            setStatusMessage("%d events written to %s.", events, g_trace.path ? g_trace.path : TRACE_DEFAULT_PATH);
+	return;
+}
+static void commandRefreshScreen(void) {
+	g_Configuration.statusMessageTime = 0;
+	setStatusMessage("");
+	
+	if (getWindowSize(&g_Configuration.screenRows, &g_Configuration.screenCols) == -1)
+		error("getWindowSize");
+	g_Configuration.screenRows -= 2;
+	refreshScreen();
+	return;
+}
+
+// aliases run the same handler but are left out of the candidates shown while typing.
+struct command g_commands[] = {
+	{ "quit", commandQuit, 0 },
+	{ "exit", commandQuit, 1 },
+	{ "kill-charlie", commandQuit, 1 },
+	{ "cache-mode", commandCacheMode, 0 },
+	{ "backup-mode", commandBackupMode, 0 },
+	{ "version", commandVersion, 0 },
+	{ "charlie_version", commandVersion, 1 },
+	{ "humans-apes?", commandApes, 1 },
+	{ "humans-apes", commandApes, 0 },
+	{ "center-screen", commandCenterScreen, 0 },
+	{ "current-line", commandCurrentLine, 0 },
+	{ "remove-backup", backupRemove, 1 },
+	{ "backup-remove", backupRemove, 0 },
+	{ "save-backup", backupSave, 1 },
+	{ "backup-save", backupSave, 0 },
+	{ "goto-line", goto_line, 0 },
+	{ "open", file_open, 0 },
+	{ "revert", revert, 0 },
+	{ "follow", follow, 0 },
+	{ "view", view, 0 },
+	{ "goto-byte", goto_byte, 0 },
+	{ "shell", shell, 0 },
+	{ "shell-kill", shellKill, 0 },
+	{ "filter", filter, 0 },
+	{ "set-mark", insertMark, 0 },
+	{ "kill-region", regionKill, 0 },
+	{ "copy-region", regionCopy, 0 },
+	{ "kill-line", killLine, 0 },
+	{ "yank", yank, 0 },
+	{ "yank-pop", yankPop, 0 },
+	{ "macro-start", macroStart, 0 },
+	{ "macro-end", macroEnd, 0 },
+	{ "macro-run", macroRepeat, 0 },
+	{ "sort-lines", sortLines, 0 },
+	{ "uniq-lines", uniqLines, 0 },
+	{ "keep-lines", keepLines, 0 },
+	{ "delete-lines", deleteLines, 0 },
+	{ "flush-lines", deleteLines, 1 },
+	{ "grep", grep, 0 },
+	{ "buffer-switch", buffer_switch, 0 },
+	{ "buffer-list", bufferList, 0 },
+	{ "buffers", bufferList, 1 },
+	{ "buffer-close", bufferClose, 0 },
+	{ "kill-buffer", bufferClose, 1 },
+	{ "buffer-next", commandBufferNext, 0 },
+	{ "buffer-previous", commandBufferPrevious, 0 },
+	{ "replace", commandReplace, 0 },
+	{ "replace-all", commandReplaceAll, 0 },
+	{ "replace-regex", commandReplaceRegex, 0 },
+	{ "replace-all-regex", commandReplaceAllRegex, 0 },
+	{ "refresh-screen", commandRefreshScreen, 0 },
+	{ "memory-report", memoryReport, 0 },
+	{ "memory-compact", commandMemoryCompact, 0 },
+	{ "memory-budget", memoryBudget, 0 },
+	{ "trace", commandTrace, 0 },
+	{ "trace-dump", commandTraceDump, 0 },
+};
+#define COMMANDS_NUMBER (int)(sizeof(g_commands) / sizeof(g_commands[0]))
+
+struct command *g_commandTable[COMMAND_TABLE_SIZE];
+struct command *g_commandsSorted[COMMANDS_NUMBER];
+
+char *g_commandHistory[COMMAND_HISTORY]; // ring, g_historyNext is where the next entry goes.
+int g_historyNext = 0;
+int g_historyLength = 0;
+
+static uint32_t commandHash(const char *name) {
+	uint32_t hash = 2166136261u;
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int commandSortCompare(const void *a, const void *b) {
+	return strcmp((*(struct command * const *)a)->name, (*(struct command * const *)b)->name);
+}
+
+static void commandInit(void) {
+	static int initialized = 0;
+	if (initialized) return;
+	initialized = 1;
+	
+	for (int i = 0; i < COMMANDS_NUMBER; i++) {
+		uint32_t slot = commandHash(g_commands[i].name) & (COMMAND_TABLE_SIZE - 1);
+		while (g_commandTable[slot] != NULL)
+			slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+		g_commandTable[slot] = &g_commands[i];
+		g_commandsSorted[i] = &g_commands[i];
+	}
+	qsort(g_commandsSorted, COMMANDS_NUMBER, sizeof(g_commandsSorted[0]), commandSortCompare);
+	return;
+}
+
+struct command *commandLookup(const char *name) {
+	commandInit();
+	uint32_t slot = commandHash(name) & (COMMAND_TABLE_SIZE - 1);
+	while (g_commandTable[slot] != NULL) {
+		if (strcmp(g_commandTable[slot]->name, name) == 0)
+			return g_commandTable[slot];
+		slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+// names starting with typed come first, in order, then the ones merely containing it.
+int commandCandidates(const char *typed, struct command **candidates, int max, int with_aliases) {
+	commandInit();
+	size_t typed_length = strlen(typed);
+	int count = 0;
+	
+	int low = 0, high = COMMANDS_NUMBER;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (strcmp(g_commandsSorted[middle]->name, typed) < 0) low = middle + 1;
+		else high = middle;
+	}
+	int first = low, end = low;
+	for (; end < COMMANDS_NUMBER && strncmp(g_commandsSorted[end]->name, typed, typed_length) == 0; end++) {
+		if (count < max && (with_aliases || !g_commandsSorted[end]->alias))
+			candidates[count++] = g_commandsSorted[end];
+	}
+	if (typed_length == 0) return count;
+	
+	for (int i = 0; i < COMMANDS_NUMBER && count < max; i++) {
+		if (i >= first && i < end) continue;
+		if (!with_aliases && g_commandsSorted[i]->alias) continue;
+		if (strstr(g_commandsSorted[i]->name, typed) != NULL)
+			candidates[count++] = g_commandsSorted[i];
+	}
+	return count;
+}
+
+// longest common prefix of every name starting with typed, NULL when that adds nothing.
+char *commandComplete(const char *typed) {
+	struct command *candidates[COMMAND_CANDIDATES];
+	int count = commandCandidates(typed, candidates, COMMAND_CANDIDATES, 1);
+	size_t typed_length = strlen(typed);
+	
+	const char *prefix = NULL;
+	size_t prefix_length = 0;
+	for (int i = 0; i < count; i++) {
+		const char *name = candidates[i]->name;
+		if (strncmp(name, typed, typed_length) != 0) break;
+		if (prefix == NULL) {
+			prefix = name;
+			prefix_length = strlen(name);
+			continue;
+		}
+		size_t j = 0;
+		while (j < prefix_length && prefix[j] == name[j]) j++;
+		prefix_length = j;
+	}
+	if (prefix == NULL || prefix_length <= typed_length) return NULL;
+	return strndup(prefix, prefix_length);
+}
+
+// what Enter runs: the typed name when it exists, the selected candidate otherwise.
+char *commandChoose(const char *typed, int rotation) {
+	if (commandLookup(typed) != NULL) return NULL;
+	
+	struct command *candidates[COMMAND_CANDIDATES];
+	int count = commandCandidates(typed, candidates, COMMAND_CANDIDATES, 0);
+	if (count == 0) return NULL;
+	rotation %= count;
+	if (rotation < 0) rotation += count;
+	return strdup(candidates[rotation]->name);
+}
+
+// appends "{a | b | ...}" to the prompt, starting from the selected candidate.
+void commandNarrow(const char *typed, int rotation) {
+	if (commandLookup(typed) != NULL) return;
+	
+	struct command *candidates[COMMAND_CANDIDATES];
+	int count = commandCandidates(typed, candidates, COMMAND_CANDIDATES, 0);
+	
+	char *message = g_Configuration.statusMessage;
+	size_t size = sizeof(g_Configuration.statusMessage);
+	size_t length = strlen(message);
+	if (count == 0) {
+		snprintf(message + length, size - length, " [No match]");
+		return;
+	}
+	rotation %= count;
+	if (rotation < 0) rotation += count;
+	
+	length += snprintf(message + length, size - length, " {");
+	for (int i = 0; i < count && length < size; i++) {
+		const char *name = candidates[(rotation + i) % count]->name;
+		length += snprintf(message + length, size - length, "%s%s", i ? " | " : "", name);
+	}
+	if (length < size) snprintf(message + length, size - length, "}");
+	return;
+}
+
+void commandHistoryAdd(const char *name) {
+	int last = (g_historyNext + COMMAND_HISTORY - 1) % COMMAND_HISTORY;
+	if (g_historyLength > 0 && strcmp(g_commandHistory[last], name) == 0) return;
+	
+	free(g_commandHistory[g_historyNext]);
+	g_commandHistory[g_historyNext] = strdup(name);
+	g_historyNext = (g_historyNext + 1) % COMMAND_HISTORY;
+	if (g_historyLength < COMMAND_HISTORY) g_historyLength++;
+	return;
+}
+
+// age 0 is the latest command run.
+const char *commandHistoryAt(int age) {
+	if (age < 0 || age >= g_historyLength) return NULL;
+	return g_commandHistory[(g_historyNext + COMMAND_HISTORY - 1 - age) % COMMAND_HISTORY];
+}
+
+void command(void) {
+	char *command = prompt("Exec. command: %s", PC_COMMAND, NULL);
+	if (command == NULL) {
+		setStatusMessage("Exec. of command aborted.");
+		return;
+	}
+	
+	struct command *entry = commandLookup(command);
+	if (entry == NULL) {
+		setStatusMessage("Command not found.");
+		free(command);
+		return;
+	}
+	commandHistoryAdd(entry->name);
+	free(command);
+	entry->handler();
+	return;
+}
+
+void drawStatusBar(struct ABUF *bff) {
+    bufferAppend(bff, "\x1b[7m", 4);
+    char status[80], rstatus[80];
+	
+	// in the viewer the rows are a window, the file is what counts.
+	long long line = g_Configuration.cursorY, lines = g_Configuration.numberRows;
+	char loading[32] = "";
+	if (g_Configuration.view) {
+		struct viewIndex *view = g_Configuration.view;
+		line += g_Configuration.viewFirst;
+		if (view->done == 1) lines = view->lines;
+		else {
+			lines = line + g_Configuration.numberRows - g_Configuration.cursorY;
+			snprintf(loading, sizeof(loading), "[indexing %d%%] ", view->size ? (int)(atomic_load(&view->indexed) * 100 / view->size) : 0);
+		}
+	}
+	float lines_percentage = 0.0f;
+	if (lines >  0) lines_percentage = (float)line / lines * 100.0f;
+    int length = snprintf(status, sizeof(status), "[%.50s] %s (%.1f%%)[line %lld/%lld][column %zu/%d]",
+						g_Configuration.filename ? g_Configuration.filename : "New File",
+						g_Configuration.view ? "(read-only)" : g_Configuration.dirty ? "(modified)" : "",
+						lines_percentage,
+						line, lines,
+						g_Configuration.renderX, g_Configuration.screenCols);
+	if (g_load != NULL && g_load->codec > 0)
+		snprintf(loading, sizeof(loading), "[loading %lld MB] ", (long long)(atomic_load(&g_load->bytesRead) >> 20));
+	else if (g_load != NULL)
+		snprintf(loading, sizeof(loading), "[loading %d%%] ",
+				 g_load->fileStat.st_size ? (int)(atomic_load(&g_load->bytesRead) * 100 / g_load->fileStat.st_size) : 0);
+	int rlength = snprintf(rstatus, sizeof(rstatus), "%s%s%s%s", loading, g_Configuration.follow ? "[follow] " : "", g_shell.pid > 0 ? "[shell: running] " : "",
+						   g_Configuration.syntax ? g_Configuration.syntax->filetype : " no syntax ");
+    
+    if (length > g_Configuration.screenCols)
+		length = g_Configuration.screenCols;
+    bufferAppend(bff, status, length);
+    
+    while (length < g_Configuration.screenCols) {
+		if (g_Configuration.screenCols - length == rlength) {
+			bufferAppend(bff, rstatus, rlength);
+			break;
+		} else {
+			bufferAppend(bff, " ", 1);
+			length++;
+		}
+	}
+    bufferAppend(bff, "\r\n", 2);
+    bufferAppend(bff, "\x1b[m", 3);
+    return;
+}
+
+// one cell of render: a byte, or all the bytes of a character outside ASCII, in the colour of its first one.
+static inline void drawCell(struct ABUF *bff, const char *text, size_t length, unsigned char highlight, int *current_colour) {
+	if (length == 1 && iscntrl(text[0])) {
+		char sym = (text[0] <= 26) ? '@' + text[0] : '?';
+		bufferAppend(bff, "\x1b[7m", 4);
+		bufferAppend(bff, &sym, 1);
+		bufferAppend(bff, "\x1b[m", 3);
+		if (*current_colour != -1) {
+			char buffer[16];
+			int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", *current_colour);
+			bufferAppend(bff, buffer, clen);
+		}
+	}
+	else if (highlight == HL_NORMAL) {
+		if (*current_colour != -1) {
+			bufferAppend(bff, "\x1b[39m", 5);
+			*current_colour = -1;
+		}
+		bufferAppend(bff, text, length);
+	} else {
+		int colour = syntaxToColour(highlight);
+		if (colour != *current_colour) {
+			*current_colour = colour;
+			char buffer[16];
+			
+			int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", colour);
+			bufferAppend(bff, buffer, clen);
+		}
+		bufferAppend(bff, text, length);
+	}
+	return;
+}
+// colsOff and screenCols count columns, so outside ASCII it goes cell by cell.
+static void drawCells(struct ABUF *bff, ROW *row) {
+	size_t left = g_Configuration.colsOff, right = g_Configuration.colsOff + g_Configuration.screenCols;
+	int current_colour = -1;
+	struct cellStop *cell = rowCellAt(row, rowRxToCx(row, left));
+	
+	for (; cell < &row->cells[row->numberCells]; cell++) {
+		// a wide character cut by either edge leaves blanks where its visible half would be.
+		if (cell[1].column > right) {
+			for (size_t i = cell->column; i < right; i++) bufferAppend(bff, " ", 1);
+			break;
+		}
+		if (cell->column < left) {
+			for (size_t i = left; i < cell[1].column; i++) bufferAppend(bff, " ", 1);
+			continue;
+		}
+		drawCell(bff, &row->render[cell->renderX], cell[1].renderX - cell->renderX, row->highlight[cell->renderX], &current_colour);
+	}
+	return;
+}
+void drawRows(struct ABUF *bff) {
+    for (int y = 0; y < g_Configuration.screenRows; y++) {
+		int fileRow = y + g_Configuration.rowsOff;
+		if (fileRow >= g_Configuration.numberRows) {
+			if (g_Configuration.numberRows == 0 && y == g_Configuration.screenRows / 2) {
+				char welcomeMessage[80];
+				int welcomeLength = snprintf(welcomeMessage, sizeof(welcomeMessage), "Charlie %s, a little bad text editor", VERSION);
+				if (welcomeLength > g_Configuration.screenCols) welcomeLength = g_Configuration.screenCols;
+				
+				int padding = (g_Configuration.screenCols - welcomeLength) / 2;
+				if (padding) {
+//					bufferAppend(bff, COLUMN_SYMBOL, 1);
+					padding--;
+				}
+				while (padding--) bufferAppend(bff, " ", 1);
+				bufferAppend(bff, welcomeMessage, welcomeLength);
+			}// else {
+//				bufferAppend(bff, COLUMN_SYMBOL, 1); // this became an apendice, but i'll keep it here in case I change my mind
+//			}
+		} else {
+			ROW *row = &g_Configuration.rows[fileRow];
+			rowEnsureRender(row);
+			if (rowIsAscii(row)) {
+				size_t length = row->rsize > g_Configuration.colsOff ? row->rsize - g_Configuration.colsOff : 0;
+				if (length > (size_t)g_Configuration.screenCols)
+					length = g_Configuration.screenCols;
+				
+				unsigned char *highlight = &row->highlight[g_Configuration.colsOff];
+				char *r = &row->render[g_Configuration.colsOff];
+				int current_colour = -1;
+				for (size_t i = 0; i < length; i++)
+					drawCell(bff, &r[i], 1, highlight[i], &current_colour);
+			} else {
+				drawCells(bff, row);
+			}
+			bufferAppend(bff, "\x1b[39m", 5);
+	  	}
+		bufferAppend(bff, "\x1b[K", 3);
+		bufferAppend(bff, "\r\n", 2);
+    }
+}
+
+struct renderHandoff g_render = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, ABUF_INIT, 0, 0, 0, 0 };
+
+static void renderWrite(int fd, const char *buffer, size_t length) {
+	long long trace = traceBegin();
+	while (length > 0) {
+		ssize_t written = write(fd, buffer, length);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			break; // nothing sane to do about a terminal that went away.
+		}
+		buffer += written;
+		length -= written;
+	}
+	traceEnd("write", trace);
+	return;
+}
+static void *renderThread(void *argument) {
+	(void)argument;
+	pthread_mutex_lock(&g_render.lock);
+	while (1) {
+		while (!g_render.hasPending)
+			pthread_cond_wait(&g_render.wake, &g_render.lock);
+		struct ABUF frame = g_render.pending;
+		g_render.pending = (struct ABUF)ABUF_INIT;
+		g_render.hasPending = 0;
+		g_render.writing = 1;
+		pthread_mutex_unlock(&g_render.lock);
+		
+		renderWrite(STDOUT_FILENO, frame.buffer, frame.length);
+		bufferFree(&frame);
+		
+		pthread_mutex_lock(&g_render.lock);
+		g_render.writing = 0;
+		pthread_cond_broadcast(&g_render.idle);
+	}
+	return NULL;
+}
+
+// hands a finished frame to the render thread. a frame it did not get to yet is just replaced,
+// every frame repaints the whole screen so there is no point in writing the stale one.
+void renderSubmit(struct ABUF *frame) {
+	if (g_headless.active) {
+		// no thread here, writing in line keeps the frame's cost inside the key that caused it.
+		g_headless.frameCount++;
+		g_headless.frameBytes += frame->length;
+		if (g_headless.frames >= 0)
+			renderWrite(g_headless.frames, frame->buffer, frame->length);
+		bufferFree(&g_headless.frame);
+		g_headless.frame = *frame;
+		return;
+	}
+	if (!g_render.started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, renderThread, NULL) != 0) {
+			renderWrite(STDOUT_FILENO, frame->buffer, frame->length);
+			bufferFree(frame);
+			return;
+		}
+		pthread_detach(thread);
+		g_render.started = 1;
+	}
+	pthread_mutex_lock(&g_render.lock);
+	if (g_render.hasPending) {
+		bufferFree(&g_render.pending);
+		g_render.skippedFrames++;
+	}
+	g_render.pending = *frame;
+	g_render.hasPending = 1;
+	pthread_cond_signal(&g_render.wake);
+	pthread_mutex_unlock(&g_render.lock);
+	return;
+}
+// anything writing to the terminal directly has to wait for the frames in flight first.
+void renderFlush(void) {
+	if (!g_render.started) return;
+	pthread_mutex_lock(&g_render.lock);
+	while (g_render.hasPending || g_render.writing)
+		pthread_cond_wait(&g_render.idle, &g_render.lock);
+	pthread_mutex_unlock(&g_render.lock);
+	return;
+}
+
+void refreshScreen(void) {
+	if (g_macro.replaying) return; // only the end of a replay gets drawn.
+	long long started = g_headless.active ? monotonicMicroseconds() : 0;
+    editorScroll();
+    
+    struct ABUF buffer = ABUF_INIT;
+    
+    bufferAppend(&buffer, "\x1b[?25l", 6);
+    bufferAppend(&buffer, "\x1b[H", 3);
+    
+	long long trace = traceBegin();
+    drawRows(&buffer);
+	traceEnd("drawRows", trace);
+    drawStatusBar(&buffer);
+    drawStatusMessage(&buffer);
+    
+    char cursor[32];
+    snprintf(cursor, sizeof(cursor), "\x1b[%d;%dH", (g_Configuration.cursorY - g_Configuration.rowsOff) + 1, (int)(g_Configuration.renderX - g_Configuration.colsOff) + 1);
+    bufferAppend(&buffer, cursor, strlen(cursor));
+    
+    bufferAppend(&buffer, "\x1b[?25h", 6);
+    renderSubmit(&buffer);
+	if (g_headless.active)
+		g_headless.renderTime += monotonicMicroseconds() - started;
+    return;
+}
+
+void control(void) {
+	int next = readKey();
+	switch (next) {
+		case CTRL_KEY('o'):
+			file_open();
+			break;
+		case CTRL_KEY('c'):
+			command();
+			break;
+		case CTRL_KEY('s'):
+			save();
+			break;
+		case 'l': // C-x C-b would be, but readKey() already turns C-b into LEFT.
+			bufferList();
+			break;
+		case 'b':
+			buffer_switch();
+			break;
+		case 'k':
+			bufferClose();
+			break;
+		case RIGHT:
+			bufferSwitch((g_currentBuffer + 1) % g_numberBuffers);
+			break;
+		case LEFT:
+			bufferSwitch((g_currentBuffer + g_numberBuffers - 1) % g_numberBuffers);
+			break;
+		case DELETE:
+			killLine();
+			break;
+		case '(':
+			macroStart();
+			break;
+		case ')':
+			macroEnd();
+			break;
+		case 'e':
+			macroRun(1);
+			break;
+	}
+	return;
+}
+
+void centerScreen(void) {
+	int new_position = g_Configuration.cursorY - (g_Configuration.screenRows / 2) - 1;
+	setStatusMessage("%d", new_position);
+	if(new_position>0)
+		g_Configuration.rowsOff=new_position;
+	else
+		g_Configuration.rowsOff=0;
+	return;
+}
+void keyPress(void) {
+    static int quit_times = QUIT_TIMES;
+    int c = readKey();
+	long long trace = traceBegin();
+    // only after the key: watchers may have touched the rows while we waited for it.
+    ROW *row = (g_Configuration.cursorY >= g_Configuration.numberRows) ? NULL : &g_Configuration.rows[g_Configuration.cursorY];
+    switch (c) {
+		case CTRL_KEY('c'): break;
+        case '\r':
+			if (g_Configuration.bufferType == BT_GREP)         grepVisit();
+			else if (g_Configuration.bufferType == BT_BUFFERS) bufferVisit();
+			else if (!bufferReadOnly())                        insertNewLine();
+			break;
+        case 27:
+			if (g_load != NULL) {
+				loadCancel();
+				break;
+			}
+			if (bufferAnyDirty() && quit_times > 0) {
+				setStatusMessage("File has unsaved changes! If you're sure, press ESC key %d more times to quit.", quit_times);
+				quit_times--;
+				traceEnd("keyPress", trace);
+				return;
+			}
+			renderFlush();
+			if (!g_headless.active) {
+				write(STDOUT_FILENO, "\x1b[2J", 4);
+				write(STDOUT_FILENO, "\x1b[H", 3);
+			}
+			exit(0);
+			break;
+	
+		case HOME:
+	    	g_Configuration.cursorX = 0;
+	    	break;
+		case END:
+	    	row = (g_Configuration.cursorY >= g_Configuration.numberRows) ? NULL : &g_Configuration.rows[g_Configuration.cursorY];
+	    	size_t rowLength = row ? row->size : 0;
+	    	if (g_Configuration.cursorX < rowLength) g_Configuration.cursorX = rowLength;
+	    	break;
+		
+		case CTRL_KEY('x'):
+			control();
+	    	break;
+
+		case CTRL_KEY('s'):
+	    	find();
+	    	break;
+
+		case DELETE:
+			if (bufferReadOnly()) break;
+			if (g_Configuration.cursorY != 0) {
+				if (g_Configuration.cursorX != 0) rowDeleteChar(row, g_Configuration.cursorX);
+				else {
+					if (g_Configuration.rows[g_Configuration.cursorY].size > 0) rowDeleteChar(row, g_Configuration.cursorX);
+					else                                                        deleteRow(g_Configuration.cursorY);
+				}
+			} else {
+				if (g_Configuration.cursorX != 0) deleteRow(g_Configuration.cursorY + 1);
+				else {
+					deleteRow(g_Configuration.cursorY);
+					g_Configuration.cursorX = 0;
+				}
+			}
+			break;
+		
+		case BACKSPACE:
+			if (bufferReadOnly()) break;
+	    	deleteChar();
+	    	break;
+	
+		case PAGE_DOWN:
+		case PAGE_UP:
 	    	{
 				if (c == PAGE_DOWN) {
 		    		g_Configuration.cursorY = g_Configuration.rowsOff + g_Configuration.screenRows -  1;
 		    		if (g_Configuration.cursorY > g_Configuration.numberRows)
 		        		g_Configuration.cursorY = g_Configuration.numberRows;
 				}
-				else if (c == PAGE_UP) {
-		    		g_Configuration.cursorY = g_Configuration.rowsOff;
+				else if (c == PAGE_UP) {
+		    		g_Configuration.cursorY = g_Configuration.rowsOff;
+				}
+		
+				int times = g_Configuration.screenRows;
+				while (times--)
+		    		moveCursor(c == PAGE_UP ? UP : DOWN);
+	    	}
+	   		break;
+	
+		case RIGHT:
+		case LEFT:
+		case DOWN:
+		case UP:
+	    	moveCursor(c);
+	    	break;
+		
+		case CTRL_KEY('l'):
+			centerScreen();
+	    	break;
+		
+		case 0: // C-space, as in emacs.
+			insertMark();
+			break;
+		
+		case CTRL_KEY('w'):
+			regionKill();
+			break;
+		case COPY_REGION:
+			regionCopy();
+			break;
+		case CTRL_KEY('k'):
+			killLine();
+			break;
+		case CTRL_KEY('y'):
+			yank();
+			break;
+		case YANK_POP:
+			yankPop();
+			break;
+	
+		default:
+			if (bufferReadOnly()) break;
+	    	insertChar(c);
+	    	break;
+    }
+    quit_times = QUIT_TIMES;
+	traceEnd("keyPress", trace);
+    return;
+}
+
+static int keyDecode(void) {
+    int c = inputByte(-1);
+    
+    if (c == '\x1b') {
+		int sequence[3];
+		if ((sequence[0] = inputByte(ESCAPE_TIMEOUT)) == -1) return '\x1b';
+		if (sequence[0] == 'w') return COPY_REGION;
+		if (sequence[0] == 'y') return YANK_POP;
+		if ((sequence[1] = inputByte(ESCAPE_TIMEOUT)) == -1) return '\x1b';
+	
+		if (sequence[0] == '[') {
+	    	if (sequence[1] >= '0' && sequence[1] <= '9') {
+				if ((sequence[2] = inputByte(ESCAPE_TIMEOUT)) == -1) return '\x1b';
+				if (sequence[2] == '~') {
+		    		switch (sequence[1]) {
+		        		case '6': return PAGE_DOWN;
+		        		case '5': return PAGE_UP;
+			
+						case '1': return HOME;
+		        		case '7': return HOME;
+		        		case '4': return END;
+		        		case '8': return END;
+			
+						case '3': return DELETE;
+					}
+				}
+	    	} else {
+				switch (sequence[1]) {
+		  		  	case 'C': return RIGHT;
+		    		case 'D': return LEFT;
+		    		case 'B': return DOWN;
+		    		case 'A': return UP;
+		    		
+		    		case 'H': return HOME;
+		    		case 'F': return END;
+				}
+			}
+		} else if (sequence[0] == '0') {
+	    	switch (sequence[1]) {
+	        	case 'H': return HOME;
+	        	case 'F': return END;
+	    	}
+		}
+		return c;
+    } else {
+		switch (c) {
+	 		// Emacs-like
+	  		case CTRL_KEY('f'): return RIGHT;
+	    	case CTRL_KEY('b'): return LEFT;
+	    	case CTRL_KEY('n'): return DOWN;
+	    	case CTRL_KEY('p'): return UP;
+	    
+	    	case CTRL_KEY('a'): return HOME;
+	    	case CTRL_KEY('e'): return END;
+			
+			case CTRL_KEY('v'): return PAGE_DOWN;
+			
+			case CTRL_KEY('g'): return RIGHT_WORD;
+		}
+    }
+    return c;
+}
+
+// in a headless run a key's latency is everything done from reading it to asking for the next one.
+int readKey(void) {
+	if (g_macro.replaying) {
+		if (g_macro.position < g_macro.length)
+			return g_macro.keys[g_macro.position++];
+		g_macro.stopped = MS_KEYS; // get out of the prompt.
+		return '\x1b';
+	}
+	if (g_headless.active && g_headless.keyStart != 0) {
+		if (g_headless.numberKeys == g_headless.capacityKeys) {
+			int capacity = g_headless.capacityKeys ? g_headless.capacityKeys * 2 : 1024;
+			long long *latencies = realloc(g_headless.latencies, sizeof(long long) * capacity);
+			if (latencies != NULL) {
+				g_headless.latencies = latencies;
+				g_headless.capacityKeys = capacity;
+			}
+		}
+		if (g_headless.numberKeys < g_headless.capacityKeys)
+			g_headless.latencies[g_headless.numberKeys++] = monotonicMicroseconds() - g_headless.keyStart;
+	}
+	int key = keyDecode();
+	if (g_headless.active)
+		g_headless.keyStart = monotonicMicroseconds();
+	if (g_macro.recording) {
+		if (g_macro.length == g_macro.capacity) {
+			int capacity = g_macro.capacity ? g_macro.capacity * 2 : 64;
+			int *keys = realloc(g_macro.keys, sizeof(int) * capacity);
+			if (keys != NULL) {
+				g_macro.keys = keys;
+				g_macro.capacity = capacity;
+			}
+		}
+		if (g_macro.length < g_macro.capacity)
+			g_macro.keys[g_macro.length++] = key;
+	}
+	return key;
+}
+
+void macroStart(void) {
+	if (g_macro.replaying) return;
+	g_macro.recording = 1;
+	g_macro.length = 0;
+	setStatusMessage("Defining keyboard macro...");
+	return;
+}
+void macroEnd(void) {
+	if (!g_macro.recording) {
+		if (!g_macro.replaying) setStatusMessage("Not defining a keyboard macro.");
+		return;
+	}
+	g_macro.recording = 0;
+	// the C-x ) that got us here was recorded too. from the command prompt there is more, kept: it
+	// finds macro-end again when replayed and does nothing.
+	if (g_macro.length >= 2 && g_macro.keys[g_macro.length - 2] == CTRL_KEY('x') && g_macro.keys[g_macro.length - 1] == ')')
+		g_macro.length -= 2;
+	setStatusMessage("Keyboard macro defined, %d keys.", g_macro.length);
+	return;
+}
+// runs the macro 'times' times, 0 for as long as its searches find something further down. nothing is
+// drawn, rows are built and a backup is due only once it is over. a key typed meanwhile stops it.
+void macroRun(int times) {
+	if (g_macro.replaying) return;
+	if (g_macro.recording) {
+		setStatusMessage("Still defining the macro, C-x ) ends it.");
+		return;
+	}
+	if (g_macro.length == 0) {
+		setStatusMessage("No keyboard macro, C-x ( starts one.");
+		return;
+	}
+	long long trace = traceBegin();
+	g_macro.replaying = 1;
+	g_macro.stopped = MS_NONE;
+	g_macro.searched = 0;
+	int runs = 0;
+	while (times == 0 || runs < times) {
+		if (runs > 0 && inputPending()) {
+			g_macro.stopped = MS_INPUT;
+			break;
+		}
+		int buffer = g_currentBuffer, dirty = g_Configuration.dirty, y = g_Configuration.cursorY;
+		size_t x = g_Configuration.cursorX;
+		g_macro.position = 0;
+		while (g_macro.position < g_macro.length && g_macro.stopped == MS_NONE) {
+			keyPress();
+			viewSlide();
+		}
+		if (g_macro.stopped != MS_NONE) break;
+		runs++;
+		if (times == 0 && !g_macro.searched) {
+			g_macro.stopped = MS_NO_SEARCH;
+			break;
+		}
+		// a run that changed nothing would do the same forever.
+		if (times == 0 && buffer == g_currentBuffer && dirty == g_Configuration.dirty &&
+			y == g_Configuration.cursorY && x == g_Configuration.cursorX)
+			break;
+	}
+	g_macro.replaying = 0;
+	traceEnd("macroRun", trace);
+	if (g_macro.stopped == MS_SEARCH)         setStatusMessage("Keyboard macro ran %d times, then stopped at a failed search.", runs);
+	else if (g_macro.stopped == MS_KEYS)      setStatusMessage("Keyboard macro ran %d times, then stopped: a prompt in it wanted more keys.", runs);
+	else if (g_macro.stopped == MS_NO_SEARCH) setStatusMessage("Keyboard macro ran once: it has no search to stop at, give it a number of times.");
+	else if (g_macro.stopped == MS_INPUT)     setStatusMessage("Keyboard macro ran %d times, then stopped by a key.", runs);
+	else                                      setStatusMessage("Keyboard macro ran %d times.", runs);
+	return;
+}
+void macroRepeat(void) {
+	if (g_macro.recording) {
+		setStatusMessage("Still defining the macro, C-x ) ends it.");
+		return;
+	}
+	char *times = prompt("Run the macro how many times (0 until a search fails)? %s", PC_MACRO, NULL);
+	if (times == NULL) {
+		setStatusMessage("Macro run aborted.");
+		return;
+	}
+	char *end;
+	long count = strtol(times, &end, 10);
+	if (end == times || *end != '\0' || count < 0 || count > INT_MAX)
+		setStatusMessage("Not a number of times: %s", times);
+	else
+		macroRun((int)count);
+	free(times);
+	return;
+}
+
+// a complete (rendered and highlighted) row that does not belong to any buffer yet.
+ROW rowNew(const char *string, size_t length) {
+	ROW row;
+    row.size = length;
+    row.chars = malloc(length + 1);
+    memcpy(row.chars, string, length);
+    row.chars[length] = '\0';
+    
+	row.highlight = NULL;
+	row.render = NULL;
+    row.rsize = 0;
+	row.columns = NULL;
+	row.numberColumns = -1;
+	row.ascii = 0;
+	row.cells = NULL;
+	
+    updateRow(&row);
+	return row;
+}
+void insertRow(int at, char *string, size_t length) {
+    if (at < 0 || at > g_Configuration.numberRows || g_Configuration.numberRows == INT_MAX) return;
+    g_Configuration.rows = realloc(g_Configuration.rows, sizeof(ROW) * (g_Configuration.numberRows + 1));
+    memmove(&g_Configuration.rows[at + 1], &g_Configuration.rows[at], sizeof(ROW) * (g_Configuration.numberRows - at));
+    
+    g_Configuration.rows[at] = rowNew(string, length);
+    
+    g_Configuration.numberRows++;
+    g_Configuration.dirty++;
+    return;
+}
+// takes ownership of 'rows' contents, which land at 'at' with a single memmove. -1 when they do
+// not fit, and then they are still the caller's.
+int insertRows(int at, ROW *rows, int count) {
+    if (at < 0 || at > g_Configuration.numberRows) return -1;
+	if (count <= 0) return 0;
+	if (count > INT_MAX - g_Configuration.numberRows) return -1; // rows are counted with an int, 2^31 of them would take 160 GB anyway.
+    ROW *grown = realloc(g_Configuration.rows, sizeof(ROW) * (g_Configuration.numberRows + count));
+	if (grown == NULL) return -1;
+	g_Configuration.rows = grown;
+    memmove(&g_Configuration.rows[at + count], &g_Configuration.rows[at], sizeof(ROW) * (g_Configuration.numberRows - at));
+	memcpy(&g_Configuration.rows[at], rows, sizeof(ROW) * count);
+	
+    g_Configuration.numberRows += count;
+    g_Configuration.dirty++;
+    return 0;
+}
+
+int syntaxToColour(int highlight) {
+	switch (highlight) {
+		case HL_KEYWORD1:
+			return 94;
+		case HL_KEYWORD2:
+			return 92;
+		case HL_KEYWORD3:
+			return 33;
+		case HL_COMMENT:
+			return 90;
+		case HL_NUMBER:
+			return 91;
+		case HL_STRING:
+			return 35;
+		case HL_MATCH:
+			return 34;
+		default:
+			return 37;
+	}
+	return -1;
+}
+
+void selectSyntaxHighlight(void) {
+	g_Configuration.syntax = NULL;
+	if (g_Configuration.filename == NULL) return;
+	char *ext = strrchr(g_Configuration.filename, '.');	
+	for (unsigned int i = 0; i < HIGHLIGHT_ENTRIES; i++) {
+		struct langSyntax *syntax =  &g_highlightDatabase[i];
+		unsigned int y = 0;
+		while (syntax->filematch[y]) {
+			int is_extension = (syntax->filematch[y][0] == '.');
+			if ((is_extension && ext && !strcmp(ext, syntax->filematch[y])) ||
+				(!is_extension && strstr(g_Configuration.filename, syntax->filematch[y]))) {
+				g_Configuration.syntax = syntax;
+				int fileRow;
+				for (fileRow = 0; fileRow < g_Configuration.numberRows; fileRow++) {
+					updateSyntax(&g_Configuration.rows[fileRow]);
+				}
+				return;
+			}
+			y++;
+		}
+	}
+}
+
+int is_separator(int c) {
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:?", c) != NULL;
+}
+void updateSyntax(ROW *row) {
+	if (row->render == NULL) return; // compacted, it's highlighted again along with its render.
+	row->highlight = realloc(row->highlight, row->rsize);
+	memset(row->highlight, HL_NORMAL, row->rsize);
+	if (g_Configuration.syntax == NULL) return;
+	long long trace = traceBegin();
+	char **keywords = g_Configuration.syntax->keywords;
+	char *scs = g_Configuration.syntax->singleline_comment_start;
+	int scs_length = scs ? strlen(scs) : 0;
+	int prev_sep = 1; int in_string = 0;
+	size_t i = 0;
+	
+	while (i < row->rsize) {
+		char c = row->render[i];
+		unsigned char prev_highlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+		if (scs_length && !in_string) {
+			if (!strncmp(&row->render[i], scs, scs_length)) {
+				memset(&row->highlight[i], HL_COMMENT, row->rsize - i);
+				break;
+			}
+		}
+		if (g_Configuration.syntax->flags & HIGHLIGHT_STRINGS) {
+			if (in_string) {
+				row->highlight[i] = HL_STRING;
+				if (c == '\\' && i + 1 < row->rsize) {
+					row->highlight[i + 1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+				if (c == in_string) in_string = 0;
+				prev_sep = 1;
+				i++;
+				continue;
+			} else {
+				if (c == '"' || c == '\'') {
+          			row->highlight[i] = HL_STRING;
+					in_string = c;
+					i++;
+					continue;
 				}
+			}
+		}
+		if (g_Configuration.syntax->flags & HIGHLIGHT_NUMBERS) {
+			if ((isdigit(c) && (prev_sep || prev_highlight == HL_NUMBER)) || (c == '.' && prev_highlight == HL_NUMBER)) {
+				row->highlight[i] = HL_NUMBER;
+				prev_sep = 0;
+				i++;
+				continue;
+			}
+		}
+		if (prev_sep) {
+			int j;
+			for (j = 0; keywords[j]; j++) {
+				int klen = strlen(keywords[j]);
+				int kw2 = keywords[j][klen - 1] == '|';
+				int kw3 = keywords[j][klen - 1] == '/';
+				if (kw2) klen--; if (kw3) klen--;
+				if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
+//					memset(&row->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+					if (kw2)
+						memset(&row->highlight[i], HL_KEYWORD2, klen);
+					else if (kw3)
+						memset(&row->highlight[i], HL_KEYWORD3, klen);
+					else
+						memset(&row->highlight[i], HL_KEYWORD1, klen);
+					i += klen;
+					break;
+				}
+			}
+			if (keywords[j] != NULL) {
+				prev_sep = 0;
+				continue;
+			}
+		}
+		prev_sep = is_separator(c);
+		i++;
+	}
+	traceEnd("updateSyntax", trace);
+}
+
+// chars -> render only, the column index and the highlight are left to the caller.
+void rowRender(ROW *row) {
+	size_t tabs = 0;
+	
+	for (size_t i = 0; i < row->size; i++)
+	if (row->chars[i] == '\t')
+		tabs++;
+	// the highlight follows the render size, so both are counted here.
+	if (row->render)
+		g_derivedBytes -= 2 * (long long)row->rsize + 1;
+	free(row->render);
+	free(row->cells);
+	row->cells = NULL;
+	row->ascii = 0;
+	
+	if (!rowIsAscii(row)) {
+		// a byte never takes more than two in render, a tab at most TAB_STOP.
+		row->render = malloc(2 * row->size + tabs * TAB_STOP + 1);
+		row->rsize = rowCells(row, row->render);
+		row->render[row->rsize] = '\0';
+		g_derivedBytes += 2 * (long long)row->rsize + 1;
+		return;
+	}
+	row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+	size_t index = 0;
+	for (size_t i = 0; i < row->size; i++) {
+		if (row->chars[i] == '\t') {
+			row->render[index++] = ' ';
+			while (index % TAB_STOP != 0)
+				row->render[index++] = ' ';
+		} else {
+			row->render[index++] = row->chars[i];
+		}
+	}
+	
+	row->render[index] = '\0';
+	row->rsize = index;
+	g_derivedBytes += 2 * (long long)row->rsize + 1;
+	return;
+}
+// a macro being replayed would build the same rows again at every key: they are only compacted,
+// and built again by rowEnsureRender() once something looks at them.
+void updateRow(ROW *row) {
+	if (g_macro.replaying) {
+		rowCompact(row);
+		free(row->columns);
+		free(row->cells);
+		row->columns = NULL;
+		row->numberColumns = -1;
+		row->cells = NULL;
+		row->ascii = 0;
+		return;
+	}
+	updateRowNow(row);
+	return;
+}
+void updateRowNow(ROW *row) {
+	long long trace = traceBegin();
+	rowRender(row);
+	
+	free(row->columns);
+	row->columns = NULL;
+	row->numberColumns = -1;
+	
+	updateSyntax(row);
+	traceEnd("updateRow", trace);
+	return;
+}
+
+void editorScroll(void) {
+    g_Configuration.renderX = 0;
+    if (g_Configuration.cursorY < g_Configuration.numberRows)
+	g_Configuration.renderX = rowCxToRx(&g_Configuration.rows[g_Configuration.cursorY], g_Configuration.cursorX);
+    
+    if (g_Configuration.cursorY < g_Configuration.rowsOff) g_Configuration.rowsOff = g_Configuration.cursorY;
+    if (g_Configuration.cursorY >= g_Configuration.rowsOff + g_Configuration.screenRows) g_Configuration.rowsOff = g_Configuration.cursorY - g_Configuration.screenRows + 1;
+ 	
+	if (g_Configuration.renderX < g_Configuration.colsOff) {
+		g_Configuration.colsOff = g_Configuration.renderX;
+	}
+	if (g_Configuration.renderX >= g_Configuration.colsOff + g_Configuration.screenCols) {
+		g_Configuration.colsOff = g_Configuration.renderX - g_Configuration.screenCols + 1;
+	}
+    return;
+}
+
+// hashes 32 bytes per round in four independent lanes, it only has to tell contents apart.
+uint64_t contentHash(const void *data, size_t size) {
+	const unsigned char *bytes = data;
+	uint64_t lanes[4] = { 0x9E3779B97F4A7C15ull ^ size, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		for (int lane = 0; lane < 4; lane++) {
+			uint64_t word;
+			memcpy(&word, &bytes[i + lane * 8], 8);
+			lanes[lane] = (lanes[lane] ^ word) * 0xFF51AFD7ED558CCDull;
+			lanes[lane] ^= lanes[lane] >> 32;
+		}
+	}
+	uint64_t hash = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+	for (; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	hash ^= hash >> 29;
+	return hash * 0xBF58476D1CE4E5B9ull;
+}
+
+// $XDG_CACHE_HOME/charlie/<hash of the absolute path>, created when 'create' is set.
+static char *cachePath(const char *file_path, int create) {
+	char absolute[PATH_MAX];
+	if (realpath(file_path, absolute) == NULL)
+		return NULL;
+	
+	char directory[PATH_MAX];
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && base[0] != '\0')
+		snprintf(directory, sizeof(directory), "%s/charlie", base);
+	else if ((base = getenv("HOME")) != NULL) {
+		snprintf(directory, sizeof(directory), "%s/.cache", base);
+		if (create) mkdir(directory, 0700);
+		snprintf(directory, sizeof(directory), "%s/.cache/charlie", base);
+	} else
+		return NULL;
+	if (create) mkdir(directory, 0700);
+	
+	char *path;
+	if (asprintf(&path, "%s/%016llx%s", directory, (unsigned long long)contentHash(absolute, strlen(absolute)), CACHE_EXTENSION) == -1)
+		return NULL;
+	return path;
+}
+
+static void cacheHeaderFill(struct cacheHeader *header, struct stat *file_stat, uint64_t hash, uint64_t rows) {
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	snprintf(header->version, sizeof(header->version), "%s", VERSION);
+	snprintf(header->filetype, sizeof(header->filetype), "%s", g_Configuration.syntax ? g_Configuration.syntax->filetype : "");
+	header->tabStop = TAB_STOP;
+	header->fileSize = file_stat->st_size;
+	header->mtimeSeconds = file_stat->st_mtim.tv_sec;
+	header->mtimeNanoseconds = file_stat->st_mtim.tv_nsec;
+	header->contentHash = hash;
+	header->numberRows = rows;
+	return;
+}
+
+// fills the (empty) active buffer from the cache. returns 0, touching nothing, if the cache
+// is missing or does not describe exactly this file, highlighted exactly this way.
+int cacheLoad(const char *file_path, int fd, struct stat *file_stat) {
+	char *path = cachePath(file_path, 0);
+	if (path == NULL) return 0;
+	int cache_fd = open(path, O_RDONLY);
+	free(path);
+	if (cache_fd == -1) return 0;
+	
+	struct stat cache_stat;
+	if (fstat(cache_fd, &cache_stat) == -1 || (size_t)cache_stat.st_size < sizeof(struct cacheHeader)) {
+		close(cache_fd);
+		return 0;
+	}
+	size_t cache_size = cache_stat.st_size;
+	unsigned char *cache = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, cache_fd, 0);
+	close(cache_fd);
+	if (cache == MAP_FAILED) return 0;
+	
+	int loaded = 0;
+	ROW *rows = NULL;
+	uint64_t built = 0;
+	char *data = MAP_FAILED;
+	size_t data_size = file_stat->st_size;
+	
+	struct cacheHeader header, expected;
+	memcpy(&header, cache, sizeof(header));
+	cacheHeaderFill(&expected, file_stat, header.contentHash, header.numberRows);
+	expected.highlightBytes = header.highlightBytes;
+	if (memcmp(&header, &expected, sizeof(header)) != 0)
+		goto done;
+	if (header.numberRows > (cache_size - sizeof(header)) / sizeof(struct cacheLine) ||
+		sizeof(header) + header.numberRows * sizeof(struct cacheLine) + header.highlightBytes != cache_size)
+		goto done;
+	
+	if (data_size > 0) {
+		data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) goto done;
+		madvise(data, data_size, MADV_SEQUENTIAL);
+		if (contentHash(data, data_size) != header.contentHash)
+			goto done;
+	}
+	
+	rows = malloc(sizeof(ROW) * (header.numberRows ? header.numberRows : 1));
+	if (rows == NULL) goto done;
+	struct cacheLine *lines = (struct cacheLine *)(cache + sizeof(header));
+	unsigned char *highlight = cache + sizeof(header) + header.numberRows * sizeof(struct cacheLine);
+	uint64_t highlight_left = header.highlightBytes;
+	
+	for (; built < header.numberRows; built++) {
+		ROW *row = &rows[built];
+		struct cacheLine line;
+		memcpy(&line, &lines[built], sizeof(line));
+		if (line.offset > data_size || line.length > data_size - line.offset)
+			goto done;
 		
-				int times = g_Configuration.screenRows;
-				while (times--)
-		    		moveCursor(c == PAGE_UP ? UP : DOWN);
-	    	}
-	   		break;
+		memset(row, 0, sizeof(ROW));
+		row->numberColumns = -1;
+		row->size = line.length;
+		row->chars = malloc(line.length + 1);
+		if (row->chars == NULL) goto done;
+		memcpy(row->chars, &data[line.offset], line.length);
+		row->chars[line.length] = '\0';
+		rowRender(row);
+		
+		if ((uint64_t)row->rsize > highlight_left) {
+			built++;
+			goto done;
+		}
+		row->highlight = malloc(row->rsize ? row->rsize : 1);
+		if (row->highlight) memcpy(row->highlight, highlight, row->rsize);
+		highlight += row->rsize;
+		highlight_left -= row->rsize;
+	}
+	if (highlight_left != 0)
+		goto done;
+	
+	g_Configuration.rows = rows;
+	g_Configuration.numberRows = header.numberRows;
+	loaded = 1;
+done:
+	if (!loaded && rows) {
+		for (uint64_t i = 0; i < built; i++)
+			freeRow(&rows[i]);
+		free(rows);
+	}
+	if (data != MAP_FAILED) munmap(data, data_size);
+	munmap(cache, cache_size);
+	return loaded;
+}
+
+// 'lines' says where every row of the active buffer starts and how long it is in the file.
+// written to a temporary file and renamed over, so a reader never sees half a cache.
+void cacheStore(const char *file_path, struct stat *file_stat, uint64_t hash, struct cacheLine *lines) {
+	char *path = cachePath(file_path, 1);
+	if (path == NULL) return;
+	char *temporary;
+	if (asprintf(&temporary, "%s.%d", path, (int)getpid()) == -1) {
+		free(path);
+		return;
+	}
+	
+	struct cacheHeader header;
+	cacheHeaderFill(&header, file_stat, hash, g_Configuration.numberRows);
+	// rows that were never drawn have no render yet, their size comes from the column index.
+	for (int i = 0; i < g_Configuration.numberRows; i++) {
+		ROW *row = &g_Configuration.rows[i];
+		header.highlightBytes += row->render ? row->rsize : rowCxToBx(row, row->size);
+	}
+	
+	int ok = 0;
+	FILE *cache = fopen(temporary, "w");
+	if (cache) {
+		setvbuf(cache, NULL, _IOFBF, 1 << 20);
+		ok = fwrite(&header, sizeof(header), 1, cache) == 1 &&
+			 (g_Configuration.numberRows == 0 || fwrite(lines, sizeof(struct cacheLine), g_Configuration.numberRows, cache) == (size_t)g_Configuration.numberRows);
+		for (int i = 0; ok && i < g_Configuration.numberRows; i++) {
+			ROW *row = &g_Configuration.rows[i];
+			int compacted = row->render == NULL;
+			rowEnsureRender(row);
+			if (row->rsize && fwrite(row->highlight, row->rsize, 1, cache) != 1)
+				ok = 0;
+			if (compacted)
+				rowCompact(row);
+		}
+		if (fclose(cache) != 0)
+			ok = 0;
+	}
+	if (!ok || rename(temporary, path) == -1)
+		unlink(temporary);
+	free(temporary);
+	free(path);
+	return;
+}
+
+// after a plain load: hashes the file as it is now and only caches it if it did not change meanwhile.
+static void cacheStoreOpened(const char *file_path, int fd, struct stat *file_stat, struct cacheLine *lines) {
+	struct stat now;
+	if (fstat(fd, &now) == -1 || now.st_size != file_stat->st_size ||
+		now.st_mtim.tv_sec != file_stat->st_mtim.tv_sec || now.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec)
+		return;
+	uint64_t hash = contentHash(NULL, 0);
+	if (file_stat->st_size > 0) {
+		char *data = mmap(NULL, file_stat->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) return;
+		madvise(data, file_stat->st_size, MADV_SEQUENTIAL);
+		hash = contentHash(data, file_stat->st_size);
+		munmap(data, file_stat->st_size);
+	}
+	cacheStore(file_path, file_stat, hash, lines);
+	return;
+}
+
+static void backupWrite(void) {
+	if (g_Configuration.filename == NULL || g_Configuration.bufferType != BT_FILE)
+		return;
+	int backup_length = strlen(g_Configuration.filename) + strlen(BACKUP_STRING) + 1;
+	char *backup_filename = (char*)malloc(backup_length);
+	
+	snprintf(backup_filename, backup_length, "%s%s", g_Configuration.filename, BACKUP_STRING);
+	int fd = open(backup_filename, O_RDWR | O_CREAT, 0644);
+	if (fd != -1) {
+		off_t length = rowsWrite(fd);
+		if (length != -1 && ftruncate(fd, length) != -1) {
+			close(fd);
+			
+			setStatusMessage("Backup saved successfully");
+			g_backupCounter = 0;
+			return;
+		}
+		close(fd);
+	}
+	setStatusMessage("Failed at saving backup");
+	free(backup_filename);
+	return;
+}
+void backupSave(void) {
+	long long trace = traceBegin();
+	backupWrite();
+	traceEnd("backupSave", trace);
+	return;
+}
+static void saveFile(void) {
+	if (g_Configuration.bufferType != BT_FILE) {
+		setStatusMessage("This buffer is not visiting a file.");
+		return;
+	}
+    if (g_Configuration.filename == NULL) {
+		g_Configuration.filename = prompt("Save new file as: %s", PC_SAVE, NULL);
+		if (g_Configuration.filename == NULL) {
+	    	setStatusMessage("Saving process aborted.");
+	    	return;
+		}
+		selectSyntaxHighlight();
+		g_Configuration.codec = codecDetect(g_Configuration.filename);
+    }
+	if (g_Configuration.codec) {
+		long long written = codecSave(g_Configuration.codec, g_Configuration.filename);
+		if (written == -1) {
+			setStatusMessage("Can't save through '%s': %s", g_Configuration.codec->compress, strerror(errno));
+			return;
+		}
+		setStatusMessage("%s saved! [%lld bytes compressed with %s]", g_Configuration.filename, written, g_Configuration.codec->compress);
+		g_Configuration.dirty = 0;
+		g_Configuration.diskChanged = 0;
+		fileUnwatch(); // it's a new file now, renamed over the old one.
+		fileWatch();
+		return;
+	}
+    int fd = open(g_Configuration.filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+	// written over the old contents first, cut to size after.
+	off_t length = rowsWrite(fd);
+	if (length != -1 && ftruncate(fd, length) != -1) {
+		struct stat file_stat;
+		if (g_doCache && length >= CACHE_MIN_BYTES && fstat(fd, &file_stat) == 0) {
+			struct cacheLine *lines = malloc(sizeof(struct cacheLine) * (g_Configuration.numberRows + 1));
+			char *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+			uint64_t offset = 0;
+			for (int i = 0; lines && i < g_Configuration.numberRows; i++) {
+				lines[i].offset = offset;
+				lines[i].length = g_Configuration.rows[i].size;
+				offset += g_Configuration.rows[i].size + 1;
+			}
+			if (lines && data != MAP_FAILED)
+				cacheStore(g_Configuration.filename, &file_stat, contentHash(data, length), lines);
+			if (data != MAP_FAILED) munmap(data, length);
+			free(lines);
+		}
+		// when following it, what was just written is the buffer itself: followRead() must not append it
+		// again, or take the cut to size for a truncation. rowsWrite() ends every row with its '\n'.
+		struct stat follow_stat;
+		if (g_Configuration.followFd != -1 && fstat(fd, &file_stat) == 0 && fstat(g_Configuration.followFd, &follow_stat) == 0 &&
+			file_stat.st_dev == follow_stat.st_dev && file_stat.st_ino == follow_stat.st_ino) {
+			g_Configuration.followOffset = length;
+			g_Configuration.followTail = 0;
+		}
+		close(fd);
+		
+		setStatusMessage("%s saved! [%lld bytes written to disk]", g_Configuration.filename, (long long)length);
+		g_Configuration.dirty = 0;
+		g_Configuration.diskChanged = 0;
+		fileWatch();
+		return;
+	}
+	close(fd);
+    }
+    setStatusMessage("Can't save :: Input/Output error: %s", strerror(errno));
+    return;
+}
+void save(void) {
+	if (bufferReadOnly()) return;
+	if (g_Configuration.partial) {
+		setStatusMessage("Only part of the file is loaded, not saving it over the whole.");
+		return;
+	}
+	if (g_Configuration.diskChanged) {
+		setStatusMessage("%s changed on disk since it was read! Overwrite it? (y/n)", g_Configuration.filename);
+		refreshScreen();
+		if (readKey() != 'y') {
+			setStatusMessage("Save aborted, revert takes the version on disk.");
+			return;
+		}
+	}
+	long long trace = traceBegin();
+	saveFile();
+	traceEnd("save", trace);
+	return;
+}
+
+// the format of 'file_path' by its first bytes, or by its name when it is empty or not there yet.
+struct codec *codecDetect(const char *file_path) {
+	unsigned char magic[8];
+	ssize_t length = -1;
+	int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		length = pread(fd, magic, sizeof(magic), 0);
+		close(fd);
+	}
+	for (int i = 0; i < CODECS_NUMBER; i++) {
+		struct codec *codec = &g_codecs[i];
+		if (length > 0) {
+			if ((size_t)length >= codec->magicLength && memcmp(magic, codec->magic, codec->magicLength) == 0)
+				return codec;
+			continue;
+		}
+		size_t name_length = strlen(file_path), extension_length = strlen(codec->extension);
+		if (name_length > extension_length && strcmp(&file_path[name_length - extension_length], codec->extension) == 0)
+			return codec;
+	}
+	return NULL;
+}
+// runs 'codec_command' between 'input' and 'output'. what it says on stderr is dropped, only its exit status counts.
+static pid_t codecSpawn(const char *codec_command, int input, int output) {
+	int errors = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	pid_t pid = spawnShell(codec_command, input, output, errors == -1 ? STDERR_FILENO : errors);
+	if (errors != -1) close(errors);
+	return pid;
+}
+// 0 once 'pid' is done and went well.
+int codecWait(pid_t pid) {
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR) return -1;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+// the read end of a pipe giving 'fd' decompressed, -1 if the decompressor could not be started.
+int codecOpen(struct codec *codec, int fd, pid_t *pid) {
+	int descriptors[2];
+	if (pipe2(descriptors, O_CLOEXEC) == -1) return -1;
+	*pid = codecSpawn(codec->decompress, fd, descriptors[1]);
+	close(descriptors[1]);
+	if (*pid == -1) {
+		close(descriptors[0]);
+		return -1;
+	}
+	return descriptors[0];
+}
+// all of 'file_path', decompressed. NULL if that didn't work out.
+char *codecRead(struct codec *codec, const char *file_path, size_t *length) {
+	int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+	pid_t pid;
+	int stream = codecOpen(codec, fd, &pid);
+	close(fd);
+	if (stream == -1) return NULL;
 	
-		case RIGHT:
-		case LEFT:
-		case DOWN:
-		case UP:
-	    	moveCursor(c);
-	    	break;
-		
-		case CTRL_KEY('l'):
-			centerScreen();
-	    	break;
+	struct ABUF data = ABUF_INIT;
+	char block[FILTER_READ_SIZE];
+	ssize_t nread;
+	while ((nread = read(stream, block, sizeof(block))) != 0) {
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread == -1) break;
+		bufferAppend(&data, block, nread);
+	}
+	close(stream);
+	if (codecWait(pid) == -1 || nread == -1) {
+		bufferFree(&data);
+		return NULL;
+	}
+	*length = data.length;
+	return data.buffer ? data.buffer : calloc(1, 1);
+}
+// saves the active buffer through the compressor, row by row: the text is never put together in one piece.
+// it goes to a temporary file first, so a compressor that fails leaves the old file as it was.
+// returns the bytes fed to the compressor, -1 on failure with errno set.
+long long codecSave(struct codec *codec, const char *file_path) {
+	char *temporary = malloc(strlen(file_path) + sizeof(".XXXXXX"));
+	if (temporary == NULL) return -1;
+	sprintf(temporary, "%s.XXXXXX", file_path);
+	int fd = mkostemp(temporary, O_CLOEXEC);
+	if (fd == -1) {
+		free(temporary);
+		return -1;
+	}
+	struct stat file_stat;
+	fchmod(fd, stat(file_path, &file_stat) == 0 ? file_stat.st_mode & 07777 : 0644);
 	
-		default:
-	    	insertChar(c);
-	    	break;
-    }
-    quit_times = QUIT_TIMES;
-    return;
+	int descriptors[2];
+	pid_t pid = -1;
+	if (pipe2(descriptors, O_CLOEXEC) == 0) {
+		pid = codecSpawn(codec->compress, descriptors[0], fd);
+		close(descriptors[0]);
+		if (pid == -1) close(descriptors[1]);
+	}
+	close(fd);
+	
+	long long total = 0;
+	int failed = pid == -1 ? errno : 0;
+	if (pid != -1 && (total = rowsWrite(descriptors[1])) == -1)
+		failed = errno;
+	if (pid != -1) {
+		close(descriptors[1]);
+		if (codecWait(pid) == -1 && !failed) failed = EIO;
+	}
+	if (!failed && rename(temporary, file_path) == -1) failed = errno;
+	if (failed) unlink(temporary);
+	free(temporary);
+	errno = failed;
+	return failed ? -1 : total;
 }
 
-int readKey(void) {
-    int nread; char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-	if (nread == -1 && errno != EAGAIN)
-	    error("read");
-    }
-    
-    if (c == '\x1b') {
-		char sequence[3];
-		if (read(STDIN_FILENO, &sequence[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &sequence[1], 1) != 1) return '\x1b';
+static struct loadBatch *loadBatchNew(int capacity, int cacheable) {
+	struct loadBatch *batch = calloc(1, sizeof(struct loadBatch));
+	if (batch == NULL) return NULL;
+	batch->capacity = capacity;
+	batch->rows = malloc(sizeof(ROW) * capacity);
+	if (cacheable) batch->lines = malloc(sizeof(struct cacheLine) * capacity);
+	if (batch->rows == NULL || (cacheable && batch->lines == NULL)) {
+		free(batch->rows);
+		free(batch->lines);
+		free(batch);
+		return NULL;
+	}
+	return batch;
+}
+static void loadBatchFree(struct loadBatch *batch, int rows_too) {
+	for (int i = 0; rows_too && i < batch->count; i++)
+		freeRow(&batch->rows[i]);
+	free(batch->rows);
+	free(batch->lines);
+	free(batch);
+	return;
+}
+static void loadPublish(struct loadJob *job, struct loadBatch *batch) {
+	pthread_mutex_lock(&job->lock);
+	*job->batchesTail = batch;
+	job->batchesTail = &batch->next;
+	pthread_mutex_unlock(&job->lock);
+	write(job->notify[1], "", 1);
+	return;
+}
+// one row with only its chars: render and highlight are built when it's first drawn, as for a compacted one.
+static int loadRow(struct loadJob *job, struct loadBatch **batch, const char *line, size_t length, uint64_t offset) {
+	while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		length--;
+	ROW *row = &(*batch)->rows[(*batch)->count];
+	memset(row, 0, sizeof(ROW));
+	row->numberColumns = -1;
+	row->size = length;
+	row->chars = malloc(length + 1);
+	if (row->chars == NULL) return -1;
+	memcpy(row->chars, line, length);
+	row->chars[length] = '\0';
+	if ((*batch)->lines) {
+		(*batch)->lines[(*batch)->count].offset = offset;
+		(*batch)->lines[(*batch)->count].length = length;
+	}
+	(*batch)->count++;
 	
-		if (sequence[0] == '[') {
-	    	if (sequence[1] >= '0' && sequence[1] <= '9') {
-				if (read(STDIN_FILENO, &sequence[2], 1) != 1) return '\x1b';
-				if (sequence[2] == '~') {
-		    		switch (sequence[1]) {
-		        		case '6': return PAGE_DOWN;
-		        		case '5': return PAGE_UP;
-			
-						case '1': return HOME;
-		        		case '7': return HOME;
-		        		case '4': return END;
-		        		case '8': return END;
-			
-						case '3': return DELETE;
-					}
+	if ((*batch)->count == (*batch)->capacity) {
+		loadPublish(job, *batch);
+		*batch = loadBatchNew(LOAD_BATCH_ROWS, job->cacheable);
+		if (*batch == NULL) return -1;
+	}
+	return 0;
+}
+
+// runs on its own thread and touches no editor state, everything goes through the batches.
+static void *loadWorker(void *argument) {
+	struct loadJob *job = argument;
+	char *block = malloc(LOAD_READ_SIZE);
+	struct ABUF partial = ABUF_INIT;
+	struct loadBatch *batch = loadBatchNew(LOAD_FIRST_BATCH, job->cacheable);
+	uint64_t block_offset = 0, line_start = 0;
+	if (block == NULL || batch == NULL) {
+		job->failed = ENOMEM;
+		goto done;
+	}
+	
+	while (!atomic_load(&job->cancel)) {
+		ssize_t nread = read(job->fd, block, LOAD_READ_SIZE);
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread == -1) {
+			job->failed = errno;
+			break;
+		}
+		if (nread == 0) {
+			// the last line, when the file doesn't end with a newline.
+			if (partial.length > 0 && loadRow(job, &batch, partial.buffer, partial.length, line_start) == -1)
+				job->failed = ENOMEM;
+			break;
+		}
+		
+		char *data = block, *end = block + nread, *newline;
+		while ((newline = memchr(data, '\n', end - data)) != NULL) {
+			const char *line = data;
+			size_t length = newline - data;
+			if (partial.length > 0) {
+				if (bufferAppend(&partial, data, length) == -1) {
+					job->failed = ENOMEM;
+					goto done;
 				}
-	    	} else {
-				switch (sequence[1]) {
-		  		  	case 'C': return RIGHT;
-		    		case 'D': return LEFT;
-		    		case 'B': return DOWN;
-		    		case 'A': return UP;
-		    		
-		    		case 'H': return HOME;
-		    		case 'F': return END;
+				line = partial.buffer;
+				length = partial.length;
+			}
+			if (loadRow(job, &batch, line, length, line_start) == -1) {
+				job->failed = ENOMEM;
+				goto done;
+			}
+			partial.length = 0;
+			data = newline + 1;
+			line_start = block_offset + (data - block);
+		}
+		if (bufferAppend(&partial, data, end - data) == -1) {
+			job->failed = ENOMEM;
+			break;
+		}
+		block_offset += nread;
+		atomic_store(&job->bytesRead, block_offset);
+		
+		// every block read shows up on screen, however long its lines are.
+		if (batch->count > 0) {
+			loadPublish(job, batch);
+			batch = loadBatchNew(LOAD_BATCH_ROWS, job->cacheable);
+			if (batch == NULL) {
+				job->failed = ENOMEM;
+				break;
+			}
+		}
+	}
+done:
+	if (batch != NULL && batch->count > 0)
+		loadPublish(job, batch);
+	else if (batch != NULL)
+		loadBatchFree(batch, 0);
+	free(block);
+	bufferFree(&partial);
+	
+	pthread_mutex_lock(&job->lock);
+	job->finished = 1;
+	pthread_mutex_unlock(&job->lock);
+	write(job->notify[1], "", 1);
+	return NULL;
+}
+
+static void loadJoin(struct loadJob *job) {
+	if (job->joined) return;
+	pthread_join(job->thread, NULL);
+	job->joined = 1;
+	return;
+}
+static void loadFree(struct loadJob *job) {
+	while (job->batches) {
+		struct loadBatch *next = job->batches->next;
+		loadBatchFree(job->batches, 1);
+		job->batches = next;
+	}
+	watchRemove(job->notify[0]);
+	close(job->notify[0]);
+	close(job->notify[1]);
+	close(job->fd);
+	if (job->codec > 0) {
+		kill(job->codec, SIGTERM); // nothing if it's done already, it hasn't been waited for.
+		codecWait(job->codec);
+	}
+	pthread_mutex_destroy(&job->lock);
+	free(job->lines);
+	free(job->path);
+	free(job);
+	return;
+}
+
+// moves the rows read so far into the buffer being loaded. returns 1 if the screen needs a repaint.
+int loadPoll(void) {
+	if (g_load == NULL) return 0;
+	char drain[256];
+	while (read(g_load->notify[0], drain, sizeof(drain)) > 0);
+	
+	pthread_mutex_lock(&g_load->lock);
+	struct loadBatch *batches = g_load->batches;
+	g_load->batches = NULL;
+	g_load->batchesTail = &g_load->batches;
+	int finished = g_load->finished;
+	pthread_mutex_unlock(&g_load->lock);
+	
+	int index = bufferFind(g_load->path);
+	if (index == -1) {
+		// the buffer was closed under us.
+		g_load->batches = batches;
+		atomic_store(&g_load->cancel, 1);
+		loadJoin(g_load);
+		loadFree(g_load);
+		g_load = NULL;
+		return 0;
+	}
+	
+	int previous = g_currentBuffer;
+	bufferActivate(index);
+	int dirty = g_Configuration.dirty;
+	while (batches) {
+		struct loadBatch *next = batches->next;
+		int at = g_Configuration.numberRows;
+		if (insertRows(at, batches->rows, batches->count) == -1) {
+			// no room for them, what's there is all the buffer will have.
+			atomic_store(&g_load->cancel, 1);
+			loadBatchFree(batches, 1);
+		} else {
+			if (batches->lines && g_load->cacheable) {
+				struct cacheLine *lines = realloc(g_load->lines, sizeof(struct cacheLine) * g_Configuration.numberRows);
+				if (lines == NULL) g_load->cacheable = 0;
+				else {
+					g_load->lines = lines;
+					memcpy(&g_load->lines[at], batches->lines, sizeof(struct cacheLine) * batches->count);
 				}
 			}
-		} else if (sequence[0] == '0') {
-	    	switch (sequence[1]) {
-	        	case 'H': return HOME;
-	        	case 'F': return END;
-	    	}
+			loadBatchFree(batches, 0);
 		}
-		return c;
-    } else {
-		switch (c) {
-	 		// Emacs-like
-	  		case CTRL_KEY('f'): return RIGHT;
-	    	case CTRL_KEY('b'): return LEFT;
-	    	case CTRL_KEY('n'): return DOWN;
-	    	case CTRL_KEY('p'): return UP;
-	    
-	    	case CTRL_KEY('a'): return HOME;
-	    	case CTRL_KEY('e'): return END;
-			
-			case CTRL_KEY('v'): return PAGE_DOWN;
-			
-			case CTRL_KEY('g'): return RIGHT_WORD;
+		batches = next;
+	}
+	g_Configuration.dirty = dirty;
+	if (g_load->gotoLine >= 0 && index == previous && g_load->gotoLine < g_Configuration.numberRows) {
+		gotoLine(g_load->gotoLine);
+		g_load->gotoLine = -1;
+	}
+	
+	if (!finished) {
+		bufferActivate(previous);
+		return 1;
+	}
+	loadJoin(g_load);
+	int cancelled = atomic_load(&g_load->cancel);
+	if (!cancelled && !g_load->failed && g_load->codec > 0) {
+		if (codecWait(g_load->codec) == -1) g_load->failed = EIO;
+		g_load->codec = 0;
+	}
+	if (g_load->failed)
+		setStatusMessage("Loading %s failed: %s. %d lines read.", g_load->path, strerror(g_load->failed), g_Configuration.numberRows);
+	else if (cancelled)
+		setStatusMessage("Loading cancelled, the first %d lines were kept.", g_Configuration.numberRows);
+	else {
+		g_Configuration.partial = 0;
+		if (g_load->cacheable && !g_Configuration.dirty)
+			cacheStoreOpened(g_load->path, g_load->fd, &g_load->fileStat, g_load->lines);
+		setStatusMessage("%s loaded, %d lines.", g_load->path, g_Configuration.numberRows);
+	}
+	bufferActivate(previous);
+	loadFree(g_load);
+	g_load = NULL;
+	return 1;
+}
+
+// starts reading 'fd' into the active buffer in the background, -1 when it has to be done in the foreground.
+static int loadStart(const char *file_path, int fd, struct stat *file_stat, int cacheable) {
+	if (g_load != NULL) return -1;
+	struct loadJob *job = calloc(1, sizeof(struct loadJob));
+	if (job == NULL) return -1;
+	job->fd = dup(fd);
+	job->path = strdup(file_path);
+	job->fileStat = *file_stat;
+	job->cacheable = cacheable;
+	job->gotoLine = -1;
+	job->batchesTail = &job->batches;
+	pthread_mutex_init(&job->lock, NULL);
+	if (job->fd == -1 || job->path == NULL || pipe2(job->notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+		if (job->fd != -1) close(job->fd);
+		pthread_mutex_destroy(&job->lock);
+		free(job->path);
+		free(job);
+		return -1;
+	}
+	lseek(job->fd, 0, SEEK_SET);
+	if (pthread_create(&job->thread, NULL, loadWorker, job) != 0) {
+		job->joined = 1;
+		loadFree(job);
+		return -1;
+	}
+	g_load = job;
+	g_Configuration.partial = 1;
+	watchAdd(job->notify[0], loadPoll);
+	return 0;
+}
+
+// ESC while loading: stops reading and keeps the rows that are already in.
+void loadCancel(void) {
+	if (g_load == NULL) return;
+	atomic_store(&g_load->cancel, 1);
+	if (g_load->codec > 0)
+		kill(g_load->codec, SIGTERM); // or the worker could sit in read() until it writes again.
+	loadJoin(g_load);
+	// joined, so the worker's last word is already in: this one finishes the job.
+	loadPoll();
+	return;
+}
+// for the callers that need the whole file now (scripted runs, benchmarks).
+void loadWait(void) {
+	while (g_load != NULL) {
+		struct pollfd descriptor = { g_load->notify[0], POLLIN, 0 };
+		poll(&descriptor, 1, -1);
+		loadPoll();
+	}
+	return;
+}
+// 'line' of the file being loaded into the active buffer, once it has been read.
+void loadGoto(int line) {
+	if (g_load != NULL && bufferFind(g_load->path) == g_currentBuffer && line >= g_Configuration.numberRows)
+		g_load->gotoLine = line;
+	else
+		gotoLine(line);
+	return;
+}
+
+// -1 until the first file is watched.
+int g_inotify = -1;
+
+static uint64_t lineHash(const char *line, size_t length) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)line[i];
+		hash *= 1099511628211ull;
+	}
+	return hash ^ (length * 0x9e3779b97f4a7c15ull);
+}
+
+// myers' diff of a against b, as the runs of lines that differ. more than DIFF_MAX_EDITS edits
+// (or no memory for them) and the whole of it is given as a single hunk instead.
+static int diffLines(const uint64_t *a, int n, const uint64_t *b, int m, struct diffHunk **hunks) {
+	*hunks = NULL;
+	if (n == 0 && m == 0) return 0;
+	int max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+	int *v = calloc(2 * max + 3, sizeof(int));
+	int **trace = calloc(max + 1, sizeof(int *));
+	int found = -1, offset = max + 1;
+	
+	for (int d = 0; v && trace && d <= max && found == -1; d++) {
+		// only k in [-d - 1, d + 1] is read back when walking the path backwards.
+		trace[d] = malloc(sizeof(int) * (2 * d + 3));
+		if (trace[d] == NULL) break;
+		memcpy(trace[d], &v[offset - d - 1], sizeof(int) * (2 * d + 3));
+		
+		for (int k = -d; k <= d; k += 2) {
+			int x;
+			if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) x = v[offset + k + 1];
+			else                                                             x = v[offset + k - 1] + 1;
+			int y = x - k;
+			while (x < n && y < m && a[x] == b[y]) {
+				x++;
+				y++;
+			}
+			v[offset + k] = x;
+			if (x >= n && y >= m) {
+				found = d;
+				break;
+			}
 		}
-    }
-    return c;
+	}
+	
+	int count = 0;
+	struct diffHunk *list = NULL;
+	if (found == -1) {
+		list = malloc(sizeof(struct diffHunk));
+		if (list) {
+			list[0] = (struct diffHunk){ 0, n, 0, m };
+			count = 1;
+		}
+	} else {
+		// the matching lines along the path, bottom up, then the gaps between them are the hunks.
+		int *matches = malloc(sizeof(int) * 2 * (n < m ? n : m) + sizeof(int) * 2);
+		int number_matches = 0;
+		int x = n, y = m;
+		for (int d = found; matches && d >= 0; d--) {
+			int *previous = trace[d] + d + 1; // so previous[k] is v[k] as it was before step d.
+			int k = x - y, previous_k;
+			if (k == -d || (k != d && previous[k - 1] < previous[k + 1])) previous_k = k + 1;
+			else                                                         previous_k = k - 1;
+			int previous_x = d ? previous[previous_k] : 0;
+			int previous_y = previous_x - previous_k;
+			if (d == 0) previous_y = 0;
+			while (x > previous_x && y > previous_y) {
+				x--;
+				y--;
+				matches[2 * number_matches] = x;
+				matches[2 * number_matches + 1] = y;
+				number_matches++;
+			}
+			x = previous_x;
+			y = previous_y;
+		}
+		list = malloc(sizeof(struct diffHunk) * (found + 1));
+		int last_x = 0, last_y = 0;
+		for (int i = number_matches - 1; matches && list && i >= -1; i--) {
+			int match_x = i >= 0 ? matches[2 * i] : n;
+			int match_y = i >= 0 ? matches[2 * i + 1] : m;
+			if (match_x > last_x || match_y > last_y)
+				list[count++] = (struct diffHunk){ last_x, match_x - last_x, last_y, match_y - last_y };
+			last_x = match_x + 1;
+			last_y = match_y + 1;
+		}
+		if (matches == NULL || list == NULL) {
+			free(list);
+			list = malloc(sizeof(struct diffHunk));
+			count = 0;
+			if (list) list[count++] = (struct diffHunk){ 0, n, 0, m };
+		}
+		free(matches);
+	}
+	for (int d = 0; trace && d <= max && trace[d]; d++)
+		free(trace[d]);
+	free(trace);
+	free(v);
+	*hunks = list;
+	return count;
 }
 
-void insertRow(int at, char *string, size_t length) {
-    if (at < 0 || at > g_Configuration.numberRows) return;
-    g_Configuration.rows = realloc(g_Configuration.rows, sizeof(ROW) * (g_Configuration.numberRows + 1));
-    memmove(&g_Configuration.rows[at + 1], &g_Configuration.rows[at], sizeof(ROW) * (g_Configuration.numberRows - at));
-    
-    g_Configuration.rows[at].size = length;
-    g_Configuration.rows[at].chars = malloc(length + 1);
-    memcpy(g_Configuration.rows[at].chars, string, length);
-    g_Configuration.rows[at].chars[length] = '\0';
-    
-	g_Configuration.rows[at].highlight = NULL;
-	g_Configuration.rows[at].render = NULL;
-    g_Configuration.rows[at].rsize = 0;
+// where row 'y' ends up once the hunks are applied, staying inside a hunk that replaced it.
+static int diffMapRow(int y, struct diffHunk *hunks, int count, int base) {
+	int shift = 0;
+	for (int i = 0; i < count; i++) {
+		int start = base + hunks[i].oldStart;
+		if (y < start) break;
+		if (y < start + hunks[i].oldCount) {
+			int inside = y - start;
+			if (inside >= hunks[i].newCount) inside = hunks[i].newCount ? hunks[i].newCount - 1 : 0;
+			return base + hunks[i].newStart + inside;
+		}
+		shift += hunks[i].newCount - hunks[i].oldCount;
+	}
+	return y + shift;
+}
+
+static void fileStamp(void) {
+	struct stat file_stat;
+	if (g_Configuration.filename == NULL || stat(g_Configuration.filename, &file_stat) == -1) return;
+	g_Configuration.diskTime = file_stat.st_mtim;
+	g_Configuration.diskSize = file_stat.st_size;
+	return;
+}
+
+static void fileDataFree(char *data, size_t size) {
+	if (data == NULL) return;
+	if (g_Configuration.codec) free(data);
+	else                       munmap(data, size);
+	return;
+}
+// patches the active buffer into what is on disk now, touching only the rows that changed.
+// returns the number of rows replaced, -1 if the file couldn't be read, or its lines didn't all fit
+// (ENOMEM, the hunks that did not fit keep the old rows and the buffer stays modified).
+int fileReload(void) {
+	int fd = open(g_Configuration.filename, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1) {
+		close(fd);
+		return -1;
+	}
+	// 'data_size' bytes of text: the file mapped, or what came out of its decompressor.
+	char *data = NULL;
+	size_t data_size = file_stat.st_size;
+	if (g_Configuration.codec && file_stat.st_size > 0) {
+		data = codecRead(g_Configuration.codec, g_Configuration.filename, &data_size);
+		if (data == NULL) {
+			close(fd);
+			return -1;
+		}
+	} else if (file_stat.st_size > 0) {
+		data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
 	
-    updateRow(&g_Configuration.rows[at]);
-    
-    g_Configuration.numberRows++;
-    g_Configuration.dirty++;
-    return;
+	// the lines on disk, split the way editorOpen() does it.
+	int number_lines = 0, lines_capacity = 0;
+	struct cacheLine *lines = NULL;
+	for (size_t at = 0; at < data_size; ) {
+		char *newline = memchr(data + at, '\n', data_size - at);
+		size_t end = newline ? (size_t)(newline - data) : data_size;
+		size_t length = end - at;
+		while (length > 0 && (data[at + length - 1] == '\n' || data[at + length - 1] == '\r'))
+			length--;
+		if (number_lines == lines_capacity) {
+			lines_capacity = lines_capacity ? lines_capacity * 2 : 4096;
+			struct cacheLine *grown = realloc(lines, sizeof(struct cacheLine) * lines_capacity);
+			if (grown == NULL) {
+				free(lines);
+				fileDataFree(data, data_size);
+				return -1;
+			}
+			lines = grown;
+		}
+		lines[number_lines].offset = at;
+		lines[number_lines].length = length;
+		number_lines++;
+		at = end + 1;
+	}
+	
+	// the common head and tail are compared directly, only what's left in between is diffed.
+	int head = 0, rows = g_Configuration.numberRows;
+	while (head < rows && head < number_lines && g_Configuration.rows[head].size == lines[head].length &&
+		   memcmp(g_Configuration.rows[head].chars, data + lines[head].offset, lines[head].length) == 0)
+		head++;
+	int tail = 0;
+	while (tail < rows - head && tail < number_lines - head) {
+		ROW *row = &g_Configuration.rows[rows - 1 - tail];
+		struct cacheLine *line = &lines[number_lines - 1 - tail];
+		if (row->size != line->length || memcmp(row->chars, data + line->offset, line->length) != 0) break;
+		tail++;
+	}
+	int old_count = rows - head - tail, new_count = number_lines - head - tail;
+	uint64_t *old_hashes = malloc(sizeof(uint64_t) * (old_count + 1));
+	uint64_t *new_hashes = malloc(sizeof(uint64_t) * (new_count + 1));
+	struct diffHunk *hunks = NULL;
+	int number_hunks = 0;
+	if (old_hashes && new_hashes) {
+		for (int i = 0; i < old_count; i++)
+			old_hashes[i] = lineHash(g_Configuration.rows[head + i].chars, g_Configuration.rows[head + i].size);
+		for (int i = 0; i < new_count; i++)
+			new_hashes[i] = lineHash(data + lines[head + i].offset, lines[head + i].length);
+		number_hunks = diffLines(old_hashes, old_count, new_hashes, new_count, &hunks);
+	}
+	free(old_hashes);
+	free(new_hashes);
+	if ((old_count || new_count) && hunks == NULL) {
+		free(lines);
+		fileDataFree(data, data_size);
+		return -1;
+	}
+	
+	int cursor_y = diffMapRow(g_Configuration.cursorY, hunks, number_hunks, head);
+	int rows_off = diffMapRow(g_Configuration.rowsOff, hunks, number_hunks, head);
+	int mark_y = diffMapRow(g_Configuration.markY, hunks, number_hunks, head);
+	
+	// bottom up, so the hunks above still start where they say.
+	int changed = 0, failed = 0;
+	for (int i = number_hunks - 1; i >= 0; i--) {
+		struct diffHunk *hunk = &hunks[i];
+		int at = head + hunk->oldStart;
+		ROW *fresh = malloc(sizeof(ROW) * (hunk->newCount + 1));
+		if (fresh == NULL) {
+			failed = 1;
+			continue;
+		}
+		for (int j = 0; j < hunk->newCount; j++) {
+			struct cacheLine *line = &lines[head + hunk->newStart + j];
+			fresh[j] = rowNew(data + line->offset, line->length);
+		}
+		// the new rows go in below the old ones before those are dropped, so a failure leaves the hunk as it was.
+		if (insertRows(at + hunk->oldCount, fresh, hunk->newCount) == -1) {
+			rowsFree(fresh, hunk->newCount);
+			failed = 1;
+			continue;
+		}
+		free(fresh);
+		deleteRows(at, hunk->oldCount);
+		changed += hunk->oldCount > hunk->newCount ? hunk->oldCount : hunk->newCount;
+	}
+	free(hunks);
+	free(lines);
+	fileDataFree(data, data_size);
+	
+	g_Configuration.cursorY = cursor_y < g_Configuration.numberRows ? cursor_y : g_Configuration.numberRows;
+	g_Configuration.rowsOff = rows_off < g_Configuration.numberRows ? rows_off : 0;
+	g_Configuration.markY = mark_y < g_Configuration.numberRows ? mark_y : 0;
+	size_t row_size = g_Configuration.cursorY < g_Configuration.numberRows ? g_Configuration.rows[g_Configuration.cursorY].size : 0;
+	if (g_Configuration.cursorX > row_size) g_Configuration.cursorX = row_size;
+	
+	if (failed) {
+		g_Configuration.dirty++;
+		g_Configuration.diskChanged = 1;
+		errno = ENOMEM;
+		return -1;
+	}
+	g_Configuration.dirty = 0;
+	g_Configuration.diskChanged = 0;
+	g_Configuration.diskTime = file_stat.st_mtim;
+	g_Configuration.diskSize = file_stat.st_size;
+	return changed;
 }
 
-int syntaxToColour(int highlight) {
-	switch (highlight) {
-		case HL_KEYWORD1:
-			return 94;
-		case HL_KEYWORD2:
-			return 92;
-		case HL_KEYWORD3:
-			return 33;
-		case HL_COMMENT:
-			return 90;
-		case HL_NUMBER:
-			return 91;
-		case HL_STRING:
-			return 35;
-		case HL_MATCH:
-			return 34;
-		default:
-			return 37;
+// starts watching the active buffer's file, and takes note of what is on disk right now.
+void fileWatch(void) {
+	if (g_Configuration.filename == NULL || g_Configuration.bufferType != BT_FILE) return;
+	fileStamp();
+	if (g_inotify == -1) {
+		g_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (g_inotify == -1) return;
+		watchAdd(g_inotify, filePoll);
 	}
-	return -1;
+	// a file replaced by rename is a new inode: the watch has to follow the name, hence the SELF events.
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+	if (g_Configuration.follow) mask |= IN_MODIFY;
+	int watch = inotify_add_watch(g_inotify, g_Configuration.filename, mask);
+	if (watch != -1)
+		g_Configuration.watch = watch;
+	return;
+}
+// another buffer may still be on the same inode (same wd), it keeps it then.
+static void watchDrop(int watch) {
+	if (watch == -1) return;
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct editorConfig *buffer = bufferAt(i);
+		if (i != g_currentBuffer && (buffer->watch == watch || buffer->followDirectory == watch))
+			return;
+	}
+	inotify_rm_watch(g_inotify, watch);
+	return;
+}
+void fileUnwatch(void) {
+	watchDrop(g_Configuration.watch);
+	g_Configuration.watch = -1;
+	return;
 }
 
-void selectSyntaxHighlight(void) {
-	g_Configuration.syntax = NULL;
-	if (g_Configuration.filename == NULL) return;
-	char *ext = strrchr(g_Configuration.filename, '.');	
-	for (unsigned int i = 0; i < HIGHLIGHT_ENTRIES; i++) {
-		struct langSyntax *syntax =  &g_highlightDatabase[i];
-		unsigned int y = 0;
-		while (syntax->filematch[y]) {
-			int is_extension = (syntax->filematch[y][0] == '.');
-			if ((is_extension && ext && !strcmp(ext, syntax->filematch[y])) ||
-				(!is_extension && strstr(g_Configuration.filename, syntax->filematch[y]))) {
-				g_Configuration.syntax = syntax;
-				int fileRow;
-				for (fileRow = 0; fileRow < g_Configuration.numberRows; fileRow++) {
-					updateSyntax(&g_Configuration.rows[fileRow]);
+// the file behind the active buffer was written by someone else.
+static void fileChanged(void) {
+	struct stat file_stat;
+	if (stat(g_Configuration.filename, &file_stat) == -1) {
+		setStatusMessage("%s was removed from the disk.", g_Configuration.filename);
+		return;
+	}
+	// our own save, or nothing that matters.
+	if (file_stat.st_size == g_Configuration.diskSize && file_stat.st_mtim.tv_sec == g_Configuration.diskTime.tv_sec &&
+		file_stat.st_mtim.tv_nsec == g_Configuration.diskTime.tv_nsec)
+		return;
+	if (g_Configuration.partial) return;
+	if (g_Configuration.dirty) {
+		g_Configuration.diskChanged = 1;
+		setStatusMessage("%s changed on disk! Your edits are kept: revert to take the new one, save to overwrite it.", g_Configuration.filename);
+		return;
+	}
+	int changed = fileReload();
+	if (changed < 0) setStatusMessage("%s changed on disk, but it couldn't be read again.", g_Configuration.filename);
+	else             setStatusMessage("%s changed on disk, %d lines updated.", g_Configuration.filename, changed);
+	return;
+}
+int filePoll(void) {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed[MAX_WATCHED_CHANGES], rotated[MAX_WATCHED_CHANGES], number_changed = 0;
+	ssize_t nread;
+	while ((nread = read(g_inotify, events, sizeof(events))) > 0) {
+		for (char *at = events; at < events + nread; ) {
+			struct inotify_event *event = (struct inotify_event *)at;
+			at += sizeof(struct inotify_event) + event->len;
+			for (int i = 0; i < g_numberBuffers; i++) {
+				struct editorConfig *buffer = bufferAt(i);
+				int rotation = 0;
+				if (buffer->follow && buffer->followDirectory == event->wd) {
+					// something else now has the followed file's name.
+					char *name = strrchr(buffer->filename, '/');
+					name = name ? name + 1 : buffer->filename;
+					if (!event->len || strcmp(event->name, name) != 0 || !(event->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+					rotation = 1;
+				} else if (buffer->watch != event->wd)
+					continue;
+				else if (!buffer->follow && (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))) {
+					if (!(event->mask & IN_IGNORED)) inotify_rm_watch(g_inotify, buffer->watch);
+					buffer->watch = -1;
 				}
-				return;
+				int seen = -1;
+				for (int j = 0; j < number_changed; j++)
+					if (changed[j] == i) seen = j;
+				if (seen == -1 && number_changed < MAX_WATCHED_CHANGES) {
+					seen = number_changed++;
+					changed[seen] = i;
+					rotated[seen] = 0;
+				}
+				if (seen != -1) rotated[seen] |= rotation;
 			}
-			y++;
 		}
 	}
+	
+	int previous = g_currentBuffer;
+	for (int i = 0; i < number_changed; i++) {
+		bufferActivate(changed[i]);
+		if (g_Configuration.follow) {
+			followUpdate(rotated[i]);
+			continue;
+		}
+		// the name may point to a new file by now, so watch it again.
+		if (g_Configuration.watch == -1) {
+			struct timespec disk_time = g_Configuration.diskTime;
+			off_t disk_size = g_Configuration.diskSize;
+			fileWatch();
+			g_Configuration.diskTime = disk_time;
+			g_Configuration.diskSize = disk_size;
+		}
+		fileChanged();
+	}
+	bufferActivate(previous);
+	return number_changed > 0;
 }
 
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:?", c) != NULL;
+void revert(void) {
+	if (g_Configuration.filename == NULL || g_Configuration.bufferType != BT_FILE) {
+		setStatusMessage("This buffer is not visiting a file.");
+		return;
+	}
+	if (g_Configuration.partial) {
+		setStatusMessage("The file is not fully loaded.");
+		return;
+	}
+	int changed = fileReload();
+	if (changed < 0) setStatusMessage("Can't read %s: %s", g_Configuration.filename, strerror(errno));
+	else             setStatusMessage("%s reverted, %d lines updated.", g_Configuration.filename, changed);
+	return;
 }
-void updateSyntax(ROW *row) {
-	row->highlight = realloc(row->highlight, row->rsize);
-	memset(row->highlight, HL_NORMAL, row->rsize);
-	if (g_Configuration.syntax == NULL) return;
-	char **keywords = g_Configuration.syntax->keywords;
-	char *scs = g_Configuration.syntax->singleline_comment_start;
-	int scs_length = scs ? strlen(scs) : 0;
-	int prev_sep = 1; int in_string = 0;
-	int i = 0;
+
+// one line (without its '\n') read by followRead(): either the rest of the last row or a new row.
+static void followLine(struct ABUF *line, int *extend, ROW **rows, int *count, int *capacity) {
+	size_t length = line->length;
+	while (length > 0 && line->buffer[length - 1] == '\r')
+		length--;
+	if (*extend && g_Configuration.numberRows > 0) {
+		rowAppendString(&g_Configuration.rows[g_Configuration.numberRows - 1], line->buffer ? line->buffer : "", length);
+	} else {
+		if (*count == *capacity) {
+			*capacity = *capacity ? *capacity * 2 : 64;
+			ROW *grown = realloc(*rows, sizeof(ROW) * *capacity);
+			if (grown == NULL) error("realloc");
+			*rows = grown;
+		}
+		(*rows)[(*count)++] = rowNew(line->buffer ? line->buffer : "", length);
+	}
+	*extend = 0;
+	line->length = 0;
+	return;
+}
+// appends what was written to the followed file since the last time, with a single insertRows().
+// only the new bytes are read, so the work is the size of the append, not of the file.
+static int followRead(void) {
+	struct stat file_stat;
+	if (g_Configuration.followFd == -1 || fstat(g_Configuration.followFd, &file_stat) == -1) return 0;
+	if (file_stat.st_size < g_Configuration.followOffset) {
+		// truncated in place (copytruncate rotation, '>' redirection): start over from its beginning.
+		g_Configuration.followOffset = 0;
+		g_Configuration.followTail = 0;
+		setStatusMessage("%s was truncated.", g_Configuration.filename);
+	}
+	if (file_stat.st_size == g_Configuration.followOffset) return 0;
 	
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_highlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
-		if (scs_length && !in_string) {
-			if (!strncmp(&row->render[i], scs, scs_length)) {
-				memset(&row->highlight[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
+	char *block = malloc(LOAD_READ_SIZE);
+	if (block == NULL) return 0;
+	int pinned = g_Configuration.cursorY >= g_Configuration.numberRows - 1;
+	int dirty = g_Configuration.dirty;
+	struct ABUF line = ABUF_INIT;
+	ROW *rows = NULL;
+	int count = 0, capacity = 0, extend = g_Configuration.followTail;
+	ssize_t nread;
+	while ((nread = pread(g_Configuration.followFd, block, LOAD_READ_SIZE, g_Configuration.followOffset)) > 0) {
+		g_Configuration.followOffset += nread;
+		for (ssize_t start = 0; start < nread; ) {
+			char *newline = memchr(block + start, '\n', nread - start);
+			ssize_t end = newline ? newline - block : nread;
+			if (end > start)
+				bufferAppend(&line, block + start, end - start);
+			start = end + 1;
+			if (newline)
+				followLine(&line, &extend, &rows, &count, &capacity);
 		}
-		if (g_Configuration.syntax->flags & HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->highlight[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->highlight[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string) in_string = 0;
-				prev_sep = 1;
-				i++;
-				continue;
-			} else {
-				if (c == '"' || c == '\'') {
-          			row->highlight[i] = HL_STRING;
-					in_string = c;
-					i++;
-					continue;
+	}
+	g_Configuration.followTail = line.length > 0;
+	if (line.length > 0)
+		followLine(&line, &extend, &rows, &count, &capacity);
+	if (insertRows(g_Configuration.numberRows, rows, count) == -1) {
+		rowsFree(rows, count);
+		setStatusMessage("No room for the new lines of %s, they are not shown.", g_Configuration.filename);
+	} else
+		free(rows);
+	free(line.buffer);
+	free(block);
+	
+	g_Configuration.dirty = dirty;
+	if (pinned && g_Configuration.numberRows > 0) {
+		g_Configuration.cursorY = g_Configuration.numberRows - 1;
+		g_Configuration.cursorX = 0;
+	}
+	memoryCheck();
+	return 1;
+}
+void followUpdate(int rotated) {
+	followRead();
+	if (!rotated) return;
+	// the old file is done with (what was still written to it is in), the new one is read from its start.
+	int fd = open(g_Configuration.filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return;
+	close(g_Configuration.followFd);
+	g_Configuration.followFd = fd;
+	g_Configuration.followOffset = 0;
+	g_Configuration.followTail = 0;
+	fileUnwatch();
+	fileWatch();
+	followRead();
+	setStatusMessage("%s was rotated, following the new one.", g_Configuration.filename);
+	return;
+}
+void followStop(void) {
+	if (!g_Configuration.follow) return;
+	g_Configuration.follow = 0;
+	close(g_Configuration.followFd);
+	g_Configuration.followFd = -1;
+	watchDrop(g_Configuration.followDirectory);
+	g_Configuration.followDirectory = -1;
+	if (g_Configuration.watch != -1)
+		fileWatch(); // back to the plain mask, and to the disk as it is now.
+	return;
+}
+void follow(void) {
+	if (g_Configuration.follow) {
+		followStop();
+		setStatusMessage("Stopped following %s.", g_Configuration.filename);
+		return;
+	}
+	if (g_Configuration.filename == NULL || g_Configuration.bufferType != BT_FILE) {
+		setStatusMessage("This buffer is not visiting a file.");
+		return;
+	}
+	if (g_Configuration.partial) {
+		setStatusMessage("The file is not fully loaded.");
+		return;
+	}
+	if (g_Configuration.codec) {
+		setStatusMessage("%s is compressed, it can't be followed.", g_Configuration.filename);
+		return;
+	}
+	int fd = open(g_Configuration.filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		setStatusMessage("Can't follow %s: %s", g_Configuration.filename, strerror(errno));
+		return;
+	}
+	g_Configuration.follow = 1;
+	g_Configuration.followFd = fd;
+	// the buffer holds the file as it was when read last; what came after that is appended right away.
+	g_Configuration.followOffset = g_Configuration.diskSize > 0 ? g_Configuration.diskSize : 0;
+	char last = '\n';
+	g_Configuration.followTail = g_Configuration.followOffset > 0 &&
+								 pread(fd, &last, 1, g_Configuration.followOffset - 1) == 1 && last != '\n';
+	
+	fileWatch();
+	char *directory_path = strdup(g_Configuration.filename);
+	if (directory_path && g_inotify != -1)
+		g_Configuration.followDirectory = inotify_add_watch(g_inotify, dirname(directory_path), IN_CREATE | IN_MOVED_TO);
+	free(directory_path);
+	
+	g_Configuration.cursorY = g_Configuration.numberRows > 0 ? g_Configuration.numberRows - 1 : 0;
+	g_Configuration.cursorX = 0;
+	followRead();
+	setStatusMessage("Following %s, move up to stop scrolling with it.", g_Configuration.filename);
+	return;
+}
+
+// reads the whole file once, noting where every VIEW_CHECKPOINT_LINES-th line starts.
+static void *viewIndexer(void *argument) {
+	struct viewIndex *view = argument;
+	char *block = malloc(LOAD_READ_SIZE);
+	off_t offset = 0, reported = 0;
+	long long lines = 0;
+	ssize_t nread = 0;
+	char last = '\n';
+	while (block && !atomic_load(&view->cancel) && (nread = pread(view->fd, block, LOAD_READ_SIZE, offset)) > 0) {
+		for (char *at = block, *end = block + nread; (at = memchr(at, '\n', end - at)) != NULL; at++) {
+			lines++;
+			if (lines % VIEW_CHECKPOINT_LINES == 0) {
+				pthread_mutex_lock(&view->lock);
+				if (view->numberCheckpoints == view->capacity) {
+					long long capacity = view->capacity * 2;
+					off_t *grown = realloc(view->checkpoints, sizeof(off_t) * capacity);
+					if (grown) {
+						view->checkpoints = grown;
+						view->capacity = capacity;
+					}
 				}
+				if (view->numberCheckpoints < view->capacity)
+					view->checkpoints[view->numberCheckpoints++] = offset + (at - block) + 1;
+				pthread_mutex_unlock(&view->lock);
 			}
 		}
-		if (g_Configuration.syntax->flags & HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (prev_sep || prev_highlight == HL_NUMBER)) || (c == '.' && prev_highlight == HL_NUMBER)) {
-				row->highlight[i] = HL_NUMBER;
-				prev_sep = 0;
-				i++;
-				continue;
-			}
+		last = block[nread - 1];
+		offset += nread;
+		atomic_store(&view->indexed, offset);
+		if (offset - reported >= VIEW_REPORT_BYTES) {
+			reported = offset;
+			write(g_viewNotify[1], "", 1);
 		}
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				int kw3 = keywords[j][klen - 1] == '/';
-				if (kw2) klen--; if (kw3) klen--;
-				if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-//					memset(&row->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					if (kw2)
-						memset(&row->highlight[i], HL_KEYWORD2, klen);
-					else if (kw3)
-						memset(&row->highlight[i], HL_KEYWORD3, klen);
-					else
-						memset(&row->highlight[i], HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
-			}
+	}
+	free(block);
+	pthread_mutex_lock(&view->lock);
+	view->lines = lines + (offset > 0 && last != '\n');
+	view->done = nread == 0 ? 1 : -1;
+	pthread_mutex_unlock(&view->lock);
+	write(g_viewNotify[1], "", 1);
+	return NULL;
+}
+int viewPoll(void) {
+	char drain[64];
+	while (read(g_viewNotify[0], drain, sizeof(drain)) > 0);
+	int previous = g_currentBuffer;
+	for (int i = 0; i < g_numberBuffers; i++) {
+		struct viewIndex *view = bufferAt(i)->view;
+		if (view == NULL || view->done == 0 || view->announced) continue;
+		view->announced = 1;
+		bufferActivate(i);
+		if (view->done == 1) setStatusMessage("%s indexed, %lld lines.", g_Configuration.filename, view->lines);
+		else                 setStatusMessage("Indexing %s failed, only part of it can be reached.", g_Configuration.filename);
+		bufferActivate(previous);
+	}
+	return 1;
+}
+static struct viewIndex *viewIndexStart(int fd, off_t size) {
+	if (g_viewNotify[0] == -1) {
+		if (pipe2(g_viewNotify, O_NONBLOCK | O_CLOEXEC) == -1) return NULL;
+		watchAdd(g_viewNotify[0], viewPoll);
+	}
+	struct viewIndex *view = calloc(1, sizeof(struct viewIndex));
+	if (view == NULL) return NULL;
+	view->fd = fd;
+	view->size = size;
+	view->capacity = 1024;
+	view->checkpoints = malloc(sizeof(off_t) * view->capacity);
+	if (view->checkpoints == NULL) {
+		free(view);
+		return NULL;
+	}
+	view->checkpoints[0] = 0; // line 0, so there is always somewhere to start from.
+	view->numberCheckpoints = 1;
+	pthread_mutex_init(&view->lock, NULL);
+	if (pthread_create(&view->thread, NULL, viewIndexer, view) != 0) {
+		pthread_mutex_destroy(&view->lock);
+		free(view->checkpoints);
+		free(view);
+		return NULL;
+	}
+	return view;
+}
+void viewIndexFree(struct viewIndex *view) {
+	atomic_store(&view->cancel, 1);
+	pthread_join(view->thread, NULL);
+	pthread_mutex_destroy(&view->lock);
+	close(view->fd);
+	free(view->checkpoints);
+	free(view);
+	return;
+}
+
+// only VIEW_MAP_BYTES of the file are mapped at any time, moved along as lines are read.
+struct viewReader {
+	struct viewIndex *view;
+	char *map;
+	off_t mapStart;
+	size_t mapLength;
+	off_t position;
+	int skipping; // in the rest of a line too long for the map, which was cut.
+};
+static int viewMap(struct viewReader *reader, off_t offset) {
+	if (reader->map) munmap(reader->map, reader->mapLength);
+	reader->map = NULL;
+	off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	if (start >= reader->view->size) return 0;
+	size_t length = reader->view->size - start < VIEW_MAP_BYTES ? (size_t)(reader->view->size - start) : VIEW_MAP_BYTES;
+	char *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, reader->view->fd, start);
+	if (map == MAP_FAILED) return 0;
+	madvise(map, length, MADV_SEQUENTIAL);
+	reader->map = map;
+	reader->mapStart = start;
+	reader->mapLength = length;
+	return 1;
+}
+// the next line, without its line ending. 0 at the end of the file.
+static int viewReadLine(struct viewReader *reader, const char **line, size_t *length) {
+	while (reader->position < reader->view->size) {
+		if (reader->map == NULL || reader->position < reader->mapStart || reader->position >= reader->mapStart + (off_t)reader->mapLength)
+			if (!viewMap(reader, reader->position)) return 0;
+		off_t map_end = reader->mapStart + reader->mapLength;
+		char *start = reader->map + (reader->position - reader->mapStart);
+		char *newline = memchr(start, '\n', map_end - reader->position);
+		if (newline == NULL && map_end < reader->view->size && reader->position - reader->mapStart >= (off_t)sysconf(_SC_PAGESIZE)) {
+			// it goes on past the map: map again from where it starts.
+			if (!viewMap(reader, reader->position)) return 0;
+			continue;
 		}
-		prev_sep = is_separator(c);
-		i++;
+		size_t size = newline ? (size_t)(newline - start) : (size_t)(map_end - reader->position);
+		reader->position += size + (newline != NULL);
+		if (reader->skipping) {
+			reader->skipping = newline == NULL;
+			continue;
+		}
+		reader->skipping = newline == NULL && reader->position < reader->view->size;
+		while (size > 0 && start[size - 1] == '\r')
+			size--;
+		*line = start;
+		*length = size;
+		return 1;
 	}
+	return 0;
+}
+static void viewReaderEnd(struct viewReader *reader) {
+	if (reader->map) munmap(reader->map, reader->mapLength);
+	reader->map = NULL;
+	return;
+}
+// the nearest checkpoint at or before 'line': its line number and where it is in the file.
+static long long viewCheckpoint(struct viewIndex *view, long long line, off_t *offset) {
+	pthread_mutex_lock(&view->lock);
+	long long checkpoint = line / VIEW_CHECKPOINT_LINES;
+	if (checkpoint >= view->numberCheckpoints) checkpoint = view->numberCheckpoints - 1;
+	*offset = view->checkpoints[checkpoint];
+	pthread_mutex_unlock(&view->lock);
+	return checkpoint * VIEW_CHECKPOINT_LINES;
 }
 
-void updateRow(ROW *row) {
-	int tabs = 0;
-	
-	for (int i = 0; i < row->size; i++)
-	if (row->chars[i] == '\t')
-		tabs++;
-	free(row->render);
+// fills the buffer with the VIEW_WINDOW_ROWS lines around 'line', the cursor keeping its place in the file.
+void viewLoad(long long line) {
+	struct viewIndex *view = g_Configuration.view;
+	long long first = line - VIEW_WINDOW_ROWS / 2;
+	pthread_mutex_lock(&view->lock);
+	if (view->done == 1 && first > view->lines - VIEW_WINDOW_ROWS) first = view->lines - VIEW_WINDOW_ROWS;
+	pthread_mutex_unlock(&view->lock);
+	if (first < 0) first = 0;
 	
-	row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
-	int index = 0;
-	for (int i = 0; i < row->size; i++) {
-		if (row->chars[i] == '\t') {
-			row->render[index++] = ' ';
-			while (index % TAB_STOP != 0)
-				row->render[index++] = ' ';
-		} else {
-			row->render[index++] = row->chars[i];
-		}
+	struct viewReader reader = { view, NULL, 0, 0, 0, 0 };
+	long long at = viewCheckpoint(view, first, &reader.position);
+	const char *text;
+	size_t length;
+	while (at < first && viewReadLine(&reader, &text, &length))
+		at++;
+	if (at < first) {
+		// past the end of a file that is still being indexed: take its last lines instead.
+		viewReaderEnd(&reader);
+		first = at - VIEW_WINDOW_ROWS > 0 ? at - VIEW_WINDOW_ROWS : 0;
+		at = viewCheckpoint(view, first, &reader.position);
+		reader.skipping = 0;
+		while (at < first && viewReadLine(&reader, &text, &length))
+			at++;
 	}
 	
-	row->render[index] = '\0';
-	row->rsize = index;
+	ROW *rows = malloc(sizeof(ROW) * VIEW_WINDOW_ROWS);
+	int count = 0;
+	while (rows && count < VIEW_WINDOW_ROWS && viewReadLine(&reader, &text, &length))
+		rows[count++] = rowNew(text, length);
+	viewReaderEnd(&reader);
+	if (rows == NULL) return;
 	
-	updateSyntax(row);
+	long long shift = first - g_Configuration.viewFirst;
+	for (int i = 0; i < g_Configuration.numberRows; i++)
+		freeRow(&g_Configuration.rows[i]);
+	free(g_Configuration.rows);
+	g_Configuration.rows = rows;
+	g_Configuration.numberRows = count;
+	g_Configuration.viewFirst = first;
+	
+	long long cursor_y = g_Configuration.cursorY - shift, rows_off = g_Configuration.rowsOff - shift;
+	g_Configuration.cursorY = cursor_y < 0 ? 0 : (cursor_y > count ? count : cursor_y);
+	g_Configuration.rowsOff = rows_off < 0 ? 0 : (rows_off > g_Configuration.cursorY ? g_Configuration.cursorY : rows_off);
+	g_Configuration.markSet = 0;
+	size_t row_size = g_Configuration.cursorY < count ? rows[g_Configuration.cursorY].size : 0;
+	if (g_Configuration.cursorX > row_size) g_Configuration.cursorX = row_size;
+	return;
+}
+// moves the window along once the cursor gets close to one of its ends.
+void viewSlide(void) {
+	if (g_Configuration.view == NULL) return;
+	int at_start = g_Configuration.viewFirst == 0;
+	int at_end = g_Configuration.numberRows < VIEW_WINDOW_ROWS;
+	if ((!at_start && g_Configuration.cursorY < VIEW_MARGIN) ||
+		(!at_end && g_Configuration.cursorY > g_Configuration.numberRows - VIEW_MARGIN))
+		viewLoad(g_Configuration.viewFirst + g_Configuration.cursorY);
+	return;
+}
+void viewGoto(long long line) {
+	if (line < 0) line = 0;
+	g_Configuration.cursorY = 0;
+	g_Configuration.rowsOff = 0;
+	g_Configuration.viewFirst = line; // so the cursor lands on 'line' once the window is there.
+	viewLoad(line);
+	g_Configuration.cursorX = 0;
+	centerScreen();
+	setStatusMessage("Cursor placed in %lld line.", g_Configuration.viewFirst + g_Configuration.cursorY);
 	return;
 }
 
-void editorScroll(void) {
-    g_Configuration.renderX = 0;
-    if (g_Configuration.cursorY < g_Configuration.numberRows)
-	g_Configuration.renderX = rowCxToRx(&g_Configuration.rows[g_Configuration.cursorY], g_Configuration.cursorX);
-    
-    if (g_Configuration.cursorY < g_Configuration.rowsOff) g_Configuration.rowsOff = g_Configuration.cursorY;
-    if (g_Configuration.cursorY >= g_Configuration.rowsOff + g_Configuration.screenRows) g_Configuration.rowsOff = g_Configuration.cursorY - g_Configuration.screenRows + 1;
- 	
-	if (g_Configuration.cursorX < g_Configuration.colsOff) {
-		g_Configuration.colsOff = g_Configuration.cursorX;
+// looks for 'query' in the lines of checkpoint block 'block' from line 'from' on (direction > 0),
+// or up to line 'from' (direction < 0). 1 and the line and byte in it when found, -1 when the indexer
+// has not found where the block ends yet.
+static int viewSearchBlock(struct viewIndex *view, long long block, const char *query, size_t query_length,
+						   long long from, int direction, long long *match_line, size_t *match_offset) {
+	off_t start = 0, end = -1;
+	pthread_mutex_lock(&view->lock);
+	int known = block < view->numberCheckpoints, done = view->done;
+	if (known) {
+		start = view->checkpoints[block];
+		end = block + 1 < view->numberCheckpoints ? view->checkpoints[block + 1] : (done != 0 ? view->size : -1);
 	}
-	if (g_Configuration.cursorX >= g_Configuration.colsOff + g_Configuration.screenCols) {
-		g_Configuration.colsOff = g_Configuration.cursorX - g_Configuration.screenCols + 1;
+	pthread_mutex_unlock(&view->lock);
+	if ((!known || end == -1) && done == 0) return -1;
+	if (!known || end <= start) return 0;
+	
+	off_t map_start = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	char *map = mmap(NULL, end - map_start, PROT_READ, MAP_PRIVATE, view->fd, map_start);
+	if (map == MAP_FAILED) return 0;
+	madvise(map, end - map_start, MADV_SEQUENTIAL);
+	char *at = map + (start - map_start), *limit = map + (end - map_start);
+	long long line = block * VIEW_CHECKPOINT_LINES;
+	
+	// forward, the search starts at line 'from'. backward it stops before the line after it.
+	char *search_start = at, *search_end = limit;
+	long long skip = (direction > 0 ? from : from + 1) - line;
+	char *position = at;
+	for (long long i = 0; i < skip && position < limit; i++) {
+		char *newline = memchr(position, '\n', limit - position);
+		position = newline ? newline + 1 : limit;
 	}
-    return;
+	if (direction > 0) search_start = position;
+	else               search_end = position;
+	
+	char *found = NULL;
+	for (char *match = search_start; (size_t)(search_end - match) >= query_length &&
+		 (match = memmem(match, search_end - match, query, query_length)) != NULL; match++) {
+		found = match;
+		if (direction > 0) break;
+	}
+	if (found) {
+		char *line_start = at;
+		for (char *newline; (newline = memchr(line_start, '\n', found - line_start)) != NULL; line_start = newline + 1)
+			line++;
+		*match_line = line;
+		*match_offset = found - line_start;
+	}
+	munmap(map, end - map_start);
+	return found != NULL;
+}
+// the next match of 'query' after (or before) absolute line 'from', in the whole file. the window is moved
+// there and its row returned, 0 when there is none and -1 if a keypress came first.
+int viewSearch(const char *query, long long from, int direction, int *match_row, size_t *match_offset) {
+	struct viewIndex *view = g_Configuration.view;
+	size_t query_length = strlen(query);
+	if (query_length == 0) return 0;
+	long long line = from + direction;
+	if (line < 0) return 0;
+	for (long long block = line / VIEW_CHECKPOINT_LINES; block >= 0; block += direction) {
+		long long match_line;
+		size_t offset;
+		int found = viewSearchBlock(view, block, query, query_length, line, direction, &match_line, &offset);
+		if (found == -1) {
+			// still being indexed: wait for the indexer to get past this block rather than miss what is in it.
+			if (inputPending()) return -1;
+			poll(NULL, 0, 20);
+			block -= direction;
+			continue;
+		}
+		if (found) {
+			viewLoad(match_line);
+			*match_row = match_line - g_Configuration.viewFirst;
+			*match_offset = offset;
+			return 1;
+		}
+		pthread_mutex_lock(&view->lock);
+		int last = block + 1 >= view->numberCheckpoints && view->done != 0;
+		pthread_mutex_unlock(&view->lock);
+		if (direction > 0 && last) return 0;
+		if (inputPending()) return -1;
+		line = direction > 0 ? (block + 1) * VIEW_CHECKPOINT_LINES : block * VIEW_CHECKPOINT_LINES - 1;
+	}
+	return 0;
 }
 
-void backupSave(void) {
-	if (g_Configuration.filename == NULL)
+// where byte 'offset' of the file is: in the viewer through the index, otherwise by walking the rows.
+void gotoByte(long long offset) {
+	if (offset < 0) offset = 0;
+	if (g_Configuration.view == NULL) {
+		int y = 0;
+		while (y < g_Configuration.numberRows && (size_t)offset > g_Configuration.rows[y].size) {
+			offset -= g_Configuration.rows[y].size + 1;
+			y++;
+		}
+		gotoLine(y);
+		g_Configuration.cursorX = y < g_Configuration.numberRows ? offset : 0;
 		return;
-	int length;
-	char *buffer = rowsToString(&length);
-	
-	int backup_length = strlen(g_Configuration.filename) + strlen(BACKUP_STRING) + 1;
-	char *backup_filename = (char*)malloc(backup_length);
+	}
+	struct viewIndex *view = g_Configuration.view;
+	if (offset > view->size) offset = view->size;
+	pthread_mutex_lock(&view->lock);
+	long long low = 0, high = view->numberCheckpoints - 1;
+	while (low < high) {
+		long long middle = (low + high + 1) / 2;
+		if (view->checkpoints[middle] <= offset) low = middle;
+		else                                     high = middle - 1;
+	}
+	struct viewReader reader = { view, NULL, 0, 0, view->checkpoints[low], 0 };
+	pthread_mutex_unlock(&view->lock);
 	
-	snprintf(backup_filename, backup_length, "%s%s", g_Configuration.filename, BACKUP_STRING);
-	int fd = open(backup_filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, length) != -1) {
-			if (write(fd, buffer, length) == length) {
-				close(fd); free(buffer);
-				
-				setStatusMessage("Backup saved successfully");
-				g_backupCounter = 0;
-				return;
-			}
-		}
-		close(fd);
+	long long line = low * VIEW_CHECKPOINT_LINES;
+	off_t line_start = reader.position;
+	const char *text;
+	size_t length;
+	while (viewReadLine(&reader, &text, &length) && reader.position <= offset) {
+		line++;
+		line_start = reader.position;
 	}
-	setStatusMessage("Failed at saving backup");
-	free(backup_filename);
-	free(buffer);
+	viewReaderEnd(&reader);
+	viewGoto(line);
+	size_t column = offset - line_start;
+	size_t row_size = g_Configuration.cursorY < g_Configuration.numberRows ? g_Configuration.rows[g_Configuration.cursorY].size : 0;
+	g_Configuration.cursorX = column < row_size ? column : row_size;
+	setStatusMessage("Cursor placed at byte %lld, line %lld.", offset, line);
 	return;
 }
-void save(void) {
-    if (g_Configuration.filename == NULL) {
-		g_Configuration.filename = prompt("Save new file as: %s", PC_SAVE, NULL);
-		if (g_Configuration.filename == NULL) {
-	    	setStatusMessage("Saving process aborted.");
-	    	return;
-		}
-		selectSyntaxHighlight();
-    }
-    int length;
-    char *buffer = rowsToString(&length);
-    
-    int fd = open(g_Configuration.filename, O_RDWR | O_CREAT, 0644);
-    ftruncate(fd, length);
-    if (fd != -1) {
-	if (ftruncate(fd, length) != -1) {
-	    if (write(fd, buffer, length) == length) {
+void goto_byte(void) {
+	char *input_number = prompt("Go to byte: %s", PC_GOTO, NULL);
+	if (input_number == NULL) {
+		setStatusMessage("Goto-byte operation aborted.");
+		return;
+	}
+	gotoByte(strtoll(input_number, NULL, 0));
+	free(input_number);
+	return;
+}
+
+// opens 'file_path' read-only in the viewer, whatever its size: only the lines around the cursor are in memory.
+void viewOpen(const char *file_path) {
+	if (codecDetect(file_path)) {
+		setStatusMessage("%s is compressed, only open can read it.", file_path);
+		return;
+	}
+	int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+	struct stat file_stat;
+	if (fd == -1 || fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+		setStatusMessage("Can't view %s: %s", file_path, fd == -1 ? strerror(errno) : "not a regular file");
+		if (fd != -1) close(fd);
+		return;
+	}
+	struct viewIndex *view = viewIndexStart(fd, file_stat.st_size);
+	if (view == NULL) {
 		close(fd);
-		free(buffer);
-		
-		setStatusMessage("%s saved! [%d bytes written to disk]", g_Configuration.filename, length);
-		g_Configuration.dirty = 0;
+		setStatusMessage("Failed to start indexing %s.", file_path);
 		return;
-	    }
 	}
-	close(fd);
-    }
-    setStatusMessage("Can't save :: Input/Output error: %s", strerror(errno));
-    free(buffer);
-    return;
+	if (!bufferIsScratch()) {
+		bufferLeave();
+		if (bufferNew() == -1) {
+			viewIndexFree(view);
+			setStatusMessage("Failed to allocate a new buffer.");
+			return;
+		}
+	}
+	free(g_Configuration.filename);
+	g_Configuration.filename = strdup(file_path);
+	g_Configuration.bufferType = BT_VIEW;
+	g_Configuration.view = view;
+	selectSyntaxHighlight();
+	viewLoad(0);
+	setStatusMessage("%s is open read-only, %lld MB.", file_path, (long long)(file_stat.st_size >> 20));
+	return;
+}
+void view(void) {
+	char *file_path = prompt("View file at: %s", PC_OPEN, NULL);
+	if (file_path == NULL) {
+		setStatusMessage("Viewing file operation aborted.");
+		return;
+	}
+	int index = bufferFindFile(file_path);
+	if (index != -1) bufferSwitch(index);
+	else             viewOpen(file_path);
+	free(file_path);
+	return;
 }
 
 void editorOpen(const char *file_path) {	
+	// already open: just go there, no need to read and highlight it all again.
+	int index = bufferFindFile(file_path);
+	if (index != -1) {
+		bufferSwitch(index);
+		return;
+	}
+	// what can't be loaded is viewed instead: anything over half the memory.
+	struct stat view_stat;
+	long long memory = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+	if (stat(file_path, &view_stat) == 0 && S_ISREG(view_stat.st_mode) && memory > 0 && view_stat.st_size > memory &&
+		codecDetect(file_path) == NULL) {
+		viewOpen(file_path);
+		return;
+	}
     FILE *file = fopen(file_path, "r");
     if (!file) {
 		setStatusMessage("File not found");
@@ -1379,45 +6993,121 @@ void editorOpen(const char *file_path) {
 //		else
 			// anything else
 //	}
-	init();
-	
-	free(g_Configuration.filename); g_Configuration.filename = strdup(file_path);
+	if (!bufferIsScratch()) {
+		bufferLeave();
+		if (bufferNew() == -1) {
+			setStatusMessage("Failed to allocate a new buffer.");
+			fclose(file);
+			return;
+		}
+	}
+	free(g_Configuration.filename);
 	g_Configuration.filename = strdup(file_path);
 	selectSyntaxHighlight();
 	
+	struct stat file_stat;
+	int regular = fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+	// compressed: the decompressor runs next to us, and rows are split off its output as it comes.
+	struct codec *codec = regular ? codecDetect(file_path) : NULL;
+	pid_t codec_pid = 0;
+	g_Configuration.codec = codec;
+	if (codec && file_stat.st_size > 0) {
+		int stream = codecOpen(codec, fileno(file), &codec_pid);
+		if (stream == -1) {
+			setStatusMessage("Can't run '%s': %s", codec->decompress, strerror(errno));
+			g_Configuration.partial = 1;
+			fclose(file);
+			return;
+		}
+		fclose(file);
+		file = fdopen(stream, "r");
+		regular = 0;
+	}
+	int cacheable = g_doCache && regular && file_stat.st_size >= CACHE_MIN_BYTES;
+	if (cacheable && cacheLoad(file_path, fileno(file), &file_stat)) {
+		g_Configuration.dirty = 0;
+		if (g_doBackups)
+			g_backupCounter = 0;
+		fclose(file);
+		fileWatch();
+		setStatusMessage("%s loaded from cache.", file_path);
+		return;
+	}
+	if ((codec_pid > 0 || (regular && file_stat.st_size >= LOAD_BACKGROUND_BYTES)) && loadStart(file_path, fileno(file), &file_stat, cacheable) == 0) {
+		g_load->codec = codec_pid;
+		g_Configuration.dirty = 0;
+		if (g_doBackups)
+			g_backupCounter = 0;
+		fclose(file);
+		fileWatch();
+		setStatusMessage("Loading %s... (ESC to stop)", file_path);
+		// a scripted run has to see the same rows every time.
+		if (g_headless.active)
+			loadWait();
+		return;
+	}
+	
     size_t capacity = 0;
     char *line = NULL;
     ssize_t length;
+	struct cacheLine *lines = NULL;
+	size_t lines_capacity = 0;
+	uint64_t offset = 0;
     
     while ((length = getline(&line, &capacity, file)) != -1) {
+		ssize_t raw_length = length;
 		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
 	    	length--;
 		insertRow(g_Configuration.numberRows, line, length);
+		if ((g_Configuration.numberRows & 4095) == 0)
+			memoryCheck();
+		
+		if (cacheable) {
+			if ((size_t)g_Configuration.numberRows > lines_capacity) {
+				lines_capacity = lines_capacity ? lines_capacity * 2 : 4096;
+				struct cacheLine *grown = realloc(lines, sizeof(struct cacheLine) * lines_capacity);
+				if (grown == NULL) cacheable = 0;
+				else               lines = grown;
+			}
+			if (cacheable) {
+				lines[g_Configuration.numberRows - 1].offset = offset;
+				lines[g_Configuration.numberRows - 1].length = length;
+			}
+		}
+		offset += raw_length;
     }
+	// getline() gives up the same way at the end and when a line does not fit in memory.
+	int failed = ferror(file);
+	if (failed) cacheable = 0;
+	if (cacheable)
+		cacheStoreOpened(file_path, fileno(file), &file_stat, lines);
+	free(lines);
     
     g_Configuration.dirty = 0;
 	if (g_doBackups)
 		g_backupCounter = 0;
     free(line);
     fclose(file);
+	if (codec_pid > 0 && codecWait(codec_pid) == -1) {
+		g_Configuration.partial = 1;
+		setStatusMessage("Decompressing %s failed, only %d lines could be read.", file_path, g_Configuration.numberRows);
+	} else if (failed) {
+		g_Configuration.partial = 1;
+		setStatusMessage("Reading %s failed, only %d lines could be read.", file_path, g_Configuration.numberRows);
+	}
+	fileWatch();
     return;
 }
 void init(void) {
-    g_Configuration.cursorX = 0; g_Configuration.cursorY = 0;
-    g_Configuration.renderX = 0;
-    
-    g_Configuration.rowsOff = 0;
-    g_Configuration.colsOff = 0;
-    
-    g_Configuration.numberRows = 0;
-    g_Configuration.rows = NULL;
+	bufferReset();
+	g_numberBuffers = 1;
+	g_currentBuffer = 0;
+	g_buffers = calloc(1, sizeof(struct editorConfig));
+	if (g_buffers == NULL)
+		error("calloc");
     
     g_Configuration.statusMessage[0] = '\0';
     g_Configuration.statusMessageTime = 0;
-    g_Configuration.dirty = 0;
-
-    g_Configuration.filename = NULL;
-	g_Configuration.syntax = NULL;
     
     if (getWindowSize(&g_Configuration.screenRows, &g_Configuration.screenCols) == -1)
         error("getWindowSize");
@@ -1425,8 +7115,21 @@ void init(void) {
     return;
 }
 
+// bench/charlie_bench.c includes this file and brings its own main.
+#ifndef CHARLIE_NO_MAIN
 int main(int argc, char *argv[]) {
-    enableRawMode();
+	if (getenv("CHARLIE_HEADLESS"))
+		headlessInit(getenv("CHARLIE_HEADLESS"));
+	else
+		enableRawMode();
+	eventInit();
+	if (getenv("CHARLIE_CACHE") && strcmp(getenv("CHARLIE_CACHE"), "0") != 0)
+		g_doCache = true;
+	if (getenv("CHARLIE_MEMORY_BUDGET"))
+		g_memoryBudget = atoll(getenv("CHARLIE_MEMORY_BUDGET")) * (1 << 20);
+	// CHARLIE_TRACE is where the trace goes, "1" for the default file.
+	if (getenv("CHARLIE_TRACE"))
+		traceStart(strcmp(getenv("CHARLIE_TRACE"), "1") != 0 && getenv("CHARLIE_TRACE")[0] ? getenv("CHARLIE_TRACE") : NULL);
     
     init();
     if (argc >= 2)
@@ -1434,7 +7137,12 @@ int main(int argc, char *argv[]) {
     setStatusMessage("Hello from Charlie!");
     while (1) {
 		refreshScreen();
+		unsigned int backup_counter = g_backupCounter;
 		keyPress();
+		viewSlide();
+		memoryCheck();
+		if (g_backupCounter != backup_counter)
+			g_lastEditTime = time(NULL);
 		
 		if (g_backupCounter >= BACKUP_NECESSARY_CHARACTERS)
 			// that's likely not the better way to implemenbt this, buddy
@@ -1442,3 +7150,4 @@ int main(int argc, char *argv[]) {
     }
     return 0;
 }
+#endif